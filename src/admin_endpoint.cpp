@@ -0,0 +1,164 @@
+#include "admin_endpoint.h"
+
+#ifdef _WIN32
+    #include <ws2tcpip.h>
+    #define close closesocket
+    #define ioctl ioctlsocket
+#else
+    #include <netdb.h>
+    #include <sys/ioctl.h>
+    #include <sys/socket.h>
+    #include <sys/time.h>
+    #include <unistd.h>
+    constexpr int INVALID_SOCKET = -1;
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace chatter {
+
+namespace {
+
+constexpr size_t MaxRequestBytes = 8192;
+constexpr int SendTimeoutMs = 100;
+
+} // namespace
+
+AdminEndpoint::AdminEndpoint(EventLoop& event_loop, const std::string& port, std::function<std::string()> render)
+    : event_loop_(&event_loop), render_(std::move(render))
+{
+    addrinfo hints;
+    addrinfo* servinfo;
+    int ret;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo("127.0.0.1", port.c_str(), &hints, &servinfo)) != 0)
+    {
+        fprintf(stderr, "admin getaddrinfo: %s\r\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    int yes = 1;
+    listen_fd_ = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (listen_fd_ == INVALID_SOCKET ||
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&yes), sizeof(int)) == -1 ||
+        bind(listen_fd_, servinfo->ai_addr, static_cast<int>(servinfo->ai_addrlen)) == -1 ||
+        listen(listen_fd_, 16) == -1)
+    {
+        perror("chatter-server: admin listener");
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(servinfo);
+    event_loop_->Add(listen_fd_, EventRead);
+}
+
+AdminEndpoint::~AdminEndpoint()
+{
+    for (const auto& request : requests_)
+    {
+        event_loop_->Remove(request.first);
+        close(request.first);
+    }
+    event_loop_->Remove(listen_fd_);
+    close(listen_fd_);
+}
+
+void AdminEndpoint::Handle(sock_t fd)
+{
+    if (fd == listen_fd_)
+    {
+        Accept();
+    }
+    else
+    {
+        Read(fd);
+    }
+}
+
+void AdminEndpoint::Accept()
+{
+    sock_t fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd == INVALID_SOCKET)
+    {
+        perror("chatter-server: admin accept");
+        return;
+    }
+    unsigned long int yes = 1;
+    ioctl(fd, FIONBIO, &yes);
+    requests_.emplace(fd, std::string());
+    event_loop_->Add(fd, EventRead);
+}
+
+void AdminEndpoint::Read(sock_t fd)
+{
+    std::string& request = requests_.at(fd);
+    char buffer[1024];
+    long nbytes = recv(fd, buffer, sizeof buffer, 0);
+    if (nbytes <= 0)
+    {
+        Close(fd);
+        return;
+    }
+    request.append(buffer, static_cast<size_t>(nbytes));
+    if (request.find("\r\n\r\n") != std::string::npos || request.find("\n\n") != std::string::npos)
+    {
+        Respond(fd, request);
+        Close(fd);
+    }
+    else if (request.size() > MaxRequestBytes)
+    {
+        Close(fd);
+    }
+}
+
+void AdminEndpoint::Respond(sock_t fd, const std::string& request)
+{
+    std::string status = "200 OK";
+    std::string body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0)
+    {
+        body = render_();
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "Not found.\n";
+    }
+    std::string response = "HTTP/1.0 " + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+
+    // The page can outgrow the socket buffer, so block briefly rather than
+    // queue it; a stalled scraper costs this shard at most the timeout.
+    unsigned long int no = 0;
+    ioctl(fd, FIONBIO, &no);
+#ifdef _WIN32
+    DWORD timeout = SendTimeoutMs;
+#else
+    timeval timeout{0, SendTimeoutMs * 1000};
+#endif
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<char*>(&timeout), sizeof timeout);
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        long nbytes = send(fd, response.data() + sent, static_cast<int>(response.size() - sent), 0);
+        if (nbytes <= 0)
+        {
+            break;
+        }
+        sent += static_cast<size_t>(nbytes);
+    }
+}
+
+void AdminEndpoint::Close(sock_t fd)
+{
+    event_loop_->Remove(fd);
+    close(fd);
+    requests_.erase(fd);
+}
+
+} // namespace chatter
@@ -0,0 +1,36 @@
+#ifndef CHATTER_ADMIN_ENDPOINT_H_
+#define CHATTER_ADMIN_ENDPOINT_H_
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include "event_loop.h"
+
+namespace chatter {
+
+// Minimal HTTP responder for metrics scrapes on a loopback port. It runs in
+// a shard's event loop; every request is answered in full and closed.
+class AdminEndpoint
+{
+    public:
+        AdminEndpoint(EventLoop& event_loop, const std::string& port, std::function<std::string()> render);
+        ~AdminEndpoint();
+        AdminEndpoint(const AdminEndpoint&) = delete;
+        AdminEndpoint& operator=(const AdminEndpoint&) = delete;
+        bool Owns(sock_t fd) const { return fd == listen_fd_ || requests_.count(fd) != 0; }
+        void Handle(sock_t fd);
+    private:
+        void Accept();
+        void Read(sock_t fd);
+        void Respond(sock_t fd, const std::string& request);
+        void Close(sock_t fd);
+        EventLoop* event_loop_;
+        sock_t listen_fd_;
+        std::function<std::string()> render_;
+        std::unordered_map<sock_t, std::string> requests_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_ADMIN_ENDPOINT_H_
@@ -0,0 +1,685 @@
+// Load generator for a running chatter server. Opens many local clients,
+// drives a weighted mix of chat lines, /join, /tell, /who and reconnects,
+// and reports throughput and end-to-end fan-out latency as one JSON object.
+// With --storm it instead opens every client at once and reports how long
+// the server takes to admit them all.
+//
+// Every chat line and /tell carries "BENCH <send time in ns>"; each copy a
+// client receives is one delivery and one latency sample. With --admin the
+// server's own write counters are scraped around the run as well. Given
+// several ports, e.g. the nodes of a federation, clients are spread over them
+// in turn and the result is the aggregate. With --binary every client
+// switches to the binary protocol once welcomed, and a frame that doesn't
+// parse counts as bad and closes the client.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_protocol.h"
+#include "event_loop.h"
+#include "histogram.h"
+#include "line_buffer.h"
+#include "wire_format.h"
+
+namespace {
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    std::vector<int> ports;
+    size_t clients = 1000;
+    double duration = 10;
+    double rate = 1;
+    size_t rooms = 10;
+    size_t max_connecting = 8;
+    std::vector<int> admin_ports;
+    bool storm = false;
+    bool binary = false;
+    double weights[5] = {90, 3, 3, 2, 2}; // chat, tell, who, join, reconnect
+    chatter::Backend backend = chatter::DefaultBackend;
+};
+
+enum Action
+{
+    CHAT,
+    TELL,
+    WHO,
+    JOIN,
+    RECONNECT,
+    ACTION_COUNT,
+};
+
+const char* ActionNames[ACTION_COUNT] = {"chat", "tell", "who", "join", "reconnect"};
+
+// Room for a /who of a few thousand members in one frame.
+constexpr size_t BinaryFrameLimit = 1 << 15;
+
+// Sums every sample of a Prometheus metric from the server's admin port.
+uint64_t ScrapeMetric(const std::string& host, int port, const std::string& name)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == -1)
+    {
+        perror("admin connect");
+        close(fd);
+        return 0;
+    }
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(fd, request, sizeof request - 1, 0);
+    std::string response;
+    char buffer[4096];
+    long nbytes;
+    while ((nbytes = recv(fd, buffer, sizeof buffer, 0)) > 0)
+    {
+        response.append(buffer, static_cast<size_t>(nbytes));
+    }
+    close(fd);
+    uint64_t total = 0;
+    size_t pos = 0;
+    while ((pos = response.find("\n" + name, pos)) != std::string::npos)
+    {
+        pos += name.size() + 1;
+        if (response[pos] == '{' || response[pos] == ' ')
+        {
+            size_t value = response.find(' ', pos);
+            total += strtoull(response.c_str() + value + 1, nullptr, 10);
+        }
+    }
+    return total;
+}
+
+uint64_t ScrapeMetric(const std::string& host, const std::vector<int>& ports, const std::string& name)
+{
+    uint64_t total = 0;
+    for (int port : ports)
+    {
+        total += ScrapeMetric(host, port, name);
+    }
+    return total;
+}
+
+std::vector<int> ParsePorts(const char* list)
+{
+    std::vector<int> ports;
+    char* end;
+    do
+    {
+        ports.push_back(static_cast<int>(strtol(list, &end, 10)));
+        list = end + 1;
+    } while (*end == ',');
+    return ports;
+}
+
+uint64_t NowNanos()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+struct BenchClient
+{
+    int fd = -1;
+    uint64_t id = 0;
+    bool welcomed = false;
+    // Binary frames follow the echoed hello line.
+    bool framed = false;
+    chatter::LineBuffer input;
+    uint64_t connect_started = 0;
+};
+
+class LoadGenerator
+{
+    public:
+        explicit LoadGenerator(const Options& options)
+            : options_(options), clients_(options.clients), loop_(chatter::MakeEventLoop(options.backend)),
+              action_(std::begin(options.weights), std::end(options.weights))
+        {
+            for (int port : options.ports)
+            {
+                sockaddr_in addr;
+                memset(&addr, 0, sizeof addr);
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(static_cast<uint16_t>(port));
+                inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+                addrs_.push_back(addr);
+            }
+        }
+
+        void Run()
+        {
+            uint64_t connect_start = NowNanos();
+            ConnectAll();
+            double connect_seconds = static_cast<double>(NowNanos() - connect_start) / 1e9;
+            fprintf(stderr, "%zu/%zu clients admitted in %.3f s\n", welcomed_, clients_.size(), connect_seconds);
+            if (options_.storm)
+            {
+                ReportStorm(connect_seconds);
+                return;
+            }
+
+            uint64_t start = NowNanos();
+            uint64_t interval = static_cast<uint64_t>(1e9 / options_.rate);
+            std::uniform_int_distribution<uint64_t> jitter(0, interval);
+            for (size_t i = 0; i < clients_.size(); ++i)
+            {
+                schedule_.push({start + jitter(rng_), i});
+            }
+            uint64_t end = start + static_cast<uint64_t>(options_.duration * 1e9);
+            measuring_ = true;
+            if (!options_.admin_ports.empty())
+            {
+                server_writes_ = ScrapeMetric(options_.host, options_.admin_ports, "chatter_write_calls_total");
+                server_syscalls_ = ScrapeMetric(options_.host, options_.admin_ports, "chatter_syscalls_total");
+            }
+            while (NowNanos() < end)
+            {
+                Pump(1);
+                uint64_t now = NowNanos();
+                while (!schedule_.empty() && schedule_.top().first <= now)
+                {
+                    size_t index = schedule_.top().second;
+                    schedule_.pop();
+                    Act(index, now);
+                    schedule_.push({now + interval / 2 + jitter(rng_), index});
+                }
+            }
+            uint64_t send_end = NowNanos();
+            // Let in-flight deliveries arrive before reporting.
+            uint64_t drain_end = send_end + 1000000000ull;
+            while (NowNanos() < drain_end)
+            {
+                Pump(10);
+            }
+            if (!options_.admin_ports.empty())
+            {
+                server_writes_ = ScrapeMetric(options_.host, options_.admin_ports, "chatter_write_calls_total") -
+                    server_writes_;
+                server_syscalls_ = ScrapeMetric(options_.host, options_.admin_ports, "chatter_syscalls_total") -
+                    server_syscalls_;
+            }
+            Report(connect_seconds, static_cast<double>(send_end - start) / 1e9);
+        }
+
+    private:
+        void ConnectAll()
+        {
+            size_t next = 0;
+            size_t connecting = 0;
+            uint64_t deadline = NowNanos() + 60000000000ull;
+            while (welcomed_ < clients_.size() && NowNanos() < deadline)
+            {
+                connecting = 0;
+                for (size_t i = 0; i < next; ++i)
+                {
+                    connecting += clients_[i].fd != -1 && !clients_[i].welcomed;
+                }
+                while (next < clients_.size() && connecting < options_.max_connecting)
+                {
+                    Connect(next++);
+                    ++connecting;
+                }
+                Pump(10);
+            }
+        }
+
+        void Connect(size_t index)
+        {
+            BenchClient& client = clients_[index];
+            client = BenchClient();
+            if (options_.binary)
+            {
+                client.input = chatter::LineBuffer(BinaryFrameLimit);
+            }
+            client.fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (client.fd == -1)
+            {
+                perror("socket");
+                exit(EXIT_FAILURE);
+            }
+            fcntl(client.fd, F_SETFL, O_NONBLOCK);
+            int yes = 1;
+            setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+            client.connect_started = NowNanos();
+            sockaddr_in& addr = addrs_[index % addrs_.size()];
+            if (connect(client.fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == -1 && errno != EINPROGRESS)
+            {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            fd_index_[client.fd] = index;
+            loop_->Add(client.fd, chatter::EventRead, true);
+        }
+
+        void Close(size_t index)
+        {
+            BenchClient& client = clients_[index];
+            if (client.fd == -1)
+            {
+                return;
+            }
+            if (client.welcomed)
+            {
+                --welcomed_;
+                ids_[index] = 0;
+            }
+            loop_->Remove(client.fd);
+            fd_index_.erase(client.fd);
+            close(client.fd);
+            client.fd = -1;
+            client.welcomed = false;
+        }
+
+        void Pump(int timeout_ms)
+        {
+            if (loop_->Wait(events_, timeout_ms) == -1)
+            {
+                perror("wait");
+                exit(EXIT_FAILURE);
+            }
+            for (const chatter::Event& event : events_)
+            {
+                auto it = fd_index_.find(event.fd);
+                if (it != fd_index_.end())
+                {
+                    Read(it->second);
+                }
+            }
+        }
+
+        void Read(size_t index)
+        {
+            BenchClient& client = clients_[index];
+            while (true)
+            {
+                long nbytes = client.input.Fill(client.fd);
+                if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+                {
+                    ++stats_.disconnects;
+                    Close(index);
+                    return;
+                }
+                if (nbytes == -1)
+                {
+                    return;
+                }
+                stats_.bytes_in += static_cast<uint64_t>(nbytes);
+                std::string_view line;
+                while (client.framed ? client.input.NextFrame(line) : client.input.NextLine(line))
+                {
+                    if (client.framed)
+                    {
+                        HandleFrame(index, line);
+                    }
+                    else
+                    {
+                        HandleLine(index, line);
+                    }
+                }
+                if (client.input.IsBad())
+                {
+                    ++stats_.bad_frames;
+                    ++stats_.disconnects;
+                    Close(index);
+                    return;
+                }
+            }
+        }
+
+        void HandleLine(size_t index, std::string_view line)
+        {
+            BenchClient& client = clients_[index];
+            ++stats_.lines_in;
+            if (!client.welcomed)
+            {
+                constexpr std::string_view Welcome = "Welcome! You are #";
+                size_t pos = line.find(Welcome);
+                if (pos != std::string_view::npos)
+                {
+                    client.id = strtoull(std::string(line.substr(pos + Welcome.size())).c_str(), nullptr, 10);
+                    client.welcomed = true;
+                    ids_[index] = client.id;
+                    ++welcomed_;
+                    admit_latency_.Record((NowNanos() - client.connect_started) / 1000);
+                    Send(index, options_.binary ? std::string(chatter::BinaryHello) + "\r\n" : "/color\r\n");
+                }
+                return;
+            }
+            if (options_.binary)
+            {
+                // After the color reset that ends the line before it.
+                client.framed = line.size() >= chatter::BinaryHello.size() &&
+                    line.substr(line.size() - chatter::BinaryHello.size()) == chatter::BinaryHello;
+                return;
+            }
+            RecordDelivery(line);
+        }
+
+        void HandleFrame(size_t index, std::string_view body)
+        {
+            ++stats_.lines_in;
+            chatter::WireReader reader(body.data(), body.size());
+            uint8_t kind;
+            uint8_t detail;
+            uint64_t time;
+            uint64_t client;
+            std::string_view name;
+            std::string_view room;
+            std::string_view text;
+            if (!reader.GetU8(kind) || !reader.GetU8(detail) || !reader.GetU64(time) || !reader.GetU64(client) ||
+                !reader.GetView(name) || !reader.GetView(room) || !reader.GetView(text) || !reader.AtEnd())
+            {
+                ++stats_.bad_frames;
+                ++stats_.disconnects;
+                Close(index);
+                return;
+            }
+            if (kind == static_cast<uint8_t>(chatter::FrameKind::CHAT) ||
+                kind == static_cast<uint8_t>(chatter::FrameKind::TELL))
+            {
+                RecordDelivery(text);
+            }
+        }
+
+        void RecordDelivery(std::string_view text)
+        {
+            constexpr std::string_view Marker = "BENCH ";
+            size_t pos = text.find(Marker);
+            if (pos == std::string_view::npos)
+            {
+                return;
+            }
+            uint64_t sent = strtoull(std::string(text.substr(pos + Marker.size(), 20)).c_str(), nullptr, 10);
+            uint64_t now = NowNanos();
+            if (measuring_ && sent != 0 && sent <= now)
+            {
+                latency_.Record((now - sent) / 1000);
+                ++stats_.deliveries;
+            }
+        }
+
+        // Framed clients send chat lines, and commands without the '/', as
+        // input frames.
+        void Send(size_t index, const std::string& line)
+        {
+            BenchClient& client = clients_[index];
+            if (client.framed)
+            {
+                bool command = line[0] == '/';
+                std::string text = line.substr(command, line.size() - command - 2);
+                std::string frame;
+                chatter::PutU32(frame, static_cast<uint32_t>(1 + 4 + text.size()));
+                frame.push_back(static_cast<char>(command ? chatter::InputKind::COMMAND : chatter::InputKind::CHAT));
+                chatter::PutString(frame, text);
+                SendRaw(client, frame);
+                return;
+            }
+            SendRaw(client, line);
+        }
+
+        void SendRaw(BenchClient& client, const std::string& line)
+        {
+            if (send(client.fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<long>(line.size()))
+            {
+                ++stats_.send_failures;
+                return;
+            }
+            stats_.bytes_out += line.size();
+        }
+
+        void Act(size_t index, uint64_t now)
+        {
+            BenchClient& client = clients_[index];
+            if (client.fd == -1)
+            {
+                Connect(index);
+                return;
+            }
+            if (!client.welcomed || client.framed != options_.binary)
+            {
+                return;
+            }
+            int action = action_(rng_);
+            ++stats_.actions[action];
+            switch (action)
+            {
+                case CHAT:
+                {
+                    Send(index, "BENCH " + std::to_string(now) + "\r\n");
+                    break;
+                }
+                case TELL:
+                {
+                    uint64_t dest = ids_[std::uniform_int_distribution<size_t>(0, ids_.size() - 1)(rng_)];
+                    if (dest == 0)
+                    {
+                        dest = client.id;
+                    }
+                    Send(index, "/tell " + std::to_string(dest) + " BENCH " + std::to_string(now) + "\r\n");
+                    break;
+                }
+                case WHO:
+                {
+                    Send(index, "/who\r\n");
+                    break;
+                }
+                case JOIN:
+                {
+                    size_t room = std::uniform_int_distribution<size_t>(0, options_.rooms)(rng_);
+                    Send(index, room == 0 ? "/leave\r\n" : "/join bench" + std::string(1, static_cast<char>('a' + room % 26)) + "\r\n");
+                    break;
+                }
+                case RECONNECT:
+                {
+                    Close(index);
+                    Connect(index);
+                    break;
+                }
+            }
+        }
+
+        void ReportStorm(double connect_seconds)
+        {
+            printf("{\"storm\":%zu,\"admitted\":%zu,\"connect_s\":%.3f,\"admits_per_sec\":%.1f,"
+                "\"admit_us\":{\"p50\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+                clients_.size(), welcomed_, connect_seconds, static_cast<double>(welcomed_) / connect_seconds,
+                static_cast<unsigned long long>(admit_latency_.Percentile(0.5)),
+                static_cast<unsigned long long>(admit_latency_.Percentile(0.99)),
+                static_cast<unsigned long long>(admit_latency_.GetMax()));
+        }
+
+        void Report(double connect_seconds, double seconds)
+        {
+            uint64_t sent = stats_.actions[CHAT] + stats_.actions[TELL];
+            printf("{\"servers\":%zu,\"clients\":%zu,\"duration_s\":%.3f,\"connect_s\":%.3f,", addrs_.size(),
+                clients_.size(), seconds, connect_seconds);
+            printf("\"admit_us\":{\"p50\":%llu,\"p99\":%llu,\"max\":%llu},",
+                static_cast<unsigned long long>(admit_latency_.Percentile(0.5)),
+                static_cast<unsigned long long>(admit_latency_.Percentile(0.99)),
+                static_cast<unsigned long long>(admit_latency_.GetMax()));
+            printf("\"actions\":{");
+            for (int i = 0; i < ACTION_COUNT; ++i)
+            {
+                printf("%s\"%s\":%llu", i == 0 ? "" : ",", ActionNames[i],
+                    static_cast<unsigned long long>(stats_.actions[i]));
+            }
+            printf("},\"msgs_per_sec\":%.1f,\"deliveries\":%llu,\"deliveries_per_sec\":%.1f,",
+                static_cast<double>(sent) / seconds, static_cast<unsigned long long>(stats_.deliveries),
+                static_cast<double>(stats_.deliveries) / seconds);
+            printf("\"lines_in\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"send_failures\":%llu,\"disconnects\":%llu,",
+                static_cast<unsigned long long>(stats_.lines_in), static_cast<unsigned long long>(stats_.bytes_in),
+                static_cast<unsigned long long>(stats_.bytes_out), static_cast<unsigned long long>(stats_.send_failures),
+                static_cast<unsigned long long>(stats_.disconnects));
+            if (options_.binary)
+            {
+                printf("\"bad_frames\":%llu,", static_cast<unsigned long long>(stats_.bad_frames));
+            }
+            if (!options_.admin_ports.empty())
+            {
+                printf("\"server_writes\":%llu,\"writes_per_delivery\":%.3f,",
+                    static_cast<unsigned long long>(server_writes_),
+                    stats_.deliveries == 0 ? 0.0 :
+                        static_cast<double>(server_writes_) / static_cast<double>(stats_.deliveries));
+                printf("\"server_syscalls\":%llu,\"syscalls_per_delivery\":%.3f,",
+                    static_cast<unsigned long long>(server_syscalls_),
+                    stats_.deliveries == 0 ? 0.0 :
+                        static_cast<double>(server_syscalls_) / static_cast<double>(stats_.deliveries));
+            }
+            printf("\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+                static_cast<unsigned long long>(latency_.Percentile(0.5)),
+                static_cast<unsigned long long>(latency_.Percentile(0.99)),
+                static_cast<unsigned long long>(latency_.Percentile(0.999)),
+                static_cast<unsigned long long>(latency_.GetMax()));
+        }
+
+        struct Stats
+        {
+            uint64_t actions[ACTION_COUNT] = {};
+            uint64_t deliveries = 0;
+            uint64_t lines_in = 0;
+            uint64_t bytes_in = 0;
+            uint64_t bytes_out = 0;
+            uint64_t send_failures = 0;
+            uint64_t disconnects = 0;
+            uint64_t bad_frames = 0;
+        };
+
+        Options options_;
+        std::vector<sockaddr_in> addrs_;
+        std::vector<BenchClient> clients_;
+        std::vector<uint64_t> ids_ = std::vector<uint64_t>(options_.clients);
+        std::unordered_map<int, size_t> fd_index_;
+        std::unique_ptr<chatter::EventLoop> loop_;
+        std::vector<chatter::Event> events_;
+        std::priority_queue<std::pair<uint64_t, size_t>, std::vector<std::pair<uint64_t, size_t>>,
+            std::greater<std::pair<uint64_t, size_t>>> schedule_;
+        std::mt19937_64 rng_{42};
+        std::discrete_distribution<int> action_;
+        size_t welcomed_ = 0;
+        bool measuring_ = false;
+        uint64_t server_writes_ = 0;
+        uint64_t server_syscalls_ = 0;
+        chatter::Histogram latency_;
+        chatter::Histogram admit_latency_;
+        Stats stats_;
+};
+
+void Usage()
+{
+    fprintf(stderr, "usage: chatter_bench --port <port>[,port...] [--host addr] [--clients n] [--duration s]\n"
+        "       [--rate lines_per_client_per_s] [--rooms n] [--max-connecting n]\n"
+        "       [--mix chat,tell,who,join,reconnect] [--backend poll|epoll] [--admin port[,port...]] [--binary]\n"
+        "       chatter_bench --port <port>[,port...] --storm <clients> [--host addr] [--backend poll|epoll]\n");
+    exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--binary")
+        {
+            options.binary = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            Usage();
+        }
+        const char* value = argv[++i];
+        if (arg == "--host")
+        {
+            options.host = value;
+        }
+        else if (arg == "--port")
+        {
+            options.ports = ParsePorts(value);
+        }
+        else if (arg == "--clients")
+        {
+            options.clients = strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--duration")
+        {
+            options.duration = atof(value);
+        }
+        else if (arg == "--rate")
+        {
+            options.rate = atof(value);
+        }
+        else if (arg == "--rooms")
+        {
+            options.rooms = strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--max-connecting")
+        {
+            options.max_connecting = strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--mix")
+        {
+            if (sscanf(value, "%lf,%lf,%lf,%lf,%lf", &options.weights[0], &options.weights[1],
+                &options.weights[2], &options.weights[3], &options.weights[4]) != 5)
+            {
+                Usage();
+            }
+        }
+        else if (arg == "--storm")
+        {
+            options.storm = true;
+            options.clients = strtoul(value, nullptr, 10);
+            options.max_connecting = options.clients;
+        }
+        else if (arg == "--admin")
+        {
+            options.admin_ports = ParsePorts(value);
+        }
+        else if (arg == "--backend")
+        {
+            if (!chatter::ParseBackend(value, options.backend))
+            {
+                Usage();
+            }
+        }
+        else
+        {
+            Usage();
+        }
+    }
+    if (options.ports.empty() || options.clients == 0 || options.rate <= 0)
+    {
+        Usage();
+    }
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    LoadGenerator generator(options);
+    generator.Run();
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Measures the cost of one wakeup on a single active socket while a growing
+// number of idle sockets stay registered. Prints one JSON object per run.
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "event_loop.h"
+
+namespace {
+
+constexpr int MaxIterations = 20000;
+constexpr double TimeBudgetSeconds = 0.5;
+
+size_t RaiseFdLimit()
+{
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return static_cast<size_t>(limit.rlim_cur);
+}
+
+void Run(chatter::Backend backend, size_t idle_count)
+{
+    auto loop = chatter::MakeEventLoop(backend);
+    std::vector<int> fds;
+    size_t idle = 0;
+    for (; idle < idle_count; ++idle)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+        {
+            break;
+        }
+        fds.push_back(pair[0]);
+        fds.push_back(pair[1]);
+        loop->Add(pair[0], chatter::EventRead, true);
+    }
+    int active[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, active) == -1)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    loop->Add(active[0], chatter::EventRead, true);
+
+    std::vector<chatter::Event> events;
+    char byte = 'x';
+    int iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    while (iterations < MaxIterations && elapsed < TimeBudgetSeconds)
+    {
+        if (write(active[1], &byte, 1) != 1 || loop->Wait(events, -1) != 1 || read(active[0], &byte, 1) != 1)
+        {
+            perror("wakeup");
+            exit(EXIT_FAILURE);
+        }
+        ++iterations;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    printf("{\"backend\":\"%s\",\"idle\":%zu,\"iterations\":%d,\"ns_per_wakeup\":%.0f}\n",
+        loop->Name(), idle, iterations, elapsed * 1e9 / iterations);
+    fflush(stdout);
+
+    loop.reset();
+    close(active[0]);
+    close(active[1]);
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<size_t> idle_counts;
+    for (int i = 1; i < argc; ++i)
+    {
+        idle_counts.push_back(strtoul(argv[i], nullptr, 10));
+    }
+    if (idle_counts.empty())
+    {
+        idle_counts = {1000, 10000, 100000};
+    }
+    size_t fd_limit = RaiseFdLimit();
+    for (size_t idle : idle_counts)
+    {
+        if (idle * 2 + 16 > fd_limit)
+        {
+            fprintf(stderr, "fd limit %zu caps idle sockets at %zu\n", fd_limit, (fd_limit - 16) / 2);
+        }
+        Run(chatter::Backend::EPOLL, idle);
+        Run(chatter::Backend::POLL, idle);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Pushes the same stream of chat lines through the room logger once per
+// output format and times it until everything is on disk. Prints one JSON
+// object per format.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "room_logger.h"
+
+namespace {
+
+constexpr size_t DistinctLines = 256;
+
+void Run(chatter::LogFormat format, size_t lines, size_t rooms)
+{
+    const char* name = format == chatter::LogFormat::STORE ? "store" : "text";
+    std::filesystem::path directory = std::filesystem::temp_directory_path() /
+        (std::string("chatter_logger_bench_") + name);
+    std::filesystem::remove_all(directory);
+
+    std::vector<chatter::RoomName> room_names;
+    for (size_t room = 0; room < rooms; ++room)
+    {
+        room_names.push_back(std::make_shared<const std::string>("room" + std::to_string(room)));
+    }
+    std::vector<chatter::Payload> payloads;
+    for (size_t i = 0; i < DistinctLines; ++i)
+    {
+        payloads.push_back(std::make_shared<const std::string>("[12:34:56][" + std::to_string(i) +
+            "]someone : a chat line of roughly typical length, number " + std::to_string(i) + "\r\n"));
+    }
+
+    chatter::LoggerOptions options;
+    options.directory = directory.string();
+    options.format = format;
+    options.queue_capacity = lines;
+    auto start = std::chrono::steady_clock::now();
+    {
+        chatter::RoomLogger logger(options);
+        for (size_t i = 0; i < lines; ++i)
+        {
+            while (!logger.Log(room_names[i % rooms], payloads[i % DistinctLines]))
+            {
+                std::this_thread::yield();
+            }
+        }
+        // The destructor drains the queue and flushes every file.
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::error_code error;
+    uintmax_t on_disk = 0;
+    for (const auto& file : std::filesystem::recursive_directory_iterator(directory, error))
+    {
+        if (file.is_regular_file())
+        {
+            on_disk += file.file_size();
+        }
+    }
+    printf("{\"format\":\"%s\",\"lines\":%zu,\"rooms\":%zu,\"bytes\":%ju,\"seconds\":%.3f,"
+        "\"lines_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n",
+        name, lines, rooms, on_disk, elapsed, lines / elapsed, on_disk / elapsed / (1 << 20));
+    fflush(stdout);
+    std::filesystem::remove_all(directory, error);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    size_t lines = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t rooms = argc > 2 ? strtoul(argv[2], nullptr, 10) : 16;
+    Run(chatter::LogFormat::TEXT, lines, rooms);
+    Run(chatter::LogFormat::STORE, lines, rooms);
+    return 0;
+}
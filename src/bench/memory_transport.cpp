@@ -0,0 +1,124 @@
+#include "memory_transport.h"
+
+#include <netinet/in.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace chatter {
+
+namespace {
+
+constexpr size_t MaxSendPayloads = 64;
+
+} // namespace
+
+int MemoryTransport::Wait(std::vector<Event>& events, int)
+{
+    events.clear();
+    completions_.swap(pending_);
+    pending_.clear();
+    return static_cast<int>(completions_.size());
+}
+
+void MemoryTransport::Accept(sock_t)
+{
+    accepting_ = true;
+}
+
+void MemoryTransport::Receive(sock_t fd, uint64_t tag)
+{
+    Receiver& receiver = GetReceiver(fd);
+    receiver.tag = tag;
+    receiver.armed = true;
+}
+
+void MemoryTransport::CancelReceive(uint64_t tag)
+{
+    for (Receiver& receiver : receivers_)
+    {
+        if (receiver.armed && receiver.tag == tag)
+        {
+            receiver.armed = false;
+            Post(Completion::Type::RECEIVE, tag, -ECANCELED, nullptr, false);
+        }
+    }
+}
+
+void MemoryTransport::Send(sock_t, uint64_t tag, OutboundQueue& queue)
+{
+    size_t head_offset = 0;
+    queue.Gather(gathered_, head_offset, MaxSendPayloads);
+    size_t bytes = 0;
+    for (const Payload& payload : gathered_)
+    {
+        bytes += payload->size();
+    }
+    bytes -= head_offset;
+    gathered_.clear();
+    ++sends_;
+    bytes_sent_ += bytes;
+    Post(Completion::Type::SEND, tag, static_cast<int>(bytes));
+}
+
+void MemoryTransport::Cancel(sock_t fd)
+{
+    Receiver& receiver = GetReceiver(fd);
+    if (receiver.armed)
+    {
+        receiver.armed = false;
+        Post(Completion::Type::RECEIVE, receiver.tag, -ECANCELED, nullptr, false);
+    }
+}
+
+void MemoryTransport::Close(sock_t fd)
+{
+    GetReceiver(fd).armed = false;
+}
+
+bool MemoryTransport::GetPeerAddress(sock_t, sockaddr_storage& addr)
+{
+    memset(&addr, 0, sizeof addr);
+    sockaddr_in& peer = reinterpret_cast<sockaddr_in&>(addr);
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return true;
+}
+
+sock_t MemoryTransport::Connect()
+{
+    if (!accepting_)
+    {
+        return -1;
+    }
+    sock_t fd = next_fd_++;
+    GetReceiver(fd);
+    Post(Completion::Type::ACCEPT, 0, fd);
+    return fd;
+}
+
+void MemoryTransport::Input(sock_t fd, std::string_view data)
+{
+    const Receiver& receiver = GetReceiver(fd);
+    if (receiver.armed)
+    {
+        Post(Completion::Type::RECEIVE, receiver.tag, static_cast<int>(data.size()), data.data());
+    }
+}
+
+MemoryTransport::Receiver& MemoryTransport::GetReceiver(sock_t fd)
+{
+    size_t index = static_cast<size_t>(fd - FirstMemoryFd);
+    if (index >= receivers_.size())
+    {
+        receivers_.resize(index + 1);
+    }
+    return receivers_[index];
+}
+
+void MemoryTransport::Post(Completion::Type type, uint64_t tag, int result, const char* data, bool more)
+{
+    pending_.push_back({type, tag, result, data, more});
+}
+
+} // namespace chatter
@@ -0,0 +1,68 @@
+#ifndef CHATTER_MEMORY_TRANSPORT_H_
+#define CHATTER_MEMORY_TRANSPORT_H_
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "completion_io.h"
+#include "event_loop.h"
+
+namespace chatter {
+
+// Well above any real descriptor the process holds, such as the listener.
+constexpr sock_t FirstMemoryFd = 1 << 16;
+
+// A completion backend with no sockets behind it, so benchmarks measure the
+// server rather than the network. The caller connects clients and feeds them
+// input; whatever the server sends completes in full on the next Wait() and
+// is only counted. Nothing ever becomes ready, and Wait() never blocks.
+class MemoryTransport : public EventLoop, public CompletionIo
+{
+    public:
+        bool Add(sock_t, unsigned, bool = false) override { return true; }
+        bool Modify(sock_t, unsigned, bool = false) override { return true; }
+        void Remove(sock_t) override { }
+        int Wait(std::vector<Event>& events, int timeout_ms) override;
+        const char* Name() const override { return "memory"; }
+        bool IsEdgeTriggered() const override { return true; }
+        CompletionIo* GetCompletionIo() override { return this; }
+        void Accept(sock_t listen_fd) override;
+        void Receive(sock_t fd, uint64_t tag) override;
+        void CancelReceive(uint64_t tag) override;
+        void Send(sock_t fd, uint64_t tag, OutboundQueue& queue) override;
+        void Cancel(sock_t fd) override;
+        void Close(sock_t fd) override;
+        const std::vector<Completion>& GetCompletions() const override { return completions_; }
+        bool GetPeerAddress(sock_t fd, sockaddr_storage& addr) override;
+        // Queues a new connection for the server's accept; returns its
+        // descriptor, which is only a number.
+        sock_t Connect();
+        // `data` is not copied, so it must outlive the PollClients() that
+        // handles it. Input to a client that isn't being read is dropped.
+        void Input(sock_t fd, std::string_view data);
+        // Whether the next Wait() has completions to hand out.
+        bool HasPending() const { return !pending_.empty(); }
+        uint64_t GetSends() const { return sends_; }
+        uint64_t GetBytesSent() const { return bytes_sent_; }
+    private:
+        struct Receiver
+        {
+            uint64_t tag = 0;
+            bool armed = false;
+        };
+        Receiver& GetReceiver(sock_t fd);
+        void Post(Completion::Type type, uint64_t tag, int result, const char* data = nullptr, bool more = true);
+        bool accepting_ = false;
+        sock_t next_fd_ = FirstMemoryFd;
+        std::vector<Receiver> receivers_;
+        std::vector<Completion> pending_;
+        std::vector<Completion> completions_;
+        std::vector<Payload> gathered_;
+        uint64_t sends_ = 0;
+        uint64_t bytes_sent_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_MEMORY_TRANSPORT_H_
@@ -0,0 +1,323 @@
+// Times single hot paths of one server shard in isolation: the timestamp,
+// rendering and queuing a reply, a chat line and commands from receipt
+// through parsing, and room broadcasts as the room grows. The shard runs on
+// a MemoryTransport, so no sockets are involved, and its loop is driven from
+// here instead of by ShardGroup::Run().
+//
+// Prints one JSON object per case with ns/op and heap allocations per op.
+// Save the output and pass it back with --baseline to have each case report
+// its change against that run.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "colors.h"
+#include "config.h"
+#include "memory_transport.h"
+#include "server.h"
+#include "shard_group.h"
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+} // namespace
+
+// Counts every allocation in the process, the server's included.
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size != 0 ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+constexpr size_t ConnectBatch = 1024;
+constexpr int Repeats = 3;
+const std::string ChatLine = "a chat line of roughly typical length, in a busy room\r\n";
+const std::string WhoLine = "/who\r\n";
+
+struct Options
+{
+    std::vector<size_t> members = {10, 100, 1000, 10000, 100000};
+    double min_time = 0.2;
+    std::string baseline;
+};
+
+struct Baseline
+{
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+// Reads back this program's own output, one case per line.
+std::map<std::string, Baseline> LoadBaseline(const std::string& path)
+{
+    std::map<std::string, Baseline> cases;
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+    {
+        perror("microbench: baseline");
+        exit(EXIT_FAILURE);
+    }
+    char line[1024];
+    while (fgets(line, sizeof line, file) != nullptr)
+    {
+        const char* name = strstr(line, "\"case\":\"");
+        const char* ns = strstr(line, "\"ns_per_op\":");
+        const char* allocs = strstr(line, "\"allocs_per_op\":");
+        if (name == nullptr || ns == nullptr || allocs == nullptr)
+        {
+            continue;
+        }
+        name += strlen("\"case\":\"");
+        const char* end = strchr(name, '"');
+        if (end != nullptr)
+        {
+            cases[std::string(name, end)] = {strtod(ns + strlen("\"ns_per_op\":"), nullptr),
+                strtod(allocs + strlen("\"allocs_per_op\":"), nullptr)};
+        }
+    }
+    fclose(file);
+    return cases;
+}
+
+class MicroBench
+{
+    public:
+        MicroBench(const Options& options, FILE* out) : options_(options), out_(out)
+        {
+            if (!options.baseline.empty())
+            {
+                baseline_ = LoadBaseline(options.baseline);
+            }
+            chatter::Config config;
+            config.port = "0";
+            config.make_event_loop = [this]()
+            {
+                auto transport = std::make_unique<chatter::MemoryTransport>();
+                transport_ = transport.get();
+                return transport;
+            };
+            config.rate_limits.chat = {};
+            config.rate_limits.command = {};
+            config.keepalive_s = 0;
+            // Connect notices would go to everyone already in as the room
+            // grows; hold them for the whole run instead.
+            config.presence_window_ms = 24 * 60 * 60 * 1000;
+            config.presence_max_members = 1;
+            group_ = std::make_unique<chatter::ShardGroup>(config);
+            server_ = &group_->GetShard(0);
+            Settle();
+        }
+
+        void Run()
+        {
+            sock_t sender = Connect(1);
+            chatter::ClientSlot slot = server_->GetClients().FindFd(sender);
+            chatter::ClientId sender_id = server_->GetClients().Info(slot).id;
+            std::string tell_line = "/tell " + std::to_string(sender_id) + " are you there?\r\n";
+            std::string message = "[" + std::to_string(sender_id) + "]anon : " + ChatLine;
+            size_t queued = 0;
+            volatile size_t sink = 0;
+
+            Measure("timestamp", 1, [&]() { sink = sink + server_->GetTimestamp().size(); });
+            // Flushed every 64 so the queue stays short, as it is in practice.
+            Measure("send_to_client", 1, [&]()
+            {
+                server_->SendToClient(slot, server_->GetTimestamp(), chatter::colors::Cyan, message, true);
+                if (++queued % 64 == 0)
+                {
+                    Settle();
+                }
+            });
+            Settle();
+            Measure("receive_chat", 1, [&]() { Handle(sender, ChatLine); });
+            Measure("command_who", 1, [&]() { Handle(sender, WhoLine); });
+            Measure("command_tell", 1, [&]() { Handle(sender, tell_line); });
+            for (size_t members : options_.members)
+            {
+                if (members > members_)
+                {
+                    Connect(members - members_);
+                }
+                Measure("broadcast/" + std::to_string(members), members_, [&]() { Handle(sender, ChatLine); });
+            }
+        }
+    private:
+        // Runs the loop until everything sent has completed.
+        void Settle()
+        {
+            do
+            {
+                server_->PollClients();
+            }
+            while (transport_->HasPending());
+        }
+
+        void Handle(sock_t fd, const std::string& line)
+        {
+            transport_->Input(fd, line);
+            Settle();
+        }
+
+        // Returns the first new client's descriptor once all are in the room.
+        sock_t Connect(size_t count)
+        {
+            sock_t first = -1;
+            for (size_t done = 0; done < count; done += ConnectBatch)
+            {
+                for (size_t i = done; i < std::min(count, done + ConnectBatch); ++i)
+                {
+                    sock_t fd = transport_->Connect();
+                    first = first == -1 ? fd : first;
+                }
+                Settle();
+            }
+            members_ += count;
+            return first;
+        }
+
+        // Doubles the iterations until a batch takes at least --min-time,
+        // then reports the fastest of Repeats such batches.
+        template<typename Op>
+        void Measure(const std::string& name, size_t members, Op op)
+        {
+            uint64_t iterations = 1;
+            double best = 0;
+            double allocs = 0;
+            double sends = 0;
+            for (int run = 0; run < Repeats; )
+            {
+                uint64_t allocated = allocations.load(std::memory_order_relaxed);
+                uint64_t sent = transport_->GetSends();
+                auto start = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < iterations; ++i)
+                {
+                    op();
+                }
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (run == 0 && elapsed < options_.min_time)
+                {
+                    iterations *= 2;
+                    continue;
+                }
+                double ns = elapsed * 1e9 / iterations;
+                if (run++ == 0 || ns < best)
+                {
+                    best = ns;
+                    allocs = static_cast<double>(allocations.load(std::memory_order_relaxed) - allocated) / iterations;
+                    sends = static_cast<double>(transport_->GetSends() - sent) / iterations;
+                }
+            }
+            Report(name, members, iterations, best, allocs, sends);
+        }
+
+        void Report(const std::string& name, size_t members, uint64_t iterations, double ns, double allocs,
+            double sends)
+        {
+            fprintf(out_, "{\"case\":\"%s\",\"members\":%zu,\"iterations\":%llu,\"ns_per_op\":%.1f,"
+                "\"allocs_per_op\":%.2f,\"sends_per_op\":%.2f", name.c_str(), members,
+                static_cast<unsigned long long>(iterations), ns, allocs, sends);
+            auto base = baseline_.find(name);
+            if (base != baseline_.end())
+            {
+                fprintf(out_, ",\"baseline_ns_per_op\":%.1f,\"ns_change_pct\":%.1f,\"baseline_allocs_per_op\":%.2f",
+                    base->second.ns_per_op, (ns / base->second.ns_per_op - 1) * 100, base->second.allocs_per_op);
+            }
+            fprintf(out_, "}\n");
+            fflush(out_);
+        }
+
+        Options options_;
+        FILE* out_;
+        std::map<std::string, Baseline> baseline_;
+        chatter::MemoryTransport* transport_ = nullptr;
+        std::unique_ptr<chatter::ShardGroup> group_;
+        chatter::Server* server_ = nullptr;
+        size_t members_ = 0;
+};
+
+void Usage()
+{
+    fprintf(stderr, "usage: microbench [--members n[,n...]] [--min-time s] [--baseline file]\n");
+    exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            Usage();
+        }
+        const char* value = argv[++i];
+        if (arg == "--members")
+        {
+            options.members.clear();
+            for (const char* p = value; *p != '\0'; p += *p == ',')
+            {
+                char* end;
+                options.members.push_back(strtoul(p, &end, 10));
+                if (end == p)
+                {
+                    Usage();
+                }
+                p = end;
+            }
+        }
+        else if (arg == "--min-time")
+        {
+            options.min_time = atof(value);
+        }
+        else if (arg == "--baseline")
+        {
+            options.baseline = value;
+        }
+        else
+        {
+            Usage();
+        }
+    }
+    // The server reports every connection on stdout; results get their own
+    // copy of it.
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == nullptr || freopen("/dev/null", "w", stdout) == nullptr)
+    {
+        perror("microbench: stdout");
+        return 1;
+    }
+    MicroBench bench(options, out);
+    bench.Run();
+    return 0;
+}
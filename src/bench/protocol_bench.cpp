@@ -0,0 +1,123 @@
+// Times what one chat line costs the server to parse and to render for its
+// recipients, as a text line and as a binary frame. Prints one JSON object
+// per protocol.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include "binary_protocol.h"
+#include "colors.h"
+#include "line_buffer.h"
+#include "rendered_message.h"
+#include "wire_format.h"
+
+namespace {
+
+constexpr size_t DistinctLines = 256;
+constexpr chatter::ClientId Sender = 42;
+const std::string SenderName = "someone";
+const std::string RoomName = "global";
+
+std::string MakeLine(size_t i)
+{
+    return "a chat line of roughly typical length, number " + std::to_string(i);
+}
+
+void Report(const char* name, size_t lines, size_t bytes_out, double elapsed)
+{
+    printf("{\"protocol\":\"%s\",\"lines\":%zu,\"bytes_out_per_line\":%.1f,\"ns_per_line\":%.1f}\n",
+        name, lines, static_cast<double>(bytes_out) / lines, elapsed * 1e9 / lines);
+    fflush(stdout);
+}
+
+// Feeds `input` through the buffer a slab at a time, the way recv() would.
+template<typename Next, typename Handle>
+void Drain(const std::string& input, Next next, Handle handle)
+{
+    chatter::LineBuffer buffer;
+    size_t offset = 0;
+    std::string_view item;
+    while (offset < input.size())
+    {
+        offset += buffer.Append(input.data() + offset, input.size() - offset);
+        while (next(buffer, item))
+        {
+            handle(item);
+        }
+    }
+}
+
+void RunText(size_t lines)
+{
+    std::string input;
+    for (size_t i = 0; i < DistinctLines; ++i)
+    {
+        input += MakeLine(i) + "\r\n";
+    }
+    size_t bytes_out = 0;
+    size_t handled = 0;
+    std::string timestamp = "[12:34:56]";
+    auto start = std::chrono::steady_clock::now();
+    while (handled < lines)
+    {
+        Drain(input, [](chatter::LineBuffer& buffer, std::string_view& line) { return buffer.NextLine(line); },
+            [&](std::string_view line)
+            {
+                std::string message = "[" + std::to_string(Sender) + "]" + SenderName + " : ";
+                message.append(line);
+                message += "\r\n";
+                chatter::Payload color = chatter::RenderPayload(timestamp, chatter::colors::Cyan, message, true);
+                chatter::Payload plain = chatter::RenderPayload(timestamp, chatter::colors::Cyan, message, false);
+                bytes_out += plain->size();
+                ++handled;
+            });
+    }
+    Report("text", handled, bytes_out, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+void RunBinary(size_t lines)
+{
+    std::string input;
+    for (size_t i = 0; i < DistinctLines; ++i)
+    {
+        std::string line = MakeLine(i);
+        chatter::PutU32(input, static_cast<uint32_t>(1 + 4 + line.size()));
+        input.push_back(static_cast<char>(chatter::InputKind::CHAT));
+        chatter::PutString(input, line);
+    }
+    size_t bytes_out = 0;
+    size_t handled = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (handled < lines)
+    {
+        Drain(input, [](chatter::LineBuffer& buffer, std::string_view& body) { return buffer.NextFrame(body); },
+            [&](std::string_view body)
+            {
+                chatter::InputKind kind;
+                std::string_view text;
+                if (!chatter::DecodeInput(body, kind, text))
+                {
+                    fprintf(stderr, "protocol_bench: bad frame\n");
+                    exit(EXIT_FAILURE);
+                }
+                chatter::Payload frame = chatter::EncodeFrame(
+                    {chatter::FrameKind::CHAT, 0, Sender, SenderName, RoomName, text});
+                bytes_out += frame->size();
+                ++handled;
+            });
+    }
+    Report("binary", handled, bytes_out, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    size_t lines = argc > 1 ? strtoul(argv[1], nullptr, 10) : 5000000;
+    RunText(lines);
+    RunBinary(lines);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "binary_protocol.h"
+
+#include <chrono>
+#include <cstring>
+
+#include "wire_format.h"
+
+namespace chatter {
+
+namespace {
+
+char* Put(char* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        *out++ = static_cast<char>(value >> (8 * i));
+    }
+    return out;
+}
+
+char* Put(char* out, std::string_view value)
+{
+    out = Put(out, value.size(), 4);
+    memcpy(out, value.data(), value.size());
+    return out + value.size();
+}
+
+} // namespace
+
+std::shared_ptr<const std::string> EncodeFrame(const FrameFields& fields)
+{
+    // Sized up front and written in place; this runs once per message.
+    size_t body = 2 + 8 + 8 + 3 * 4 + fields.name.size() + fields.room.size() + fields.text.size();
+    auto frame = std::make_shared<std::string>(FrameHeaderSize + body, '\0');
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    char* out = Put(frame->data(), body, FrameHeaderSize);
+    *out++ = static_cast<char>(fields.kind);
+    *out++ = static_cast<char>(fields.detail);
+    out = Put(out, static_cast<uint64_t>(now_ms), 8);
+    out = Put(out, fields.client, 8);
+    out = Put(out, fields.name);
+    out = Put(out, fields.room);
+    Put(out, fields.text);
+    return frame;
+}
+
+std::string FrameText(std::string_view message)
+{
+    std::string text;
+    text.reserve(message.size());
+    for (size_t i = 0; i < message.size(); ++i)
+    {
+        if (message[i] == '\x1b')
+        {
+            // Color codes are "ESC [ ... m".
+            size_t end = message.find('m', i);
+            i = end != std::string_view::npos ? end : message.size();
+        }
+        else if (message[i] != '\r')
+        {
+            text.push_back(message[i]);
+        }
+    }
+    if (!text.empty() && text.back() == '\n')
+    {
+        text.pop_back();
+    }
+    return text;
+}
+
+bool DecodeInput(std::string_view body, InputKind& kind, std::string_view& text)
+{
+    WireReader reader(body.data(), body.size());
+    uint8_t value;
+    if (!reader.GetU8(value) || value < static_cast<uint8_t>(InputKind::CHAT) ||
+        value > static_cast<uint8_t>(InputKind::COMMAND) || !reader.GetView(text) || !reader.AtEnd())
+    {
+        return false;
+    }
+    kind = static_cast<InputKind>(value);
+    return true;
+}
+
+} // namespace chatter
@@ -0,0 +1,69 @@
+#ifndef CHATTER_BINARY_PROTOCOL_H_
+#define CHATTER_BINARY_PROTOCOL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "client.h"
+
+namespace chatter {
+
+// A client that sends this as its first line speaks the binary protocol from
+// then on. The server answers with the same line, so a client can skip the
+// text sent before it, and both sides then exchange frames: a little-endian
+// u32 body length followed by the body.
+constexpr std::string_view BinaryHello("\0chatter-binary 1", 17);
+
+// Server frame body: u8 kind, u8 detail, u64 time (Unix ms), u64 client,
+// then name, room and text as u32-length strings. Text has no color codes
+// and no line ending; the lines of a longer reply are separated by LF.
+enum class FrameKind : uint8_t
+{
+    // Sent once after the hello: your number, name and room.
+    HELLO = 1,
+    // client/name said text in room.
+    CHAT,
+    // detail is the PresenceKind; client is the subject, or none for a
+    // digest of several. room is empty for connects and disconnects.
+    PRESENCE,
+    // detail 0: client/name told you text; 1: you told client/name.
+    TELL,
+    // Command output and errors, for you alone.
+    REPLY,
+    // Anything else said to a room or to everyone.
+    NOTICE,
+    // Keepalive with only the time set; there is nothing to show.
+    PING,
+};
+
+// Client frame body: u8 kind, then text as a u32-length string.
+enum class InputKind : uint8_t
+{
+    // Said in the current room, even if it starts with '/'.
+    CHAT = 1,
+    // A command without its '/', e.g. "join lobby".
+    COMMAND,
+};
+
+constexpr size_t FrameHeaderSize = 4;
+
+struct FrameFields
+{
+    FrameKind kind = FrameKind::NOTICE;
+    uint8_t detail = 0;
+    ClientId client = NoClient;
+    std::string_view name;
+    std::string_view room;
+    std::string_view text;
+};
+
+std::shared_ptr<const std::string> EncodeFrame(const FrameFields& fields);
+// Text rendered for a terminal, less its colors, CRs and final LF.
+std::string FrameText(std::string_view message);
+bool DecodeInput(std::string_view body, InputKind& kind, std::string_view& text);
+
+} // namespace chatter
+
+#endif // CHATTER_BINARY_PROTOCOL_H_
@@ -0,0 +1,115 @@
+#ifndef CHATTER_BOUNDED_QUEUE_H_
+#define CHATTER_BOUNDED_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace chatter {
+
+// Fixed-capacity lock-free multi-producer/multi-consumer ring (D. Vyukov's
+// sequence-numbered cells). TryPush() fails instead of blocking when full.
+template <typename T>
+class BoundedQueue
+{
+    public:
+        explicit BoundedQueue(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+            cells_ = std::make_unique<Cell[]>(size);
+            mask_ = size - 1;
+            for (size_t i = 0; i < size; ++i)
+            {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        bool TryPush(T&& value)
+        {
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true)
+            {
+                cell = &cells_[pos & mask_];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if (diff == 0)
+                {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            cell->value = std::move(value);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool TryPop(T& value)
+        {
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            Cell* cell;
+            while (true)
+            {
+                cell = &cells_[pos & mask_];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0)
+                {
+                    if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            value = std::move(cell->value);
+            cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Only a snapshot while other threads push and pop.
+        size_t Size() const
+        {
+            size_t dequeued = dequeue_pos_.load(std::memory_order_acquire);
+            return enqueue_pos_.load(std::memory_order_relaxed) - dequeued;
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+        std::unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        alignas(64) std::atomic<size_t> enqueue_pos_{0};
+        alignas(64) std::atomic<size_t> dequeue_pos_{0};
+};
+
+} // namespace chatter
+
+#endif // CHATTER_BOUNDED_QUEUE_H_
@@ -1,32 +1,301 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 
-#include "server.h"
+#include "config.h"
+#include "handoff.h"
+#include "mccp.h"
+#include "shard_group.h"
 
 int main(int argc, char* argv[])
 {
     if (argc < 2)
     {
-        fprintf(stderr, "usage: chatter <port>\r\n");
+        fprintf(stderr, "usage: chatter <port> [-L] [-G text|store] [-E poll|epoll|uring] [-T threads]\r\n"
+            "       [-Q max_queued_bytes] [-M max_queued_messages] [-S drop|disconnect]\r\n"
+            "       [-l max_line_length] [-F flush_ms] [-Y] [-R rotate_bytes] [-r rotate_seconds]\r\n"
+            "       [-A admin_port] [-C] [-H history_lines] [-B history_bytes] [-b backlog]\r\n"
+            "       [-W presence_window_ms] [-U presence_max_members] [-z compression_level]\r\n"
+            "       [-K chat_rate[:burst]] [-k command_rate[:burst]] [-O room=chat_rate[:burst]]...\r\n"
+            "       [-X queue|drop|notice] [-I idle_seconds] [-P keepalive_seconds]\r\n"
+            "       [-J handshake_seconds] [-g read_bytes] [-n read_lines] [-t tick_lines]\r\n"
+            "       [-D host:port,host:port,... -N node_index] [-V handoff_socket [-Z] [-w ack_ms]]\r\n");
         return 1;
     }
-    bool enable_logs = false;
-    if (argc > 2)
+    chatter::Config config;
+    config.port = argv[1];
+    for (int i = 2; i < argc; ++i)
     {
-        if (std::string(argv[2]) == "-L")
+        std::string arg = argv[i];
+        if (arg == "-L")
         {
             printf("Logging is enabled!\r\n");
-            enable_logs = true;
+            config.enable_logs = true;
+        }
+        else if (arg == "-G" && i + 1 < argc)
+        {
+            std::string format = argv[++i];
+            if (format == "text")
+            {
+                config.logger_options.format = chatter::LogFormat::TEXT;
+            }
+            else if (format == "store")
+            {
+                config.logger_options.format = chatter::LogFormat::STORE;
+            }
+            else
+            {
+                fprintf(stderr, "unknown log format: %s\r\n", format.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "-E" && i + 1 < argc)
+        {
+            if (!chatter::ParseBackend(argv[++i], config.backend))
+            {
+                fprintf(stderr, "unknown event loop backend: %s\r\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (arg == "-T" && i + 1 < argc)
+        {
+            config.threads = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-D" && i + 1 < argc)
+        {
+            std::string nodes = argv[++i];
+            size_t start = 0;
+            while (start <= nodes.size())
+            {
+                size_t comma = std::min(nodes.find(',', start), nodes.size());
+                config.nodes.push_back(nodes.substr(start, comma - start));
+                start = comma + 1;
+            }
+        }
+        else if (arg == "-N" && i + 1 < argc)
+        {
+            config.node_id = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-V" && i + 1 < argc)
+        {
+            config.handoff_path = argv[++i];
+        }
+        else if (arg == "-Z")
+        {
+            config.take_over = true;
+        }
+        else if (arg == "-w" && i + 1 < argc)
+        {
+            config.handoff_ack_ms = atoi(argv[++i]);
+        }
+        else if (arg == "-Q" && i + 1 < argc)
+        {
+            config.outbound_limits.max_bytes = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-M" && i + 1 < argc)
+        {
+            config.outbound_limits.max_messages = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-g" && i + 1 < argc)
+        {
+            config.read_budget.bytes = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-n" && i + 1 < argc)
+        {
+            config.read_budget.lines = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-t" && i + 1 < argc)
+        {
+            config.read_budget.tick_lines = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-F" && i + 1 < argc)
+        {
+            config.logger_options.flush_interval_ms = atoi(argv[++i]);
+        }
+        else if (arg == "-Y")
+        {
+            config.logger_options.fsync = true;
+        }
+        else if (arg == "-R" && i + 1 < argc)
+        {
+            config.logger_options.rotate_bytes = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            config.logger_options.rotate_seconds = strtol(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-l" && i + 1 < argc)
+        {
+            config.max_line_length = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-z" && i + 1 < argc)
+        {
+            config.compression_level = std::clamp(atoi(argv[++i]), 0, 9);
+        }
+        else if (arg == "-C")
+        {
+            config.cork_output = true;
+        }
+        else if (arg == "-A" && i + 1 < argc)
+        {
+            config.admin_port = argv[++i];
+        }
+        else if (arg == "-b" && i + 1 < argc)
+        {
+            config.backlog = atoi(argv[++i]);
+        }
+        else if (arg == "-W" && i + 1 < argc)
+        {
+            config.presence_window_ms = atoi(argv[++i]);
+        }
+        else if (arg == "-U" && i + 1 < argc)
+        {
+            config.presence_max_members = strtoul(argv[++i], nullptr, 10);
+        }
+        else if ((arg == "-K" || arg == "-k") && i + 1 < argc)
+        {
+            chatter::RateLimit& limit = arg == "-K" ? config.rate_limits.chat : config.rate_limits.command;
+            if (!chatter::ParseRateLimit(argv[++i], limit))
+            {
+                fprintf(stderr, "bad rate limit: %s\r\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (arg == "-O" && i + 1 < argc)
+        {
+            std::string room_limit = argv[++i];
+            size_t equals = room_limit.find('=');
+            chatter::RateLimit limit;
+            if (equals == std::string::npos || !chatter::ParseRateLimit(room_limit.substr(equals + 1), limit))
+            {
+                fprintf(stderr, "bad room rate limit: %s\r\n", room_limit.c_str());
+                return 1;
+            }
+            config.rate_limits.rooms[room_limit.substr(0, equals)] = limit;
+        }
+        else if (arg == "-X" && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy == "queue")
+            {
+                config.rate_limits.policy = chatter::ThrottlePolicy::QUEUE;
+            }
+            else if (policy == "drop")
+            {
+                config.rate_limits.policy = chatter::ThrottlePolicy::DROP;
+            }
+            else if (policy == "notice")
+            {
+                config.rate_limits.policy = chatter::ThrottlePolicy::NOTICE;
+            }
+            else
+            {
+                fprintf(stderr, "unknown throttle policy: %s\r\n", policy.c_str());
+                return 1;
+            }
+        }
+        else if (arg == "-I" && i + 1 < argc)
+        {
+            config.idle_timeout_s = atoi(argv[++i]);
+        }
+        else if (arg == "-P" && i + 1 < argc)
+        {
+            config.keepalive_s = atoi(argv[++i]);
+        }
+        else if (arg == "-J" && i + 1 < argc)
+        {
+            config.handshake_timeout_s = atoi(argv[++i]);
+        }
+        else if (arg == "-H" && i + 1 < argc)
+        {
+            config.history_lines = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-B" && i + 1 < argc)
+        {
+            config.history_bytes = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-S" && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy == "drop")
+            {
+                config.outbound_limits.policy = chatter::SlowConsumerPolicy::DROP_OLDEST;
+            }
+            else if (policy == "disconnect")
+            {
+                config.outbound_limits.policy = chatter::SlowConsumerPolicy::DISCONNECT;
+            }
+            else
+            {
+                fprintf(stderr, "unknown slow consumer policy: %s\r\n", policy.c_str());
+                return 1;
+            }
         }
     }
-    chatter::Server chatter(argv[1], enable_logs);
-
-    printf("Waiting for clients on port %s...\r\n", argv[1]);
+    if (config.compression_level != 0 && !chatter::IsCompressionAvailable())
+    {
+        fprintf(stderr, "This build has no zlib; MCCP is not offered.\r\n");
+        config.compression_level = 0;
+    }
+    if (!config.nodes.empty() && config.node_id >= config.nodes.size())
+    {
+        fprintf(stderr, "node index %zu is not in the node list\r\n", config.node_id);
+        return 1;
+    }
+    chatter::HandoffState inherited;
+    sock_t handoff_fd = static_cast<sock_t>(-1);
+    auto handoff_start = std::chrono::steady_clock::now();
+    if (config.take_over)
+    {
+        if (config.handoff_path.empty())
+        {
+            fprintf(stderr, "-Z needs the running server's -V path\r\n");
+            return 1;
+        }
+        handoff_fd = chatter::ReceiveHandoff(config.handoff_path, inherited);
+        if (handoff_fd == static_cast<sock_t>(-1))
+        {
+            return 1;
+        }
+        // Client ids encode the node and shard, so both must carry over.
+        size_t node_count = config.nodes.empty() ? 1 : config.nodes.size();
+        if (inherited.node_id != config.node_id || inherited.node_count != node_count)
+        {
+            fprintf(stderr, "the running server is node %zu of %zu\r\n", inherited.node_id, inherited.node_count);
+            return 1;
+        }
+        config.threads = inherited.shards.size();
+    }
+    chatter::ShardGroup chatter(config, config.take_over ? &inherited : nullptr);
+    if (config.take_over)
+    {
+        size_t clients = 0;
+        for (const chatter::ShardState& shard : inherited.shards)
+        {
+            clients += shard.clients.size();
+        }
+        if (!chatter::AcknowledgeHandoff(handoff_fd))
+        {
+            fprintf(stderr, "the running server stopped waiting and carries on\r\n");
+            return 1;
+        }
+        inherited = chatter::HandoffState();
+        printf("Took over %zu clients in %lld ms\r\n", clients,
+            static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - handoff_start).count()));
+    }
 
-    while (true)
+    printf("Waiting for clients on port %s (%s, %zu threads)...\r\n", argv[1],
+        chatter.GetBackendName(), chatter.GetShardCount());
+    if (!config.nodes.empty())
     {
-        chatter.PollClients();
+        printf("Node %zu of %zu, peer links on %s\r\n", config.node_id, config.nodes.size(),
+            config.nodes[config.node_id].c_str());
     }
 
+    chatter.Run();
+
     return 0;
 }
@@ -1,8 +1,12 @@
 #ifndef CHATTER_CLIENT_H_
 #define CHATTER_CLIENT_H_
 
+#include <cstdint>
 #include <string>
 
+#include "line_buffer.h"
+#include "rate_limit.h"
+
 #ifdef _WIN32
     #include <winsock2.h>
     typedef SOCKET sock_t;
@@ -12,13 +16,54 @@
 
 namespace chatter {
 
+class Room;
+
+// Server-wide client number shown to users as [id]. The low digits name the
+// node (id % nodes) and shard (id / nodes % shards) that own the connection.
+typedef uint64_t ClientId;
+constexpr ClientId NoClient = UINT64_MAX;
+
+// Index of a client in its shard's ClientTable.
+typedef uint32_t ClientSlot;
+constexpr ClientSlot NoSlot = UINT32_MAX;
+
+// Per-client state that is only needed when handling that client's own
+// input or a directory lookup. Fan-out state lives in ClientTable columns.
 struct Client
 {
-    sock_t fd;
+    ClientSlot slot = NoSlot;
+    ClientId id = NoClient;
     std::string name = "anon";
     std::string addr;
-    std::string room_name;
-    bool color = true;
+    LineBuffer input;
+    TokenBucket chat_bucket;
+    TokenBucket command_bucket;
+    // Set once the client has been told it is sending too fast; cleared by
+    // the next line that gets through.
+    bool throttle_noticed = false;
+    // Steady-clock milliseconds, for the idle, keepalive and handshake timers.
+    int64_t connected_ms = 0;
+    int64_t last_input_ms = 0;
+    int64_t last_probe_ms = 0;
+    bool handshake_done = false;
+    // Input handled in loop iteration `read_tick`, against the read budget.
+    uint64_t read_tick = 0;
+    size_t read_bytes = 0;
+    size_t read_lines = 0;
+    // Input that arrived while throttled or deferred, when the event loop
+    // reads for us.
+    std::string backlog;
+};
+
+// A client connected to another shard or node, as seen through this shard's
+// replica.
+struct RemoteClient
+{
+    ClientId id = NoClient;
+    std::string name = "anon";
+    Room* room = nullptr;
+    uint32_t room_index = 0;
+    bool binary = false;
 };
 
 } // namespace chatter
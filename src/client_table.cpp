@@ -0,0 +1,136 @@
+#include "client_table.h"
+
+#include <algorithm>
+#include <cstddef>
+
+namespace chatter {
+
+ClientSlot ClientTable::Insert(sock_t fd)
+{
+    ClientSlot slot;
+    if (!free_slots_.empty())
+    {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    }
+    else if (fds_.size() < MaxSlots)
+    {
+        slot = static_cast<ClientSlot>(fds_.size());
+        fds_.push_back(NoFd);
+        flags_.push_back(0);
+        rooms_.push_back(nullptr);
+        room_indexes_.push_back(0);
+        queues_.emplace_back();
+        compression_.emplace_back();
+        generations_.push_back(0);
+        clients_.emplace_back();
+    }
+    else
+    {
+        return NoSlot;
+    }
+    size_t index = static_cast<size_t>(fd);
+    if (index >= slot_by_fd_.size())
+    {
+        slot_by_fd_.resize(index + 1, NoSlot);
+    }
+    slot_by_fd_[index] = slot;
+    fds_[slot] = fd;
+    flags_[slot] = ClientColor;
+    clients_[slot].slot = slot;
+    clients_[slot].id = MakeId(slot);
+    ++size_;
+    return slot;
+}
+
+void ClientTable::Erase(ClientSlot slot)
+{
+    slot_by_fd_[static_cast<size_t>(fds_[slot])] = NoSlot;
+    fds_[slot] = NoFd;
+    flags_[slot] = 0;
+    rooms_[slot] = nullptr;
+    queues_[slot] = OutboundQueue();
+    compression_[slot] = CompressionState();
+    clients_[slot] = Client();
+    // Wrapping only matters if one slot is reused 4 billion times.
+    ++generations_[slot];
+    free_slots_.push_back(slot);
+    --size_;
+}
+
+void ClientTable::Restore(const std::vector<uint32_t>& generations,
+    const std::vector<std::pair<sock_t, ClientId>>& clients)
+{
+    size_t slots = std::min(generations.size(), static_cast<size_t>(MaxSlots));
+    fds_.assign(slots, NoFd);
+    flags_.assign(slots, 0);
+    rooms_.assign(slots, nullptr);
+    room_indexes_.assign(slots, 0);
+    queues_.resize(slots);
+    compression_.assign(slots, CompressionState());
+    generations_.assign(generations.begin(), generations.begin() + static_cast<std::ptrdiff_t>(slots));
+    clients_.resize(slots);
+    for (const auto& [fd, id] : clients)
+    {
+        if (id == NoClient || id % partitions_ != partition_)
+        {
+            continue;
+        }
+        ClientId key = id / partitions_;
+        ClientSlot slot = static_cast<ClientSlot>(key & (MaxSlots - 1));
+        if (slot >= End() || InUse(slot) || generations_[slot] != (key >> SlotBits))
+        {
+            continue;
+        }
+        size_t index = static_cast<size_t>(fd);
+        if (index >= slot_by_fd_.size())
+        {
+            slot_by_fd_.resize(index + 1, NoSlot);
+        }
+        slot_by_fd_[index] = slot;
+        fds_[slot] = fd;
+        flags_[slot] = ClientColor;
+        clients_[slot].slot = slot;
+        clients_[slot].id = id;
+        ++size_;
+    }
+    // Lowest slots first, as a fresh table would hand them out.
+    for (ClientSlot slot = End(); slot-- > 0;)
+    {
+        if (!InUse(slot))
+        {
+            free_slots_.push_back(slot);
+        }
+    }
+}
+
+ClientSlot ClientTable::FindFd(sock_t fd) const
+{
+    size_t index = static_cast<size_t>(fd);
+    return index < slot_by_fd_.size() ? slot_by_fd_[index] : NoSlot;
+}
+
+ClientSlot ClientTable::FindId(ClientId id) const
+{
+    if (id == NoClient || id % partitions_ != partition_)
+    {
+        return NoSlot;
+    }
+    ClientId key = id / partitions_;
+    ClientSlot slot = static_cast<ClientSlot>(key & (MaxSlots - 1));
+    if (slot >= End() || !InUse(slot) || generations_[slot] != (key >> SlotBits))
+    {
+        return NoSlot;
+    }
+    return slot;
+}
+
+ClientId ClientTable::MakeId(ClientSlot slot) const
+{
+    // A slot's first occupant gets a small id; later ones are told apart by
+    // the generation in the high bits.
+    ClientId key = (static_cast<ClientId>(generations_[slot]) << SlotBits) | slot;
+    return key * partitions_ + partition_;
+}
+
+} // namespace chatter
@@ -0,0 +1,93 @@
+#ifndef CHATTER_CLIENT_TABLE_H_
+#define CHATTER_CLIENT_TABLE_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "client.h"
+#include "mccp.h"
+#include "outbound_queue.h"
+
+namespace chatter {
+
+class Room;
+
+enum ClientFlags : uint16_t
+{
+    ClientColor = 1u << 0,
+    // Waiting for the socket to drain, or with completion I/O, for a send.
+    ClientWriteArmed = 1u << 1,
+    ClientFlushScheduled = 1u << 2,
+    ClientClosing = 1u << 3,
+    // Input is paused until the client's rate limit allows another line.
+    ClientThrottled = 1u << 4,
+    // Input is left over after the client used up its read budget.
+    ClientDeferred = 1u << 5,
+    // Speaks the binary protocol; gets frames instead of text.
+    ClientBinary = 1u << 6,
+    // Everything sent is deflate data (MCCP).
+    ClientCompressed = 1u << 7,
+    // Timed out: nothing more is read or queued, and the client is closed
+    // once what is queued has been sent.
+    ClientDraining = 1u << 8,
+};
+
+// Slot map of one shard's clients. The fields fan-out touches for every
+// recipient are kept column by column; names and buffers sit in a separate
+// Client column. Ids carry the slot's generation, so an id held after its
+// client left never resolves to the slot's next occupant, and end in the
+// table's partition (id % partitions), one per shard of every node.
+class ClientTable
+{
+    public:
+        static constexpr int SlotBits = 20;
+        static constexpr ClientSlot MaxSlots = ClientSlot{1} << SlotBits;
+        ClientTable(size_t partition, size_t partitions) : partition_(partition), partitions_(partitions) { }
+        // Returns NoSlot when the shard is full.
+        ClientSlot Insert(sock_t fd);
+        void Erase(ClientSlot slot);
+        // Rebuilds an empty table from one handed over by a previous process.
+        // Each id names its slot; ids that don't belong here are skipped.
+        void Restore(const std::vector<uint32_t>& generations, const std::vector<std::pair<sock_t, ClientId>>& clients);
+        const std::vector<uint32_t>& GetGenerations() const { return generations_; }
+        ClientSlot FindFd(sock_t fd) const;
+        ClientSlot FindId(ClientId id) const;
+        size_t Size() const { return size_; }
+        // Slots below End() are either in use or on the free list.
+        ClientSlot End() const { return static_cast<ClientSlot>(fds_.size()); }
+        bool InUse(ClientSlot slot) const { return fds_[slot] != NoFd; }
+        sock_t Fd(ClientSlot slot) const { return fds_[slot]; }
+        bool Has(ClientSlot slot, uint16_t flag) const { return (flags_[slot] & flag) != 0; }
+        void Set(ClientSlot slot, uint16_t flag) { flags_[slot] |= flag; }
+        void Clear(ClientSlot slot, uint16_t flag) { flags_[slot] &= static_cast<uint16_t>(~flag); }
+        Room* GetRoom(ClientSlot slot) const { return rooms_[slot]; }
+        void SetRoom(ClientSlot slot, Room* room) { rooms_[slot] = room; }
+        // Index of the client in its room's member array.
+        uint32_t GetRoomIndex(ClientSlot slot) const { return room_indexes_[slot]; }
+        void SetRoomIndex(ClientSlot slot, uint32_t index) { room_indexes_[slot] = index; }
+        OutboundQueue& Queue(ClientSlot slot) { return queues_[slot]; }
+        CompressionState& Compression(ClientSlot slot) { return compression_[slot]; }
+        Client& Info(ClientSlot slot) { return clients_[slot]; }
+        const Client& Info(ClientSlot slot) const { return clients_[slot]; }
+    private:
+        static constexpr sock_t NoFd = static_cast<sock_t>(-1);
+        ClientId MakeId(ClientSlot slot) const;
+        size_t partition_;
+        size_t partitions_;
+        size_t size_ = 0;
+        std::vector<sock_t> fds_;
+        std::vector<uint16_t> flags_;
+        std::vector<Room*> rooms_;
+        std::vector<uint32_t> room_indexes_;
+        std::vector<OutboundQueue> queues_;
+        std::vector<CompressionState> compression_;
+        std::vector<uint32_t> generations_;
+        std::vector<Client> clients_;
+        std::vector<ClientSlot> free_slots_;
+        std::vector<ClientSlot> slot_by_fd_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_CLIENT_TABLE_H_
@@ -1,63 +1,74 @@
 #include "command_handler.h"
 
+#include <cctype>
+#include <charconv>
+#include <ctime>
+
 #include "colors.h"
+#include "message_store.h"
+#include "room_logger.h"
 #include "server.h"
+#include "shard_group.h"
 
 namespace chatter {
 
-std::string CommandHandler::GetToken(std::string& message) const
+std::string_view CommandHandler::GetToken(std::string_view& message) const
 {
-    std::string ret;
-    size_t pos = 0;
-    while (ret.empty() && (pos = message.find(' ')) != std::string::npos)
-    {
-        ret += message.substr(0, pos);
-        message.erase(0, pos + 1);
-    }
-    if (ret.empty())
+    size_t start = message.find_first_not_of(' ');
+    if (start == std::string_view::npos)
     {
-        ret = message;
-        message.erase(0, std::string::npos);
+        message = std::string_view();
+        return message;
     }
-    return ret;
+    size_t end = message.find(' ', start);
+    std::string_view token = message.substr(start, end == std::string_view::npos ? end : end - start);
+    message = end == std::string_view::npos ? std::string_view() : message.substr(end + 1);
+    return token;
 }
 
-bool CommandHandler::SanitizeString(std::string& str, bool lower) const
+bool CommandHandler::IsWord(std::string_view str) const
 {
-    for (size_t i = 0; i < str.size();)
+    for (char c : str)
     {
-        if (str[i] < 32)
+        if (!isalpha(static_cast<unsigned char>(c)))
         {
-            str.erase(str.begin() + i);
-            continue;
-        }
-        if (!isalpha(str[i]))
-        {
-            str.erase(0, std::string::npos);
             return false;
         }
-        if (lower)
-        {
-            str[i] = tolower(str[i]);
-        }
-        ++i;
     }
     return true;
 }
 
-void CommandHandler::ParseCommand(Client& client, std::string& message)
+std::string CommandHandler::ToLower(std::string_view str) const
+{
+    std::string lower(str);
+    for (char& c : lower)
+    {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return lower;
+}
+
+bool CommandHandler::IsExpensive(std::string_view message) const
+{
+    std::string_view name = GetToken(message);
+    Command command;
+    return IsWord(name) && FindCommand(name, command) && IsExpensiveCommand(command);
+}
+
+void CommandHandler::ParseCommand(Client& client, std::string_view message)
 {
-    std::string command = GetToken(message);
-    if (!SanitizeString(command, true))
+    std::string_view name = GetToken(message);
+    Command command;
+    if (!IsWord(name))
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Invalid command.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Invalid command.\r\n");
         return;
     }
 
     /* COMMANDS */
-    if (chatter::Commands.find(command) != chatter::Commands.end())
+    if (FindCommand(name, command))
     {
-        switch (chatter::Commands.at(command))
+        switch (command)
         {
             case Command::NAME:
             {
@@ -99,6 +110,16 @@ void CommandHandler::ParseCommand(Client& client, std::string& message)
                 Color(client);
                 break;
             }
+            case Command::STATS:
+            {
+                Stats(client);
+                break;
+            }
+            case Command::HISTORY:
+            {
+                History(client, message);
+                break;
+            }
             case Command::HELP:
             {
                 Help(client);
@@ -108,119 +129,114 @@ void CommandHandler::ParseCommand(Client& client, std::string& message)
     }
     else
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Unknown command.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Unknown command.\r\n");
     }
 }
 
-void CommandHandler::Who(const Client& client, std::string& message) const
+void CommandHandler::Who(const Client& client, std::string_view message) const
 {
-    std::string room_name = GetToken(message);
+    std::string_view token = GetToken(message);
     std::string out;
-    if (!SanitizeString(room_name, true))
+    if (!IsWord(token))
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Invalid room name.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Invalid room name.\r\n");
         return;
     }
-    if (!room_name.empty())
-    {
-        if (server_->rooms_.find(room_name) == server_->rooms_.end())
-        {
-            server_->SendToClient(client.fd, "", chatter::colors::Red, "Room \"" + room_name + "\" doesn't exist!\r\n");
-            return;
-        }
-        else
-        {
-            room_name = room_name;
-        }
-    }
-    else
+    std::string room_name = token.empty() ? server_->GetRoom(client).GetName() : ToLower(token);
+    const Room* room = server_->FindRoom(room_name);
+    if (room == nullptr)
     {
-        room_name = client.room_name;
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Room \"" + room_name + "\" doesn't exist!\r\n");
+        return;
     }
     out += "Members of room \"" + room_name + "\":\r\n";
-    for (auto member_fd : server_->rooms_.at(room_name).GetMembers())
+    for (const Room::LocalMember& member : room->GetLocalMembers())
     {
-        out += "[" + std::to_string(member_fd) + "]" + server_->clients_.at(member_fd).name;
-        if (member_fd == client.fd)
+        out += "[" + std::to_string(member.id) + "]" + server_->clients_.Info(member.slot).name;
+        if (member.id == client.id)
         {
             out += " (you)";
         }
         out += "\r\n";
     }
-    server_->SendToClient(client.fd, "", chatter::colors::None, out);
+    for (const RemoteClient* remote : room->GetRemoteMembers())
+    {
+        out += "[" + std::to_string(remote->id) + "]" + remote->name + "\r\n";
+    }
+    server_->SendToClient(client.slot, "", chatter::colors::None, out);
 }
 
-void CommandHandler::Name(Client& client, std::string& message)
+void CommandHandler::Name(Client& client, std::string_view message)
 {
-    std::string new_name = GetToken(message);
-    if (!SanitizeString(new_name))
+    std::string_view new_name = GetToken(message);
+    if (!IsWord(new_name))
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Invalid name.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Invalid name.\r\n");
         return;
     }
     if (!new_name.empty())
     {
-        std::string out = "[" + std::to_string(client.fd) + "]" + client.name + " is now known as ";
-        client.name = new_name;
-        server_->SendToClient(client.fd, "", chatter::colors::None, "Your new name is " + client.name + ".\r\n");
-        out += client.name + ".\r\n";
-        server_->rooms_.at(client.room_name).BroadCastMessage(client.fd, chatter::colors::Yellow, out);
+        std::string out = "[" + std::to_string(client.id) + "]" + client.name + " is now known as ";
+        client.name.assign(new_name);
+        server_->PublishRename(client);
+        server_->SendToClient(client.slot, "", chatter::colors::None, "Your new name is " + client.name + ".\r\n");
+        server_->GetRoom(client).QueuePresence(PresenceKind::RENAMED, client.id, out + client.name);
     }
     else
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Please specify a new name.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Please specify a new name.\r\n");
     }
 }
 
 void CommandHandler::Rooms(const Client& client) const
 {
     std::string out = "Rooms (members):\r\n";
-    for (const auto& room : server_->rooms_)
+    for (const auto& [name, room] : server_->rooms_)
     {
-        out += room.first + " (" + std::to_string(room.second.GetMembers().size()) + ")\r\n";
+        if (!room.IsIdle())
+        {
+            out += name + " (" + std::to_string(room.GetMemberCount()) + ")\r\n";
+        }
     }
-    server_->SendToClient(client.fd, "", chatter::colors::None, out);
+    server_->SendToClient(client.slot, "", chatter::colors::None, out);
 }
 
-void CommandHandler::Join(Client& client, std::string& message)
+void CommandHandler::Join(Client& client, std::string_view message)
 {
-    std::string new_room = GetToken(message);
-    if (!SanitizeString(new_room, true))
+    std::string_view token = GetToken(message);
+    if (!IsWord(token))
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Invalid room name.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Invalid room name.\r\n");
         return;
     }
-    if (!new_room.empty())
+    if (!token.empty())
     {
-        if (client.room_name == new_room)
+        std::string new_room = ToLower(token);
+        if (server_->GetRoom(client).GetName() == new_room)
         {
-            server_->SendToClient(client.fd, "", chatter::colors::Red, "You are already in that room.\r\n");
+            server_->SendToClient(client.slot, "", chatter::colors::Red, "You are already in that room.\r\n");
         }
         else
         {
-            std::string password = GetToken(message);
+            std::string password(GetToken(message));
             if (new_room == "global")
             {
                 password.clear();
             }
-            if (!password.empty())
-            {
-                password.erase(password.size() - 2, std::string::npos); // remove newline
-            }
             server_->AddClientToRoom(client, new_room, password);
         }
     }
     else
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Please specify a room to join.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Please specify a room to join.\r\n");
     }
 }
 
 void CommandHandler::Leave(Client& client)
 {
-    if (client.room_name == "global")
+    if (server_->GetRoom(client).GetName() == "global")
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "You are already in the global room.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "You are already in the global room.\r\n");
     }
     else
     {
@@ -228,58 +244,176 @@ void CommandHandler::Leave(Client& client)
     }
 }
 
-void CommandHandler::Tell(const Client& client, std::string& message) const
+void CommandHandler::Tell(const Client& client, std::string_view message) const
 {
-    int dest_fd;
-    try
-    {
-        dest_fd = std::stoi(GetToken(message));
-    }
-    catch (...)
+    ClientId dest_id;
+    std::string_view dest = GetToken(message);
+    auto [end, error] = std::from_chars(dest.data(), dest.data() + dest.size(), dest_id);
+    if (dest.empty() || error != std::errc() || end != dest.data() + dest.size())
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "Please enter a valid recipient number.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Please enter a valid recipient number.\r\n");
         return;
     }
-    if (server_->clients_.find(dest_fd) == server_->clients_.end())
+    const Client* local_dest = server_->FindLocalClient(dest_id);
+    if (local_dest == nullptr && server_->remote_clients_.find(dest_id) == server_->remote_clients_.end())
     {
-        server_->SendToClient(client.fd, "", chatter::colors::Red, "User #" + std::to_string(dest_fd) + " does not exist.\r\n");
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "User #" + std::to_string(dest_id) + " does not exist.\r\n");
     }
     else
     {
         if (!message.empty())
         {
-            Client& dest = server_->clients_.at(dest_fd);
             std::string timestamp = server_->GetTimestamp();
-            server_->SendToClient(client.fd, timestamp, chatter::colors::Magenta, ">>[" +
-                std::to_string(dest_fd) + "]" + dest.name + " : " + message);
-            server_->SendToClient(dest.fd, timestamp, chatter::colors::Magenta, "[" +
-                std::to_string(client.fd) + "]" + client.name + ">> " + message);
+            std::string dest_name = server_->GetClientName(dest_id);
+            std::string text(message);
+            text += "\r\n";
+            server_->SendToClient(client.slot, timestamp, chatter::colors::Magenta, ">>[" +
+                std::to_string(dest_id) + "]" + dest_name + " : " + text,
+                {FrameKind::TELL, 1, dest_id, dest_name, {}, message});
+            std::string out = "[" + std::to_string(client.id) + "]" + client.name + ">> " + text;
+            FrameFields fields{FrameKind::TELL, 0, client.id, client.name, {}, message};
+            if (local_dest != nullptr)
+            {
+                server_->SendToClient(local_dest->slot, timestamp, chatter::colors::Magenta, out, fields);
+            }
+            else
+            {
+                ShardMessage tell;
+                tell.type = ShardMessage::Type::TELL;
+                tell.client = client.id;
+                tell.target = dest_id;
+                tell.rendered = RenderMessage(timestamp, chatter::colors::Magenta, out, fields);
+                size_t node = server_->NodeOf(dest_id);
+                if (node != server_->GetNodeId())
+                {
+                    server_->PostToNode(node, std::move(tell));
+                }
+                else
+                {
+                    server_->Post(server_->ShardOf(dest_id), std::move(tell));
+                }
+            }
         }
     }
 }
 
 void CommandHandler::Random(const Client& client) const
 {
-    std::string out = "[" + std::to_string(client.fd) + "]Random! " + client.name +
-        " rolled " + std::to_string(rand() % 100) + ".\r\n" + chatter::colors::Reset;
-    server_->rooms_.at(client.room_name).BroadCastMessage(server_->server_fd_, chatter::colors::Yellow, out);
+    std::string text = "Random! " + client.name + " rolled " + std::to_string(rand() % 100) + ".";
+    std::string out = "[" + std::to_string(client.id) + "]" + text + "\r\n" + chatter::colors::Reset;
+    Room& room = server_->GetRoom(client);
+    room.BroadCastMessage(NoClient, chatter::colors::Yellow, out,
+        {FrameKind::NOTICE, 0, client.id, client.name, room.GetName(), text});
 }
 
 void CommandHandler::Color(Client& client)
 {
-    client.color = !client.color;
-    std::string color_display = client.color ? "enabled" : "disabled";
-    server_->SendToClient(client.fd, "", chatter::colors::None, "Color is now " + color_display + ".\r\n");
+    bool color = !server_->clients_.Has(client.slot, ClientColor);
+    if (color)
+    {
+        server_->clients_.Set(client.slot, ClientColor);
+    }
+    else
+    {
+        server_->clients_.Clear(client.slot, ClientColor);
+    }
+    std::string color_display = color ? "enabled" : "disabled";
+    server_->SendToClient(client.slot, "", chatter::colors::None, "Color is now " + color_display + ".\r\n");
+}
+
+void CommandHandler::Stats(const Client& client) const
+{
+    server_->SendToClient(client.slot, "", chatter::colors::None, server_->group_->GetStatsReport());
+}
+
+void CommandHandler::History(const Client& client, std::string_view message) const
+{
+    size_t lines = server_->history_arena_.GetLines();
+    std::string_view count = GetToken(message);
+    std::string_view to = GetToken(message);
+    if (!to.empty())
+    {
+        StoredHistory(client, count, to);
+        return;
+    }
+    if (!count.empty())
+    {
+        auto [end, error] = std::from_chars(count.data(), count.data() + count.size(), lines);
+        if (error != std::errc() || end != count.data() + count.size() || lines == 0)
+        {
+            server_->SendToClient(client.slot, "", chatter::colors::Red, "Please enter a valid number of lines.\r\n");
+            return;
+        }
+    }
+    if (server_->GetRoom(client).ReplayHistory(client.slot, lines) == 0)
+    {
+        server_->SendToClient(client.slot, "", chatter::colors::None, "No history in this room.\r\n");
+    }
+}
+
+void CommandHandler::StoredHistory(const Client& client, std::string_view from, std::string_view to) const
+{
+    const RoomLogger* logger = server_->group_->GetLogger();
+    std::string directory = logger != nullptr ? logger->GetStoreDirectory(server_->GetRoom(client).GetName()) : "";
+    if (directory.empty())
+    {
+        server_->SendToClient(client.slot, "", chatter::colors::Red, "Messages are not stored on this server.\r\n");
+        return;
+    }
+    uint64_t from_seq;
+    uint64_t to_seq;
+    int64_t from_us;
+    int64_t to_us;
+    auto [from_end, from_error] = std::from_chars(from.data(), from.data() + from.size(), from_seq);
+    auto [to_end, to_error] = std::from_chars(to.data(), to.data() + to.size(), to_seq);
+    bool by_seq = from_error == std::errc() && from_end == from.data() + from.size() &&
+        to_error == std::errc() && to_end == to.data() + to.size();
+    time_t now = time(nullptr);
+    if (!by_seq && (!ParseStoreTime(from, now, false, from_us) || !ParseStoreTime(to, now, true, to_us)))
+    {
+        server_->SendToClient(client.slot, "", chatter::colors::Red,
+            "Please enter two times (HH:MM[:SS] or YYYY-MM-DDTHH:MM[:SS]) or two message #s.\r\n");
+        return;
+    }
+    std::string out;
+    size_t shown = 0;
+    auto visit = [&](const StoredMessage& message)
+    {
+        if (shown++ < MaxStoredHistoryLines)
+        {
+            out += "#" + std::to_string(message.seq) + " ";
+            out.append(message.text);
+        }
+    };
+    StoreReader reader(directory);
+    if (by_seq)
+    {
+        reader.ReadBySeq(from_seq, to_seq, MaxStoredHistoryLines + 1, visit);
+    }
+    else
+    {
+        reader.ReadByTime(from_us, to_us, MaxStoredHistoryLines + 1, visit);
+    }
+    if (shown == 0)
+    {
+        out = "No logged messages in that range.\r\n";
+    }
+    else if (shown > MaxStoredHistoryLines)
+    {
+        out += "More messages follow; ask for a narrower range.\r\n";
+    }
+    server_->SendToClient(client.slot, "", chatter::colors::None, out);
 }
 
 void CommandHandler::Help(const Client& client) const
 {
     std::string out;
-    for (const auto& help_text : chatter::HelpText)
+    for (std::string_view help_text : chatter::HelpText)
     {
-        out += help_text + "\r\n";
+        out.append(help_text);
+        out += "\r\n";
     }
-    server_->SendToClient(client.fd, "", chatter::colors::None, out);
+    server_->SendToClient(client.slot, "", chatter::colors::None, out);
 }
 
 } // namespace chatter
@@ -1,9 +1,11 @@
 #ifndef CHATTER_COMMAND_HANDLER_H_
 #define CHATTER_COMMAND_HANDLER_H_
 
+#include <array>
+#include <cstdint>
+#include <iterator>
 #include <string>
-#include <unordered_map>
-#include <vector>
+#include <string_view>
 
 #include "client.h"
 
@@ -21,10 +23,18 @@ enum class Command
     TELL,
     RANDOM,
     COLOR,
+    STATS,
+    HISTORY,
     HELP,
 };
 
-const std::unordered_map<std::string, Command> Commands
+struct CommandName
+{
+    std::string_view name;
+    Command command;
+};
+
+constexpr CommandName Commands[]
 {
     {"name", Command::NAME},
     {"who", Command::WHO},
@@ -34,10 +44,12 @@ const std::unordered_map<std::string, Command> Commands
     {"tell", Command::TELL},
     {"random", Command::RANDOM},
     {"color", Command::COLOR},
+    {"stats", Command::STATS},
+    {"history", Command::HISTORY},
     {"help", Command::HELP},
 };
 
-const std::vector<std::string> HelpText
+constexpr std::string_view HelpText[]
 {
     "/name <name>            : Change your display name.",
     "/who                    : List users in current room.",
@@ -49,25 +61,121 @@ const std::vector<std::string> HelpText
     "/tell <#> <message>     : Send a direct message to the specified user #.",
     "/random                 : Roll a random number from 0 to 99.",
     "/color                  : Toggles color display.",
+    "/stats                  : Show server statistics.",
+    "/history [n]            : Show the last n messages of the current room.",
+    "/history <from> <to>    : Show logged messages between two times or #s.",
     "/help                   : Display available commands.",
 };
 
+// Commands that scan rooms, members or the store are charged to the command
+// rate limit; the rest are free.
+constexpr bool IsExpensiveCommand(Command command)
+{
+    return command == Command::WHO || command == Command::ROOMS || command == Command::JOIN ||
+        command == Command::HISTORY;
+}
+
+// Most logged messages one /history <from> <to> sends back.
+constexpr size_t MaxStoredHistoryLines = 200;
+
+// Perfect hash over Commands: the seed is searched at compile time so every
+// name gets its own slot. Names are hashed case-folded.
+constexpr size_t CommandSlots = 32;
+
+constexpr uint32_t HashCommand(std::string_view name, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name)
+    {
+        hash = (hash ^ static_cast<uint8_t>(c | 0x20)) * 16777619u;
+    }
+    return hash % CommandSlots;
+}
+
+constexpr bool IsPerfectCommandSeed(uint32_t seed)
+{
+    bool used[CommandSlots] = {};
+    for (const CommandName& entry : Commands)
+    {
+        uint32_t slot = HashCommand(entry.name, seed);
+        if (used[slot])
+        {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t FindCommandSeed()
+{
+    uint32_t seed = 0;
+    while (!IsPerfectCommandSeed(seed))
+    {
+        ++seed;
+    }
+    return seed;
+}
+
+constexpr uint32_t CommandSeed = FindCommandSeed();
+
+constexpr std::array<int8_t, CommandSlots> MakeCommandTable()
+{
+    std::array<int8_t, CommandSlots> table{};
+    for (int8_t& slot : table)
+    {
+        slot = -1;
+    }
+    for (size_t i = 0; i < std::size(Commands); ++i)
+    {
+        table[HashCommand(Commands[i].name, CommandSeed)] = static_cast<int8_t>(i);
+    }
+    return table;
+}
+
+constexpr std::array<int8_t, CommandSlots> CommandTable = MakeCommandTable();
+
+// Case-insensitive; `name` must be alphabetic.
+constexpr bool FindCommand(std::string_view name, Command& command)
+{
+    int8_t index = CommandTable[HashCommand(name, CommandSeed)];
+    if (index < 0 || Commands[index].name.size() != name.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        if ((name[i] | 0x20) != Commands[index].name[i])
+        {
+            return false;
+        }
+    }
+    command = Commands[index].command;
+    return true;
+}
+
 class CommandHandler
 {
     public:
         CommandHandler(Server& server) : server_(&server) { };
-        void ParseCommand(Client& client, std::string& command);
+        // `message` is the line after the leading '/', without its line ending.
+        void ParseCommand(Client& client, std::string_view message);
+        bool IsExpensive(std::string_view message) const;
     private:
-        std::string GetToken(std::string& message) const;
-        bool SanitizeString(std::string& str, bool lower = false) const;
-        void Who(const Client& client, std::string& message) const;
-        void Name(Client& client, std::string& message);
+        std::string_view GetToken(std::string_view& message) const;
+        bool IsWord(std::string_view str) const;
+        std::string ToLower(std::string_view str) const;
+        void Who(const Client& client, std::string_view message) const;
+        void Name(Client& client, std::string_view message);
         void Rooms(const Client& client) const;
-        void Join(Client& client, std::string& message);
+        void Join(Client& client, std::string_view message);
         void Leave(Client& client);
-        void Tell(const Client& client, std::string& message) const;
+        void Tell(const Client& client, std::string_view message) const;
         void Random(const Client& client) const;
         void Color(Client& client);
+        void Stats(const Client& client) const;
+        void History(const Client& client, std::string_view message) const;
+        void StoredHistory(const Client& client, std::string_view from, std::string_view to) const;
         void Help(const Client& client) const;
         Server* server_;
 };
@@ -0,0 +1,71 @@
+#ifndef CHATTER_COMPLETION_IO_H_
+#define CHATTER_COMPLETION_IO_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "outbound_queue.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    typedef SOCKET sock_t;
+#else
+    #include <sys/socket.h>
+    typedef int sock_t;
+#endif
+
+namespace chatter {
+
+struct Completion
+{
+    enum class Type
+    {
+        ACCEPT,
+        RECEIVE,
+        SEND,
+    };
+    Type type;
+    // The tag given to Receive() or Send().
+    uint64_t tag;
+    // A new socket, a byte count or -errno.
+    int result;
+    // Received bytes; valid until the next Wait().
+    const char* data;
+    // The multishot request that produced this is still armed.
+    bool more;
+};
+
+// Client socket I/O run by the event loop itself rather than signalled as
+// readiness. Requests queued between two Wait() calls are submitted together
+// by the next one, and their results come back from GetCompletions().
+class CompletionIo
+{
+    public:
+        virtual ~CompletionIo() = default;
+        // Keeps accepting until it reports a completion without `more`.
+        virtual void Accept(sock_t listen_fd) = 0;
+        // Keeps receiving into shared buffers until it reports a completion
+        // without `more`.
+        virtual void Receive(sock_t fd, uint64_t tag) = 0;
+        virtual void CancelReceive(uint64_t tag) = 0;
+        // Sends the head of the queue. The payloads are held until the send
+        // completes; one send per socket may be in flight.
+        virtual void Send(sock_t fd, uint64_t tag, OutboundQueue& queue) = 0;
+        // Ends every request on the socket, an accept included; those not
+        // done already complete with -ECANCELED.
+        virtual void Cancel(sock_t fd) = 0;
+        // Cancels the socket's requests and then closes it.
+        virtual void Close(sock_t fd) = 0;
+        virtual const std::vector<Completion>& GetCompletions() const = 0;
+        // Where an accepted socket connects from; false if it was reset.
+        virtual bool GetPeerAddress(sock_t fd, sockaddr_storage& addr)
+        {
+            socklen_t addr_size = sizeof addr;
+            return getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &addr_size) == 0;
+        }
+};
+
+} // namespace chatter
+
+#endif // CHATTER_COMPLETION_IO_H_
@@ -0,0 +1,75 @@
+#ifndef CHATTER_CONFIG_H_
+#define CHATTER_CONFIG_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "handoff.h"
+#include "history.h"
+#include "line_buffer.h"
+#include "outbound_queue.h"
+#include "presence.h"
+#include "rate_limit.h"
+#include "room_logger.h"
+
+namespace chatter {
+
+// The kernel caps this at net.core.somaxconn.
+constexpr int DefaultBacklog = 1024;
+constexpr int DefaultKeepaliveSeconds = 60;
+
+// Input one client may have handled per loop iteration, and all clients
+// together, before the rest waits for the next one. 0 is unlimited.
+struct ReadBudget
+{
+    size_t bytes = 16384;
+    size_t lines = 32;
+    size_t tick_lines = 1024;
+};
+
+struct Config
+{
+    std::string port;
+    int backlog = DefaultBacklog;
+    bool enable_logs = false;
+    LoggerOptions logger_options;
+    Backend backend = DefaultBackend;
+    // Builds each shard's event loop in place of `backend`; benchmarks pass
+    // one that keeps clients in memory.
+    std::function<std::unique_ptr<EventLoop>()> make_event_loop;
+    size_t threads = 1;
+    OutboundLimits outbound_limits;
+    bool cork_output = false;
+    size_t max_line_length = MaxLineLength;
+    // zlib level for clients that accept MCCP; 0 doesn't offer it.
+    int compression_level = 0;
+    std::string admin_port;
+    size_t history_lines = DefaultHistoryLines;
+    size_t history_bytes = DefaultHistoryBytes;
+    int presence_window_ms = DefaultPresenceWindowMs;
+    size_t presence_max_members = DefaultPresenceMaxMembers;
+    RateLimits rate_limits;
+    ReadBudget read_budget;
+    // 0 disables each of these.
+    int idle_timeout_s = 0;
+    int keepalive_s = DefaultKeepaliveSeconds;
+    int handshake_timeout_s = 0;
+    // Peer link address of every node in the federation, and which of them
+    // this is. Empty for a standalone server.
+    std::vector<std::string> nodes;
+    size_t node_id = 0;
+    // Unix socket a new process connects to in order to take over, and
+    // whether this process is that new one.
+    std::string handoff_path;
+    bool take_over = false;
+    // How long the old process waits for the new one, with every thread
+    // stopped, before it gives up and resumes.
+    int handoff_ack_ms = DefaultHandoffAckMs;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_CONFIG_H_
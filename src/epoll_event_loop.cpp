@@ -0,0 +1,122 @@
+#include "epoll_event_loop.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+namespace chatter {
+
+namespace {
+
+uint32_t ToEpollEvents(unsigned events, bool edge_triggered)
+{
+    uint32_t ret = 0;
+    if (events & EventRead)
+    {
+        ret |= EPOLLIN;
+    }
+    if (events & EventWrite)
+    {
+        ret |= EPOLLOUT;
+    }
+    if (edge_triggered)
+    {
+        ret |= EPOLLET;
+    }
+    return ret;
+}
+
+unsigned FromEpollEvents(uint32_t revents)
+{
+    unsigned ret = 0;
+    if (revents & EPOLLIN)
+    {
+        ret |= EventRead;
+    }
+    if (revents & EPOLLOUT)
+    {
+        ret |= EventWrite;
+    }
+    if (revents & EPOLLHUP)
+    {
+        ret |= EventHangup;
+    }
+    if (revents & EPOLLERR)
+    {
+        ret |= EventError;
+    }
+    return ret;
+}
+
+} // namespace
+
+EpollEventLoop::EpollEventLoop()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), ready_(chatter::MaxEpollEvents)
+{
+    if (epoll_fd_ == -1)
+    {
+        perror("epoll_create1");
+    }
+}
+
+EpollEventLoop::~EpollEventLoop()
+{
+    if (epoll_fd_ != -1)
+    {
+        close(epoll_fd_);
+    }
+}
+
+bool EpollEventLoop::Add(sock_t fd, unsigned events, bool edge_triggered)
+{
+    epoll_event ev{};
+    ev.events = ToEpollEvents(events, edge_triggered);
+    ev.data.fd = fd;
+    ++syscalls_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl: add");
+        return false;
+    }
+    return true;
+}
+
+bool EpollEventLoop::Modify(sock_t fd, unsigned events, bool edge_triggered)
+{
+    epoll_event ev{};
+    ev.events = ToEpollEvents(events, edge_triggered);
+    ev.data.fd = fd;
+    ++syscalls_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl: mod");
+        return false;
+    }
+    return true;
+}
+
+void EpollEventLoop::Remove(sock_t fd)
+{
+    // Closing the fd drops it from the interest list too; ignore ENOENT/EBADF.
+    ++syscalls_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int EpollEventLoop::Wait(std::vector<Event>& events, int timeout_ms)
+{
+    events.clear();
+    ++syscalls_;
+    int count = epoll_wait(epoll_fd_, ready_.data(), static_cast<int>(ready_.size()), timeout_ms);
+    if (count == -1)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        events.push_back({ready_[i].data.fd, FromEpollEvents(ready_[i].events)});
+    }
+    return count;
+}
+
+} // namespace chatter
@@ -0,0 +1,36 @@
+#ifndef CHATTER_EPOLL_EVENT_LOOP_H_
+#define CHATTER_EPOLL_EVENT_LOOP_H_
+
+#include <sys/epoll.h>
+
+#include <vector>
+
+#include "event_loop.h"
+
+namespace chatter {
+
+constexpr int MaxEpollEvents = 1024;
+
+// Linux backend: the kernel keeps the interest list, so a wakeup costs
+// O(ready) rather than O(registered) descriptors.
+class EpollEventLoop : public EventLoop
+{
+    public:
+        EpollEventLoop();
+        ~EpollEventLoop() override;
+        bool IsValid() const { return epoll_fd_ != -1; }
+        int GetFd() const { return epoll_fd_; }
+        bool Add(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        bool Modify(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        void Remove(sock_t fd) override;
+        int Wait(std::vector<Event>& events, int timeout_ms) override;
+        const char* Name() const override { return "epoll"; }
+        bool IsEdgeTriggered() const override { return true; }
+    private:
+        int epoll_fd_;
+        std::vector<epoll_event> ready_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_EPOLL_EVENT_LOOP_H_
@@ -0,0 +1,64 @@
+#include "event_loop.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "poll_event_loop.h"
+#ifdef __linux__
+    #include "epoll_event_loop.h"
+#endif
+#ifdef CHATTER_HAVE_URING
+    #include "uring_event_loop.h"
+#endif
+
+namespace chatter {
+
+std::unique_ptr<EventLoop> MakeEventLoop(Backend backend)
+{
+#ifdef CHATTER_HAVE_URING
+    if (backend == Backend::URING)
+    {
+        auto loop = std::make_unique<UringEventLoop>();
+        if (loop->IsValid())
+        {
+            return loop;
+        }
+        fprintf(stderr, "io_uring unavailable, using epoll\r\n");
+    }
+#endif
+#ifdef __linux__
+    if (backend == Backend::EPOLL || backend == Backend::URING)
+    {
+        auto loop = std::make_unique<EpollEventLoop>();
+        if (loop->IsValid())
+        {
+            return loop;
+        }
+    }
+#else
+    (void)backend;
+#endif
+    return std::make_unique<PollEventLoop>();
+}
+
+bool ParseBackend(const char* name, Backend& backend)
+{
+    if (strcmp(name, "poll") == 0)
+    {
+        backend = Backend::POLL;
+        return true;
+    }
+    if (strcmp(name, "epoll") == 0)
+    {
+        backend = Backend::EPOLL;
+        return true;
+    }
+    if (strcmp(name, "uring") == 0)
+    {
+        backend = Backend::URING;
+        return true;
+    }
+    return false;
+}
+
+} // namespace chatter
@@ -0,0 +1,70 @@
+#ifndef CHATTER_EVENT_LOOP_H_
+#define CHATTER_EVENT_LOOP_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "client.h"
+#include "completion_io.h"
+
+namespace chatter {
+
+enum EventFlags : unsigned
+{
+    EventRead = 1u << 0,
+    EventWrite = 1u << 1,
+    EventHangup = 1u << 2,
+    EventError = 1u << 3,
+};
+
+struct Event
+{
+    sock_t fd;
+    unsigned events;
+};
+
+enum class Backend
+{
+    POLL,
+    EPOLL,
+    URING,
+};
+
+// Readiness notification over a set of sockets. Wait() fills `events` with
+// only the sockets that are ready, so callers never scan idle descriptors.
+class EventLoop
+{
+    public:
+        virtual ~EventLoop() = default;
+        virtual bool Add(sock_t fd, unsigned events, bool edge_triggered = false) = 0;
+        virtual bool Modify(sock_t fd, unsigned events, bool edge_triggered = false) = 0;
+        virtual void Remove(sock_t fd) = 0;
+        virtual int Wait(std::vector<Event>& events, int timeout_ms) = 0;
+        virtual const char* Name() const = 0;
+        // Whether edge_triggered is honoured. Otherwise a socket keeps being
+        // reported for as long as it has unread input.
+        virtual bool IsEdgeTriggered() const { return false; }
+        // Non-null when client sockets should be accepted, read and written
+        // through the loop instead of being added to it.
+        virtual CompletionIo* GetCompletionIo() { return nullptr; }
+        // System calls made by the loop itself.
+        virtual uint64_t GetSyscalls() const { return syscalls_; }
+    protected:
+        uint64_t syscalls_ = 0;
+};
+
+// Falls back from io_uring to epoll to poll when the requested backend is
+// unavailable on this platform or kernel.
+std::unique_ptr<EventLoop> MakeEventLoop(Backend backend);
+bool ParseBackend(const char* name, Backend& backend);
+
+#ifdef __linux__
+constexpr Backend DefaultBackend = Backend::EPOLL;
+#else
+constexpr Backend DefaultBackend = Backend::POLL;
+#endif
+
+} // namespace chatter
+
+#endif // CHATTER_EVENT_LOOP_H_
@@ -0,0 +1,642 @@
+#include "federation.h"
+
+#ifdef _WIN32
+    #include <ws2tcpip.h>
+    #define close closesocket
+    #define ioctl ioctlsocket
+#else
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/ioctl.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+    constexpr int INVALID_SOCKET = -1;
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "wire_format.h"
+
+namespace chatter {
+
+namespace {
+
+// A frame is a u32 length of the rest, a u8 kind and the message fields:
+// client and target as u64, created as u8, then name, room and password as
+// a u32 length and the bytes, the rendered message's u64 serial and its
+// renderings the same way. A history reply then has a u32 count of lines,
+// each as a serial and renderings. Integers are little-endian.
+// Kind 0 is the hello a dialling node opens with, carrying its index as the
+// client; the others are 1 + ShardMessage::Type.
+constexpr uint8_t HelloKind = 0;
+constexpr uint8_t HistoryKind = 1 + static_cast<uint8_t>(ShardMessage::Type::HISTORY);
+constexpr uint8_t LastKind = 1 + static_cast<uint8_t>(ShardMessage::Type::BINARY);
+// A hello's length, fixed fields, three empty strings, a zero serial and
+// three empty renderings.
+constexpr size_t HelloBytes = 4 + 1 + 8 + 8 + 1 + 3 * 4 + 8 + 3 * 4;
+// Enough for one frame of the largest size.
+constexpr size_t MaxPeerInputBytes = 4 + MaxPeerFrameBytes;
+constexpr size_t ReadChunk = 65536;
+
+bool WouldBlock()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool ConnectInProgress()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+void PutPayload(std::string& out, const Payload& payload)
+{
+    if (payload != nullptr)
+    {
+        PutString(out, *payload);
+    }
+    else
+    {
+        PutU32(out, 0);
+    }
+}
+
+bool GetPayload(WireReader& reader, Payload& payload)
+{
+    std::string bytes;
+    if (!reader.GetString(bytes))
+    {
+        return false;
+    }
+    payload = bytes.empty() ? nullptr : std::make_shared<const std::string>(std::move(bytes));
+    return true;
+}
+
+void PutRendered(std::string& out, const RenderedMessage& rendered)
+{
+    PutU64(out, rendered.serial);
+    PutPayload(out, rendered.color);
+    PutPayload(out, rendered.plain);
+    PutPayload(out, rendered.binary);
+}
+
+bool GetRendered(WireReader& reader, RenderedMessage& rendered)
+{
+    return reader.GetU64(rendered.serial) && GetPayload(reader, rendered.color) && GetPayload(reader, rendered.plain) &&
+        GetPayload(reader, rendered.binary);
+}
+
+void Encode(std::string& out, uint8_t kind, const ShardMessage& message)
+{
+    size_t start = out.size();
+    PutU32(out, 0);
+    out.push_back(static_cast<char>(kind));
+    PutU64(out, message.client);
+    PutU64(out, message.target);
+    out.push_back(message.created ? 1 : 0);
+    PutString(out, message.name);
+    PutString(out, message.room);
+    PutString(out, message.password);
+    PutRendered(out, message.rendered);
+    if (kind == HistoryKind)
+    {
+        PutU32(out, static_cast<uint32_t>(message.history.size()));
+        for (const RenderedMessage& line : message.history)
+        {
+            PutRendered(out, line);
+        }
+    }
+    uint32_t size = static_cast<uint32_t>(out.size() - start - 4);
+    for (size_t i = 0; i < 4; ++i)
+    {
+        out[start + i] = static_cast<char>(size >> (8 * i));
+    }
+}
+
+bool Decode(const char* data, size_t size, uint8_t& kind, ShardMessage& message)
+{
+    WireReader reader(data, size);
+    uint8_t created;
+    if (!reader.GetU8(kind) || kind > LastKind || !reader.GetU64(message.client) ||
+        !reader.GetU64(message.target) || !reader.GetU8(created) || !reader.GetString(message.name) ||
+        !reader.GetString(message.room) || !reader.GetString(message.password) ||
+        !GetRendered(reader, message.rendered))
+    {
+        return false;
+    }
+    message.history.clear();
+    if (kind == HistoryKind)
+    {
+        uint32_t count;
+        if (!reader.GetU32(count))
+        {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            RenderedMessage line;
+            if (!GetRendered(reader, line) || line.plain == nullptr)
+            {
+                return false;
+            }
+            message.history.push_back(std::move(line));
+        }
+    }
+    if (kind != HelloKind)
+    {
+        message.type = static_cast<ShardMessage::Type>(kind - 1);
+    }
+    message.created = created != 0;
+    message.relay = NoNode;
+    return true;
+}
+
+// Takes one complete frame off the front of `input`, starting at `offset`.
+// Returns false when the frame is incomplete; `bad` is set if it never will be.
+bool NextFrame(const std::string& input, size_t& offset, const char*& frame, size_t& size, bool& bad)
+{
+    if (input.size() - offset < 4)
+    {
+        return false;
+    }
+    uint32_t length = 0;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        length |= static_cast<uint32_t>(static_cast<uint8_t>(input[offset + i])) << (8 * i);
+    }
+    if (length > MaxPeerFrameBytes)
+    {
+        bad = true;
+        return false;
+    }
+    if (input.size() - offset - 4 < length)
+    {
+        return false;
+    }
+    frame = input.data() + offset + 4;
+    size = length;
+    offset += 4 + length;
+    return true;
+}
+
+bool SplitAddr(const std::string& addr, std::string& host, std::string& port)
+{
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == addr.size())
+    {
+        return false;
+    }
+    host = addr.substr(0, colon);
+    port = addr.substr(colon + 1);
+    return true;
+}
+
+void SetNoDelay(sock_t fd)
+{
+    // Frames are already batched per tick; don't hold the batch for an ack.
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&yes), sizeof yes);
+}
+
+} // namespace
+
+Federation::Federation(EventLoop& event_loop, const std::vector<std::string>& nodes, size_t node_id, ShardStats& stats,
+    Handlers handlers)
+    : event_loop_(&event_loop), node_id_(node_id), stats_(&stats), handlers_(std::move(handlers))
+{
+    for (const std::string& addr : nodes)
+    {
+        Peer peer;
+        peer.addr = addr;
+        peer.fd = INVALID_SOCKET;
+        peers_.push_back(std::move(peer));
+    }
+    Listen();
+}
+
+Federation::~Federation()
+{
+    // Links are torn down and rebuilt when a handoff fails, so leave the
+    // event loop as it was.
+    for (Peer& peer : peers_)
+    {
+        if (peer.fd != INVALID_SOCKET)
+        {
+            event_loop_->Remove(peer.fd);
+            close(peer.fd);
+        }
+    }
+    for (const auto& hello : hellos_)
+    {
+        event_loop_->Remove(hello.first);
+        close(hello.first);
+    }
+    event_loop_->Remove(listen_fd_);
+    close(listen_fd_);
+}
+
+void Federation::Listen()
+{
+    std::string host;
+    std::string port;
+    if (!SplitAddr(peers_[node_id_].addr, host, port))
+    {
+        fprintf(stderr, "bad peer address: %s\r\n", peers_[node_id_].addr.c_str());
+        exit(EXIT_FAILURE);
+    }
+    addrinfo hints;
+    addrinfo* servinfo;
+    int ret;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &servinfo)) != 0)
+    {
+        fprintf(stderr, "peer getaddrinfo: %s\r\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    int yes = 1;
+    listen_fd_ = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (listen_fd_ == INVALID_SOCKET ||
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&yes), sizeof(int)) == -1 ||
+        bind(listen_fd_, servinfo->ai_addr, static_cast<int>(servinfo->ai_addrlen)) == -1 ||
+        listen(listen_fd_, 16) == -1)
+    {
+        perror("chatter-server: peer listener");
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(servinfo);
+    unsigned long int nonblocking = 1;
+    ioctl(listen_fd_, FIONBIO, &nonblocking);
+    event_loop_->Add(listen_fd_, EventRead);
+}
+
+void Federation::Dial(size_t node)
+{
+    Peer& peer = peers_[node];
+    peer.retry_ms = now_ms_ + PeerRetryMs;
+    std::string host;
+    std::string port;
+    addrinfo hints;
+    addrinfo* servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (!SplitAddr(peer.addr, host, port) || getaddrinfo(host.c_str(), port.c_str(), &hints, &servinfo) != 0)
+    {
+        fprintf(stderr, "chatter-server: can't resolve node %zu (%s)\r\n", node, peer.addr.c_str());
+        return;
+    }
+    sock_t fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (fd == INVALID_SOCKET)
+    {
+        perror("chatter-server: peer socket");
+        freeaddrinfo(servinfo);
+        return;
+    }
+    unsigned long int nonblocking = 1;
+    ioctl(fd, FIONBIO, &nonblocking);
+    SetNoDelay(fd);
+    int ret = connect(fd, servinfo->ai_addr, static_cast<int>(servinfo->ai_addrlen));
+    freeaddrinfo(servinfo);
+    if (ret == -1 && !ConnectInProgress())
+    {
+        close(fd);
+        return;
+    }
+    // Completion, or failure, is reported as writability.
+    peer.fd = fd;
+    peer.connecting = true;
+    nodes_by_fd_[fd] = node;
+    event_loop_->Add(fd, EventWrite);
+}
+
+void Federation::Accept()
+{
+    while (true)
+    {
+        sock_t fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd == INVALID_SOCKET)
+        {
+            if (!WouldBlock())
+            {
+                perror("chatter-server: peer accept");
+            }
+            return;
+        }
+        unsigned long int nonblocking = 1;
+        ioctl(fd, FIONBIO, &nonblocking);
+        SetNoDelay(fd);
+        nodes_by_fd_[fd] = Unidentified;
+        hellos_.emplace(fd, std::string());
+        event_loop_->Add(fd, EventRead);
+    }
+}
+
+void Federation::Handle(const Event& event)
+{
+    if (event.fd == listen_fd_)
+    {
+        Accept();
+        return;
+    }
+    size_t node = nodes_by_fd_.at(event.fd);
+    if (node == Unidentified)
+    {
+        Identify(event.fd);
+        return;
+    }
+    Peer& peer = peers_[node];
+    if (peer.connecting)
+    {
+        Connected(node);
+        return;
+    }
+    if (event.events & EventWrite)
+    {
+        Write(node);
+        if (peer.fd != event.fd)
+        {
+            return;
+        }
+    }
+    if (event.events & (EventRead | EventHangup | EventError))
+    {
+        if (Read(peer.fd, peer.input, MaxPeerInputBytes))
+        {
+            Parse(node);
+        }
+        else
+        {
+            Drop(node);
+        }
+    }
+}
+
+void Federation::Connected(size_t node)
+{
+    Peer& peer = peers_[node];
+    int error = 0;
+    socklen_t size = sizeof error;
+    if (getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &size) == -1 || error != 0)
+    {
+        // Not up yet; Reconnect() tries again.
+        Close(peer.fd);
+        peer.fd = INVALID_SOCKET;
+        peer.connecting = false;
+        return;
+    }
+    peer.connecting = false;
+    ShardMessage hello;
+    hello.client = node_id_;
+    Encode(peer.output, HelloKind, hello);
+    sock_t fd = peer.fd;
+    peer.fd = INVALID_SOCKET;
+    event_loop_->Modify(fd, EventRead);
+    Link(node, fd);
+}
+
+void Federation::Link(size_t node, sock_t fd)
+{
+    Peer& peer = peers_[node];
+    if (peer.fd != INVALID_SOCKET)
+    {
+        // The node restarted; the newest link wins.
+        Drop(node);
+    }
+    peer.fd = fd;
+    peer.linked = true;
+    nodes_by_fd_[fd] = node;
+    printf("Linked to node %zu (%s)\r\n", node, peer.addr.c_str());
+    handlers_.linked(node);
+}
+
+void Federation::Drop(size_t node)
+{
+    Peer& peer = peers_[node];
+    bool was_linked = peer.linked;
+    if (peer.fd != INVALID_SOCKET)
+    {
+        Close(peer.fd);
+    }
+    peer.fd = INVALID_SOCKET;
+    peer.connecting = false;
+    peer.linked = false;
+    peer.write_armed = false;
+    peer.input.clear();
+    peer.output.clear();
+    peer.retry_ms = now_ms_ + PeerRetryMs;
+    if (was_linked)
+    {
+        printf("Lost link to node %zu (%s)\r\n", node, peer.addr.c_str());
+        handlers_.unlinked(node);
+    }
+}
+
+void Federation::Identify(sock_t fd)
+{
+    // Nothing past the hello is read until the link is known.
+    std::string& input = hellos_.at(fd);
+    if (!Read(fd, input, HelloBytes))
+    {
+        Close(fd);
+        return;
+    }
+    if (input.size() < HelloBytes)
+    {
+        return;
+    }
+    size_t offset = 0;
+    const char* frame;
+    size_t size;
+    bool bad = false;
+    uint8_t kind;
+    // Only higher-numbered nodes dial in.
+    if (!NextFrame(input, offset, frame, size, bad) || !Decode(frame, size, kind, message_) || kind != HelloKind ||
+        message_.client <= node_id_ || message_.client >= peers_.size())
+    {
+        fprintf(stderr, "chatter-server: rejected peer link without a valid hello\r\n");
+        Close(fd);
+        return;
+    }
+    size_t node = static_cast<size_t>(message_.client);
+    std::string rest = input.substr(offset);
+    hellos_.erase(fd);
+    Link(node, fd);
+    peers_[node].input = std::move(rest);
+    Parse(node);
+}
+
+bool Federation::Read(sock_t fd, std::string& input, size_t limit)
+{
+    // Peer traffic carries other nodes' whole load, so read all of it that
+    // a frame can need.
+    while (input.size() < limit)
+    {
+        size_t used = input.size();
+        size_t chunk = std::min(ReadChunk, limit - used);
+        input.resize(used + chunk);
+        long nbytes = recv(fd, &input[used], static_cast<int>(chunk), 0);
+        ++stats_->syscalls;
+        input.resize(used + (nbytes > 0 ? static_cast<size_t>(nbytes) : 0));
+        if (nbytes == 0 || (nbytes == -1 && !WouldBlock()))
+        {
+            return false;
+        }
+        if (nbytes == -1)
+        {
+            return true;
+        }
+        stats_->peer_bytes_in += static_cast<uint64_t>(nbytes);
+    }
+    return true;
+}
+
+void Federation::Parse(size_t node)
+{
+    Peer& peer = peers_[node];
+    sock_t fd = peer.fd;
+    size_t offset = 0;
+    const char* frame;
+    size_t size;
+    bool bad = false;
+    // A handler may drop the link, which clears the input under us.
+    while (peer.fd == fd && NextFrame(peer.input, offset, frame, size, bad))
+    {
+        uint8_t kind;
+        if (!Decode(frame, size, kind, message_) || kind == HelloKind)
+        {
+            bad = true;
+            break;
+        }
+        ++stats_->peer_messages_in;
+        handlers_.received(node, message_);
+    }
+    if (bad)
+    {
+        fprintf(stderr, "chatter-server: bad frame from node %zu\r\n", node);
+        Drop(node);
+        return;
+    }
+    if (peer.fd == fd)
+    {
+        peer.input.erase(0, offset);
+    }
+}
+
+void Federation::Send(size_t node, const ShardMessage& message)
+{
+    Peer& peer = peers_[node];
+    if (!peer.linked)
+    {
+        return;
+    }
+    Encode(peer.output, static_cast<uint8_t>(1 + static_cast<uint8_t>(message.type)), message);
+    ++stats_->peer_messages_out;
+    if (peer.output.size() > MaxPeerOutputBytes)
+    {
+        fprintf(stderr, "chatter-server: node %zu fell behind\r\n", node);
+        Drop(node);
+    }
+}
+
+void Federation::SendToAll(const ShardMessage& message)
+{
+    for (size_t node = 0; node < peers_.size(); ++node)
+    {
+        if (node != node_id_)
+        {
+            Send(node, message);
+        }
+    }
+}
+
+void Federation::Flush()
+{
+    for (size_t node = 0; node < peers_.size(); ++node)
+    {
+        Peer& peer = peers_[node];
+        if (peer.linked && !peer.write_armed && !peer.output.empty())
+        {
+            Write(node);
+        }
+    }
+}
+
+void Federation::Write(size_t node)
+{
+    Peer& peer = peers_[node];
+    size_t sent = 0;
+    while (sent < peer.output.size())
+    {
+        long nbytes = send(peer.fd, peer.output.data() + sent, static_cast<int>(peer.output.size() - sent), 0);
+        ++stats_->syscalls;
+        if (nbytes == -1)
+        {
+            if (!WouldBlock())
+            {
+                Drop(node);
+                return;
+            }
+            break;
+        }
+        sent += static_cast<size_t>(nbytes);
+    }
+    stats_->peer_bytes_out += sent;
+    peer.output.erase(0, sent);
+    bool pending = !peer.output.empty();
+    if (pending != peer.write_armed)
+    {
+        peer.write_armed = pending;
+        event_loop_->Modify(peer.fd, pending ? EventRead | EventWrite : EventRead);
+    }
+}
+
+void Federation::Reconnect(int64_t now_ms)
+{
+    now_ms_ = now_ms;
+    for (size_t node = 0; node < node_id_; ++node)
+    {
+        if (peers_[node].fd == INVALID_SOCKET && now_ms >= peers_[node].retry_ms)
+        {
+            Dial(node);
+        }
+    }
+}
+
+int Federation::GetTimeout(int64_t now_ms) const
+{
+    int timeout = -1;
+    for (size_t node = 0; node < node_id_; ++node)
+    {
+        if (peers_[node].fd == INVALID_SOCKET)
+        {
+            int64_t wait = peers_[node].retry_ms > now_ms ? peers_[node].retry_ms - now_ms : 0;
+            timeout = timeout == -1 ? static_cast<int>(wait) : std::min(timeout, static_cast<int>(wait));
+        }
+    }
+    return timeout;
+}
+
+void Federation::Close(sock_t fd)
+{
+    event_loop_->Remove(fd);
+    close(fd);
+    nodes_by_fd_.erase(fd);
+    hellos_.erase(fd);
+}
+
+} // namespace chatter
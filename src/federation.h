@@ -0,0 +1,94 @@
+#ifndef CHATTER_FEDERATION_H_
+#define CHATTER_FEDERATION_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.h"
+#include "mailbox.h"
+#include "stats.h"
+
+namespace chatter {
+
+constexpr int64_t PeerRetryMs = 1000;
+constexpr size_t MaxPeerFrameBytes = 1 << 20;
+// A peer that lets this much output pile up is dropped and relinked.
+constexpr size_t MaxPeerOutputBytes = 64 << 20;
+
+// Persistent links to the other nodes of a federation, run in shard 0's
+// event loop. Node i dials every node below it and accepts the others, so
+// each pair shares one connection. Messages are appended to the peer's
+// buffer as binary frames and each buffer is written once per loop
+// iteration, so everything a tick sends to a node leaves in one send().
+class Federation
+{
+    public:
+        struct Handlers
+        {
+            // The node should be sent this node's clients and their rooms.
+            std::function<void(size_t node)> linked;
+            // The node's clients are gone until it links again.
+            std::function<void(size_t node)> unlinked;
+            std::function<void(size_t node, ShardMessage& message)> received;
+        };
+        Federation(EventLoop& event_loop, const std::vector<std::string>& nodes, size_t node_id, ShardStats& stats,
+            Handlers handlers);
+        ~Federation();
+        Federation(const Federation&) = delete;
+        Federation& operator=(const Federation&) = delete;
+        bool Owns(sock_t fd) const { return fd == listen_fd_ || nodes_by_fd_.count(fd) != 0; }
+        void Handle(const Event& event);
+        size_t GetNodeCount() const { return peers_.size(); }
+        // Dropped while the link is down; the node gets a fresh snapshot
+        // once it is back.
+        void Send(size_t node, const ShardMessage& message);
+        void SendToAll(const ShardMessage& message);
+        void Flush();
+        // Redials links that are down once their retry time has passed.
+        void Reconnect(int64_t now_ms);
+        int GetTimeout(int64_t now_ms) const;
+    private:
+        static constexpr size_t Unidentified = SIZE_MAX;
+        struct Peer
+        {
+            std::string addr;
+            sock_t fd;
+            bool connecting = false;
+            bool linked = false;
+            bool write_armed = false;
+            std::string input;
+            std::string output;
+            int64_t retry_ms = 0;
+        };
+        void Listen();
+        void Dial(size_t node);
+        void Accept();
+        void Connected(size_t node);
+        void Link(size_t node, sock_t fd);
+        void Drop(size_t node);
+        void Identify(sock_t fd);
+        // Reads until the socket is empty or `input` holds `limit` bytes; the
+        // level-triggered loop reports the rest on its next wait.
+        bool Read(sock_t fd, std::string& input, size_t limit);
+        void Parse(size_t node);
+        void Write(size_t node);
+        void Close(sock_t fd);
+        EventLoop* event_loop_;
+        size_t node_id_;
+        ShardStats* stats_;
+        Handlers handlers_;
+        sock_t listen_fd_;
+        std::vector<Peer> peers_;
+        // Accepted links are Unidentified until their hello frame arrives.
+        std::unordered_map<sock_t, size_t> nodes_by_fd_;
+        std::unordered_map<sock_t, std::string> hellos_;
+        ShardMessage message_;
+        int64_t now_ms_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_FEDERATION_H_
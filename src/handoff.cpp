@@ -0,0 +1,400 @@
+#include "handoff.h"
+
+#ifndef _WIN32
+    #include <poll.h>
+    #include <sys/ioctl.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+    constexpr int INVALID_SOCKET = -1;
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "wire_format.h"
+
+namespace chatter {
+
+#ifdef _WIN32
+
+sock_t ListenForHandoff(const std::string&)
+{
+    fprintf(stderr, "Socket handoff is not supported on this platform.\r\n");
+    exit(EXIT_FAILURE);
+}
+
+bool SendHandoff(sock_t, const HandoffState&) { return false; }
+bool AwaitHandoffAck(sock_t, int) { return false; }
+
+sock_t ReceiveHandoff(const std::string&, HandoffState&)
+{
+    fprintf(stderr, "Socket handoff is not supported on this platform.\r\n");
+    return INVALID_SOCKET;
+}
+
+bool AcknowledgeHandoff(sock_t) { return false; }
+
+#else
+
+namespace {
+
+constexpr uint32_t HandoffMagic = 0x6f686863; // "chho"
+constexpr uint32_t HandoffVersion = 4;
+// Descriptors attached to one sendmsg(); the kernel allows 253.
+constexpr size_t MaxFdsPerMessage = 250;
+
+bool MakeAddress(const std::string& path, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "handoff socket path too long: %s\r\n", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+}
+
+bool SendAll(sock_t fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            perror("handoff: send");
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool ReceiveAll(sock_t fd, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            fprintf(stderr, "handoff: connection closed early\r\n");
+            return false;
+        }
+        data += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+bool SendFds(sock_t fd, const std::vector<int>& fds)
+{
+    for (size_t start = 0; start < fds.size(); start += MaxFdsPerMessage)
+    {
+        size_t count = std::min(MaxFdsPerMessage, fds.size() - start);
+        char byte = 0;
+        iovec iov{&byte, 1};
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds.data() + start, count * sizeof(int));
+        ssize_t sent;
+        while ((sent = sendmsg(fd, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        {
+        }
+        if (sent != 1)
+        {
+            perror("handoff: sendmsg");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ReceiveFds(sock_t fd, size_t count, std::vector<int>& fds)
+{
+    std::vector<char> control(CMSG_SPACE(MaxFdsPerMessage * sizeof(int)));
+    while (fds.size() < count)
+    {
+        // One data byte per batch, so a recvmsg() never spans two batches.
+        char byte;
+        iovec iov{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        ssize_t received;
+        while ((received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        {
+        }
+        if (received != 1 || (message.msg_flags & MSG_CTRUNC))
+        {
+            fprintf(stderr, "handoff: descriptors lost\r\n");
+            return false;
+        }
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                size_t received_fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                size_t offset = fds.size();
+                fds.resize(offset + received_fds);
+                memcpy(fds.data() + offset, CMSG_DATA(header), received_fds * sizeof(int));
+            }
+        }
+    }
+    return fds.size() == count;
+}
+
+// Descriptors travel separately; the blob refers to them by index.
+void PutShard(std::string& out, const ShardState& shard, std::vector<int>& fds)
+{
+    PutU32(out, static_cast<uint32_t>(fds.size()));
+    fds.push_back(shard.listener);
+    PutU32(out, static_cast<uint32_t>(shard.generations.size()));
+    for (uint32_t generation : shard.generations)
+    {
+        PutU32(out, generation);
+    }
+    PutU32(out, static_cast<uint32_t>(shard.rooms.size()));
+    for (const RoomState& room : shard.rooms)
+    {
+        PutString(out, room.name);
+        PutString(out, room.password);
+        PutU64(out, room.creator);
+    }
+    PutU32(out, static_cast<uint32_t>(shard.clients.size()));
+    for (const ClientState& client : shard.clients)
+    {
+        PutU32(out, static_cast<uint32_t>(fds.size()));
+        fds.push_back(client.fd);
+        PutU64(out, client.id);
+        PutString(out, client.name);
+        int flags = (client.color ? 1 : 0) | (client.binary ? 2 : 0) | (client.compressed ? 4 : 0);
+        out.push_back(static_cast<char>(flags));
+        PutU32(out, client.adler);
+        PutString(out, client.room);
+        PutString(out, client.input);
+        PutString(out, client.output);
+    }
+}
+
+bool GetShard(WireReader& reader, ShardState& shard)
+{
+    uint32_t listener;
+    uint32_t count;
+    if (!reader.GetU32(listener) || !reader.GetU32(count))
+    {
+        return false;
+    }
+    shard.listener = static_cast<sock_t>(listener);
+    shard.generations.resize(count);
+    for (uint32_t& generation : shard.generations)
+    {
+        if (!reader.GetU32(generation))
+        {
+            return false;
+        }
+    }
+    if (!reader.GetU32(count))
+    {
+        return false;
+    }
+    shard.rooms.resize(count);
+    for (RoomState& room : shard.rooms)
+    {
+        if (!reader.GetString(room.name) || !reader.GetString(room.password) || !reader.GetU64(room.creator))
+        {
+            return false;
+        }
+    }
+    if (!reader.GetU32(count))
+    {
+        return false;
+    }
+    shard.clients.resize(count);
+    for (ClientState& client : shard.clients)
+    {
+        uint32_t fd;
+        uint8_t flags;
+        if (!reader.GetU32(fd) || !reader.GetU64(client.id) || !reader.GetString(client.name) ||
+            !reader.GetU8(flags) || !reader.GetU32(client.adler) || !reader.GetString(client.room) || !reader.GetString(client.input) ||
+            !reader.GetString(client.output))
+        {
+            return false;
+        }
+        client.fd = static_cast<sock_t>(fd);
+        client.color = (flags & 1) != 0;
+        client.binary = (flags & 2) != 0;
+        client.compressed = (flags & 4) != 0;
+    }
+    return true;
+}
+
+} // namespace
+
+sock_t ListenForHandoff(const std::string& path)
+{
+    sockaddr_un addr;
+    if (!MakeAddress(path, addr))
+    {
+        exit(EXIT_FAILURE);
+    }
+    sock_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // A previous server may have left the path behind, or still be handing
+    // off from it; either way the path now belongs to this process.
+    unlink(path.c_str());
+    if (fd == INVALID_SOCKET || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == -1 ||
+        listen(fd, 1) == -1)
+    {
+        perror("chatter-server: handoff listener");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long int nonblocking = 1;
+    ioctl(fd, FIONBIO, &nonblocking);
+    return fd;
+}
+
+bool SendHandoff(sock_t fd, const HandoffState& state)
+{
+    unsigned long int blocking = 0;
+    ioctl(fd, FIONBIO, &blocking);
+    std::string blob;
+    std::vector<int> fds;
+    PutU32(blob, HandoffMagic);
+    PutU32(blob, HandoffVersion);
+    PutU64(blob, state.node_id);
+    PutU64(blob, state.node_count);
+    PutU32(blob, static_cast<uint32_t>(state.shards.size()));
+    for (const ShardState& shard : state.shards)
+    {
+        PutShard(blob, shard, fds);
+    }
+    PutU32(blob, static_cast<uint32_t>(fds.size()));
+    std::string size;
+    PutU64(size, blob.size());
+    return SendAll(fd, size.data(), size.size()) && SendAll(fd, blob.data(), blob.size()) && SendFds(fd, fds);
+}
+
+bool AwaitHandoffAck(sock_t fd, int timeout_ms)
+{
+    pollfd ack{fd, POLLIN, 0};
+    char byte = 0;
+    int ready;
+    while ((ready = poll(&ack, 1, timeout_ms)) == -1 && errno == EINTR)
+    {
+    }
+    return ready == 1 && recv(fd, &byte, 1, 0) == 1 && byte == 'A' && SendAll(fd, "G", 1);
+}
+
+sock_t ReceiveHandoff(const std::string& path, HandoffState& state)
+{
+    sockaddr_un addr;
+    if (!MakeAddress(path, addr))
+    {
+        return INVALID_SOCKET;
+    }
+    sock_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == INVALID_SOCKET || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == -1)
+    {
+        perror("handoff: connect");
+        if (fd != INVALID_SOCKET)
+        {
+            close(fd);
+        }
+        return INVALID_SOCKET;
+    }
+    char size_bytes[8];
+    uint64_t size = 0;
+    std::string blob;
+    std::vector<int> fds;
+    bool valid = ReceiveAll(fd, size_bytes, sizeof size_bytes) &&
+        WireReader(size_bytes, sizeof size_bytes).GetU64(size);
+    if (valid)
+    {
+        blob.resize(static_cast<size_t>(size));
+        valid = ReceiveAll(fd, blob.data(), blob.size());
+    }
+    WireReader reader(blob.data(), blob.size());
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t node_id = 0;
+    uint64_t node_count = 0;
+    uint32_t shard_count = 0;
+    uint32_t fd_count = 0;
+    valid = valid && reader.GetU32(magic) && magic == HandoffMagic && reader.GetU32(version) &&
+        version == HandoffVersion && reader.GetU64(node_id) && reader.GetU64(node_count) &&
+        reader.GetU32(shard_count) && shard_count > 0;
+    if (valid)
+    {
+        state.node_id = static_cast<size_t>(node_id);
+        state.node_count = static_cast<size_t>(node_count);
+        state.shards.resize(shard_count);
+        for (ShardState& shard : state.shards)
+        {
+            valid = valid && GetShard(reader, shard);
+        }
+        valid = valid && reader.GetU32(fd_count) && reader.AtEnd() && ReceiveFds(fd, fd_count, fds);
+    }
+    for (const ShardState& shard : state.shards)
+    {
+        valid = valid && static_cast<size_t>(shard.listener) < fds.size();
+        for (const ClientState& client : shard.clients)
+        {
+            valid = valid && static_cast<size_t>(client.fd) < fds.size();
+        }
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "handoff: bad state from the running server\r\n");
+        for (int received : fds)
+        {
+            close(received);
+        }
+        close(fd);
+        return INVALID_SOCKET;
+    }
+    for (ShardState& shard : state.shards)
+    {
+        shard.listener = fds[static_cast<size_t>(shard.listener)];
+        for (ClientState& client : shard.clients)
+        {
+            client.fd = fds[static_cast<size_t>(client.fd)];
+        }
+    }
+    return fd;
+}
+
+bool AcknowledgeHandoff(sock_t fd)
+{
+    // The old process closes instead of confirming once it has resumed.
+    char byte = 0;
+    bool confirmed = SendAll(fd, "A", 1) && ReceiveAll(fd, &byte, 1) && byte == 'G';
+    close(fd);
+    return confirmed;
+}
+
+#endif
+
+} // namespace chatter
@@ -0,0 +1,73 @@
+#ifndef CHATTER_HANDOFF_H_
+#define CHATTER_HANDOFF_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "client.h"
+
+namespace chatter {
+
+constexpr int DefaultHandoffAckMs = 1000;
+
+// What one shard hands to the process replacing it: its listener, its
+// clients' sockets and sessions, and the rooms they are in. Replicas of
+// other shards' clients, room history and statistics start over.
+struct ClientState
+{
+    sock_t fd;
+    ClientId id;
+    std::string name;
+    bool color;
+    bool binary;
+    // Mid MCCP stream, and its checksum so far.
+    bool compressed;
+    uint32_t adler;
+    std::string room;
+    // Input not yet handled and output not yet written.
+    std::string input;
+    std::string output;
+};
+
+struct RoomState
+{
+    std::string name;
+    std::string password;
+    ClientId creator;
+};
+
+struct ShardState
+{
+    sock_t listener;
+    // Slot generations of the client table, so no id is handed out twice.
+    std::vector<uint32_t> generations;
+    std::vector<RoomState> rooms;
+    std::vector<ClientState> clients;
+};
+
+struct HandoffState
+{
+    size_t node_id = 0;
+    size_t node_count = 1;
+    std::vector<ShardState> shards;
+};
+
+// Upgrade handoff over a Unix socket. The running server listens on a path;
+// a new process connects, receives every shard's state with the descriptors
+// attached (SCM_RIGHTS), sets itself up and acknowledges, and only then does
+// the old process exit. Until then the old process still owns everything and
+// carries on if the new one goes away or is too slow to acknowledge. The old
+// process confirms the acknowledgement, so a late one can't leave two
+// processes serving the same sockets.
+sock_t ListenForHandoff(const std::string& path);
+bool SendHandoff(sock_t fd, const HandoffState& state);
+bool AwaitHandoffAck(sock_t fd, int timeout_ms);
+// Returns the connection to acknowledge on, or -1 if nothing was handed over.
+sock_t ReceiveHandoff(const std::string& path, HandoffState& state);
+// Returns false if the old process gave up waiting and carries on.
+bool AcknowledgeHandoff(sock_t fd);
+
+} // namespace chatter
+
+#endif // CHATTER_HANDOFF_H_
@@ -0,0 +1,166 @@
+#ifndef CHATTER_HISTOGRAM_H_
+#define CHATTER_HISTOGRAM_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+namespace chatter {
+
+// Counter written by exactly one thread and read by any. Increments are a
+// relaxed load and store rather than a locked read-modify-write.
+class RelaxedCounter
+{
+    public:
+        RelaxedCounter() = default;
+        RelaxedCounter(const RelaxedCounter& other) : value_(other.Load()) { }
+        RelaxedCounter& operator=(uint64_t value)
+        {
+            value_.store(value, std::memory_order_relaxed);
+            return *this;
+        }
+        RelaxedCounter& operator+=(uint64_t delta)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+            return *this;
+        }
+        RelaxedCounter& operator-=(uint64_t delta)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) - delta, std::memory_order_relaxed);
+            return *this;
+        }
+        RelaxedCounter& operator++() { return *this += 1; }
+        operator uint64_t() const { return Load(); }
+        uint64_t Load() const { return value_.load(std::memory_order_relaxed); }
+    private:
+        std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear histogram: eight sub-buckets per power of two, so any recorded
+// value is reported within ~12% using a fixed 4 KiB of counters.
+template <typename Counter>
+class BasicHistogram
+{
+    public:
+        static constexpr int SubBucketBits = 3;
+        static constexpr int SubBuckets = 1 << SubBucketBits;
+        static constexpr int BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+        static int IndexOf(uint64_t value)
+        {
+            if (value < SubBuckets)
+            {
+                return static_cast<int>(value);
+            }
+            int exponent = HighestBit(value);
+            return (exponent - SubBucketBits + 1) * SubBuckets +
+                static_cast<int>((value >> (exponent - SubBucketBits)) & (SubBuckets - 1));
+        }
+
+        static uint64_t LowerBound(int index)
+        {
+            if (index < SubBuckets)
+            {
+                return static_cast<uint64_t>(index);
+            }
+            int exponent = index / SubBuckets + SubBucketBits - 1;
+            uint64_t mantissa = static_cast<uint64_t>(SubBuckets + index % SubBuckets);
+            return mantissa << (exponent - SubBucketBits);
+        }
+
+        void Record(uint64_t value)
+        {
+            counts_[IndexOf(value)] += 1;
+            count_ += 1;
+            sum_ += value;
+            if (value > GetMax())
+            {
+                max_ = value;
+            }
+        }
+
+        template <typename OtherCounter>
+        void Merge(const BasicHistogram<OtherCounter>& other)
+        {
+            for (int i = 0; i < BucketCount; ++i)
+            {
+                counts_[i] += other.GetBucket(i);
+            }
+            count_ += other.GetCount();
+            sum_ += other.GetSum();
+            if (other.GetMax() > GetMax())
+            {
+                max_ = other.GetMax();
+            }
+        }
+
+        // Upper edge of the bucket holding the given quantile (0..1).
+        uint64_t Percentile(double quantile) const
+        {
+            uint64_t count = GetCount();
+            if (count == 0)
+            {
+                return 0;
+            }
+            uint64_t target = static_cast<uint64_t>(quantile * static_cast<double>(count));
+            if (target >= count)
+            {
+                target = count - 1;
+            }
+            uint64_t seen = 0;
+            for (int i = 0; i < BucketCount; ++i)
+            {
+                seen += counts_[i];
+                if (seen > target)
+                {
+                    uint64_t upper = i + 1 < BucketCount ? LowerBound(i + 1) - 1 : GetMax();
+                    return upper < GetMax() ? upper : GetMax();
+                }
+            }
+            return GetMax();
+        }
+
+        uint64_t GetCount() const { return count_; }
+        uint64_t GetSum() const { return sum_; }
+        uint64_t GetMax() const { return max_; }
+        uint64_t GetBucket(int index) const { return counts_[index]; }
+        // Observations <= bound, to bucket resolution; used to export fixed
+        // cumulative buckets.
+        uint64_t CountAtMost(uint64_t bound) const
+        {
+            uint64_t total = 0;
+            for (int i = 0; i < BucketCount && LowerBound(i) <= bound; ++i)
+            {
+                total += counts_[i];
+            }
+            return total;
+        }
+
+    private:
+        static int HighestBit(uint64_t value)
+        {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanReverse64(&index, value);
+            return static_cast<int>(index);
+#else
+            return 63 - __builtin_clzll(value);
+#endif
+        }
+        std::array<Counter, BucketCount> counts_{};
+        Counter count_{};
+        Counter sum_{};
+        Counter max_{};
+};
+
+typedef BasicHistogram<uint64_t> Histogram;
+// Recorded by one shard, readable from any thread.
+typedef BasicHistogram<RelaxedCounter> AtomicHistogram;
+
+} // namespace chatter
+
+#endif // CHATTER_HISTOGRAM_H_
@@ -0,0 +1,124 @@
+#include "history.h"
+
+namespace chatter {
+
+namespace {
+
+size_t RetainedBytes(const RenderedMessage& rendered)
+{
+    size_t bytes = rendered.plain->size();
+    if (rendered.color != rendered.plain)
+    {
+        bytes += rendered.color->size();
+    }
+    if (rendered.binary != nullptr)
+    {
+        bytes += rendered.binary->size();
+    }
+    return bytes;
+}
+
+} // namespace
+
+RenderedMessage* HistoryArena::Allocate()
+{
+    if (free_rings_.empty())
+    {
+        chunks_.push_back(std::make_unique<RenderedMessage[]>(RingsPerChunk * lines_));
+        for (size_t i = 0; i < RingsPerChunk; ++i)
+        {
+            free_rings_.push_back(chunks_.back().get() + i * lines_);
+        }
+    }
+    RenderedMessage* ring = free_rings_.back();
+    free_rings_.pop_back();
+    return ring;
+}
+
+void HistoryArena::Release(RenderedMessage* ring)
+{
+    free_rings_.push_back(ring);
+}
+
+void HistoryArena::Touch(RoomHistory& history)
+{
+    if (history.count_ != 0)
+    {
+        recent_.splice(recent_.begin(), recent_, history.recent_entry_);
+    }
+    else
+    {
+        recent_.push_front(&history);
+        history.recent_entry_ = recent_.begin();
+    }
+}
+
+void HistoryArena::Forget(RoomHistory& history)
+{
+    recent_.erase(history.recent_entry_);
+}
+
+void HistoryArena::Trim()
+{
+    while (bytes_ > budget_bytes_ && !recent_.empty())
+    {
+        recent_.back()->PopOldest();
+    }
+}
+
+RoomHistory::~RoomHistory()
+{
+    Clear();
+}
+
+void RoomHistory::Clear()
+{
+    while (count_ != 0)
+    {
+        PopOldest();
+    }
+}
+
+void RoomHistory::Push(const RenderedMessage& rendered)
+{
+    size_t lines = arena_->lines_;
+    if (lines == 0)
+    {
+        return;
+    }
+    if (ring_ == nullptr)
+    {
+        ring_ = arena_->Allocate();
+    }
+    arena_->Touch(*this);
+    if (count_ == lines)
+    {
+        arena_->bytes_ -= RetainedBytes(ring_[head_]);
+        ring_[head_] = rendered;
+        head_ = (head_ + 1) % lines;
+    }
+    else
+    {
+        ring_[(head_ + count_) % lines] = rendered;
+        ++count_;
+    }
+    arena_->bytes_ += RetainedBytes(rendered);
+    arena_->Trim();
+}
+
+void RoomHistory::PopOldest()
+{
+    RenderedMessage& oldest = ring_[head_];
+    arena_->bytes_ -= RetainedBytes(oldest);
+    oldest = RenderedMessage();
+    head_ = (head_ + 1) % arena_->lines_;
+    if (--count_ == 0)
+    {
+        arena_->Forget(*this);
+        arena_->Release(ring_);
+        ring_ = nullptr;
+        head_ = 0;
+    }
+}
+
+} // namespace chatter
@@ -0,0 +1,71 @@
+#ifndef CHATTER_HISTORY_H_
+#define CHATTER_HISTORY_H_
+
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "rendered_message.h"
+
+namespace chatter {
+
+constexpr size_t DefaultHistoryLines = 32;
+constexpr size_t DefaultHistoryBytes = 16 << 20;
+
+class RoomHistory;
+
+// Hands out fixed-size rings of RenderedMessage slots to rooms and keeps the
+// payload bytes they retain under a budget by trimming the ring that was
+// written least recently. One arena per shard; payloads are shared between
+// shards, so each shard's replicas reference the same bytes.
+class HistoryArena
+{
+    public:
+        HistoryArena(size_t lines, size_t budget_bytes) : lines_(lines), budget_bytes_(budget_bytes) { }
+        HistoryArena(const HistoryArena&) = delete;
+        HistoryArena& operator=(const HistoryArena&) = delete;
+        size_t GetLines() const { return lines_; }
+        size_t GetBytes() const { return bytes_; }
+    private:
+        friend class RoomHistory;
+        static constexpr size_t RingsPerChunk = 64;
+        RenderedMessage* Allocate();
+        void Release(RenderedMessage* ring);
+        void Touch(RoomHistory& history);
+        void Forget(RoomHistory& history);
+        void Trim();
+        size_t lines_;
+        size_t budget_bytes_;
+        size_t bytes_ = 0;
+        std::vector<std::unique_ptr<RenderedMessage[]>> chunks_;
+        std::vector<RenderedMessage*> free_rings_;
+        std::list<RoomHistory*> recent_; // most recently written first
+};
+
+// The last few messages delivered in one room, oldest first. The ring is
+// taken from the arena on the first message and returned once it empties.
+class RoomHistory
+{
+    public:
+        explicit RoomHistory(HistoryArena& arena) : arena_(&arena) { }
+        RoomHistory(const RoomHistory&) = delete;
+        RoomHistory& operator=(const RoomHistory&) = delete;
+        ~RoomHistory();
+        void Push(const RenderedMessage& rendered);
+        void Clear();
+        size_t Size() const { return count_; }
+        // index 0 is the oldest message kept.
+        const RenderedMessage& At(size_t index) const { return ring_[(head_ + index) % arena_->lines_]; }
+    private:
+        friend class HistoryArena;
+        void PopOldest();
+        HistoryArena* arena_;
+        RenderedMessage* ring_ = nullptr;
+        size_t head_ = 0;
+        size_t count_ = 0;
+        std::list<RoomHistory*>::iterator recent_entry_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_HISTORY_H_
@@ -0,0 +1,202 @@
+#include "line_buffer.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <sys/socket.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "telnet.h"
+
+namespace chatter {
+
+size_t LineBuffer::MakeRoom()
+{
+    if (buffer_.empty())
+    {
+        buffer_.resize(max_line_length_ * 2 + FrameSlack);
+    }
+    if (start_ == end_)
+    {
+        start_ = end_ = scan_ = 0;
+    }
+    else if (end_ == buffer_.size())
+    {
+        // NextLine() has consumed everything longer than a line, and no
+        // frame is longer than a line and FrameSlack, so moving the partial
+        // line or frame to the front always frees about half the slab.
+        memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
+        end_ -= start_;
+        scan_ -= start_;
+        start_ = 0;
+    }
+    return buffer_.size() - end_;
+}
+
+long LineBuffer::Fill(sock_t fd)
+{
+    size_t room = MakeRoom();
+    long nbytes = recv(fd, buffer_.data() + end_, static_cast<int>(room), 0);
+    if (nbytes > 0)
+    {
+        end_ += static_cast<size_t>(nbytes);
+    }
+    return nbytes;
+}
+
+size_t LineBuffer::Append(const char* data, size_t size)
+{
+    size_t copied = std::min(size, MakeRoom());
+    memcpy(buffer_.data() + end_, data, copied);
+    end_ += copied;
+    return copied;
+}
+
+size_t LineBuffer::GetCommandLength() const
+{
+    const char* base = buffer_.data() + start_;
+    size_t size = end_ - start_;
+    if (size < 2)
+    {
+        return 0;
+    }
+    unsigned char command = static_cast<unsigned char>(base[1]);
+    if (command == telnet::Sb)
+    {
+        const char end[] = {static_cast<char>(telnet::Iac), static_cast<char>(telnet::Se)};
+        std::string_view rest(base, size);
+        size_t found = rest.find(std::string_view(end, 2), 2);
+        if (found != std::string_view::npos)
+        {
+            return found + 2;
+        }
+        // Subnegotiation that never ends is handed out as far as it got.
+        return size >= max_line_length_ ? size : 0;
+    }
+    if (command >= telnet::Will && command <= telnet::Dont)
+    {
+        return size >= 3 ? 3 : 0;
+    }
+    return 2;
+}
+
+bool LineBuffer::NextLine(std::string_view& line)
+{
+    while (start_ != end_)
+    {
+        const char* base = buffer_.data();
+        if (!discarding_ && static_cast<unsigned char>(base[start_]) == telnet::Iac)
+        {
+            size_t length = GetCommandLength();
+            if (length == 0)
+            {
+                return false;
+            }
+            line = std::string_view(base + start_, length);
+            line_start_ = start_;
+            line_truncated_ = truncated_;
+            start_ += length;
+            scan_ = std::max(scan_, start_);
+            return true;
+        }
+        const char* newline = static_cast<const char*>(memchr(base + scan_, '\n', end_ - scan_));
+        if (discarding_)
+        {
+            if (newline == nullptr)
+            {
+                start_ = scan_ = end_;
+                return false;
+            }
+            start_ = scan_ = static_cast<size_t>(newline - base) + 1;
+            discarding_ = false;
+            continue;
+        }
+        if (newline == nullptr)
+        {
+            scan_ = end_;
+            if (end_ - start_ < max_line_length_)
+            {
+                return false;
+            }
+            line = std::string_view(base + start_, max_line_length_);
+            line_start_ = start_;
+            line_truncated_ = truncated_;
+            start_ = scan_ = start_ + max_line_length_;
+            discarding_ = true;
+            ++truncated_;
+            return true;
+        }
+        size_t newline_pos = static_cast<size_t>(newline - base);
+        size_t length = newline_pos - start_;
+        line_start_ = start_;
+        line_truncated_ = truncated_;
+        if (length > 0 && base[newline_pos - 1] == '\r')
+        {
+            --length;
+        }
+        if (length > max_line_length_)
+        {
+            length = max_line_length_;
+            ++truncated_;
+        }
+        line = std::string_view(base + start_, length);
+        start_ = scan_ = newline_pos + 1;
+        return true;
+    }
+    return false;
+}
+
+bool LineBuffer::NextFrame(std::string_view& body)
+{
+    if (bad_ || end_ - start_ < 4)
+    {
+        return false;
+    }
+    const char* base = buffer_.data() + start_;
+    size_t length = 0;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        length |= static_cast<size_t>(static_cast<unsigned char>(base[i])) << (8 * i);
+    }
+    if (length + 4 > max_line_length_ + FrameSlack)
+    {
+        bad_ = true;
+        return false;
+    }
+    if (end_ - start_ < length + 4)
+    {
+        return false;
+    }
+    body = std::string_view(base + 4, length);
+    line_start_ = start_;
+    line_truncated_ = truncated_;
+    start_ = scan_ = start_ + 4 + length;
+    return true;
+}
+
+std::string LineBuffer::GetUnread() const
+{
+    if (start_ == end_)
+    {
+        return std::string();
+    }
+    size_t start = start_;
+    if (discarding_)
+    {
+        const char* newline = static_cast<const char*>(memchr(buffer_.data() + start_, '\n', end_ - start_));
+        start = newline != nullptr ? static_cast<size_t>(newline - buffer_.data()) + 1 : end_;
+    }
+    return std::string(buffer_.data() + start, end_ - start);
+}
+
+void LineBuffer::Unread()
+{
+    start_ = scan_ = line_start_;
+    truncated_ = line_truncated_;
+    discarding_ = false;
+}
+
+} // namespace chatter
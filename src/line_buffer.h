@@ -0,0 +1,70 @@
+#ifndef CHATTER_LINE_BUFFER_H_
+#define CHATTER_LINE_BUFFER_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    typedef SOCKET sock_t;
+#else
+    typedef int sock_t;
+#endif
+
+namespace chatter {
+
+constexpr size_t MaxLineLength = 1024;
+// How much longer than a line a frame may be, length prefix included.
+constexpr size_t FrameSlack = 16;
+
+// Incremental CRLF/LF framing over one client's byte stream. Bytes are read
+// straight into a fixed slab allocated on first use; complete lines are
+// handed out as views into it and a trailing partial line is kept for the
+// next read. Lines longer than the limit are truncated and the rest of the
+// line is discarded. Binary-mode clients send length-prefixed frames
+// instead, read the same way.
+class LineBuffer
+{
+    public:
+        explicit LineBuffer(size_t max_line_length = chatter::MaxLineLength) : max_line_length_(max_line_length) { }
+        // One recv() into the free tail. Views from NextLine() stay valid
+        // until the next Fill().
+        long Fill(sock_t fd);
+        // Copies in as much of `data` as fits; returns how much that was.
+        // Once NextLine() has returned every line there is room again.
+        size_t Append(const char* data, size_t size);
+        // A telnet command at the start of a line is handed out on its own,
+        // without waiting for a line ending that telnet never sends.
+        bool NextLine(std::string_view& line);
+        // Hands out the body of the next frame: a little-endian u32 length
+        // and that many bytes. An oversized frame can't be skipped, so it
+        // leaves the buffer bad.
+        bool NextFrame(std::string_view& body);
+        bool IsBad() const { return bad_; }
+        // Hands the last line or frame out again.
+        void Unread();
+        // Bytes not yet handed out as lines, less the rest of a line being
+        // discarded.
+        std::string GetUnread() const;
+        size_t GetTruncated() const { return truncated_; }
+    private:
+        // Returns the free space at the tail.
+        size_t MakeRoom();
+        // Length of the telnet command at start_, or 0 if it is incomplete.
+        size_t GetCommandLength() const;
+        std::vector<char> buffer_;
+        size_t max_line_length_;
+        size_t start_ = 0;
+        size_t end_ = 0;
+        size_t scan_ = 0;
+        bool discarding_ = false;
+        bool bad_ = false;
+        size_t truncated_ = 0;
+        size_t line_start_ = 0;
+        size_t line_truncated_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_LINE_BUFFER_H_
@@ -0,0 +1,89 @@
+#include "mailbox.h"
+
+#ifdef __linux__
+    #include <sys/eventfd.h>
+#endif
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace chatter {
+
+Mailbox::Mailbox()
+{
+#if defined(__linux__)
+    read_fd_ = write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (read_fd_ == -1)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+#elif !defined(_WIN32)
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    read_fd_ = fds[0];
+    write_fd_ = fds[1];
+#else
+    // Windows runs a single shard, so nothing is ever posted.
+    read_fd_ = write_fd_ = INVALID_SOCKET;
+#endif
+}
+
+Mailbox::~Mailbox()
+{
+#ifndef _WIN32
+    close(read_fd_);
+    if (write_fd_ != read_fd_)
+    {
+        close(write_fd_);
+    }
+#endif
+}
+
+void Mailbox::Post(ShardMessage message)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        was_empty = queue_.empty();
+        queue_.push_back(std::move(message));
+    }
+#ifndef _WIN32
+    if (was_empty)
+    {
+        uint64_t one = 1;
+        if (write(write_fd_, &one, sizeof one) == -1)
+        {
+            // EAGAIN means a wakeup is already pending.
+        }
+    }
+#else
+    (void)was_empty;
+#endif
+}
+
+void Mailbox::Drain(std::vector<ShardMessage>& messages)
+{
+#ifndef _WIN32
+    uint64_t counter;
+    while (read(read_fd_, &counter, sizeof counter) > 0)
+    {
+    }
+#endif
+    messages.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    messages.swap(queue_);
+}
+
+} // namespace chatter
@@ -0,0 +1,76 @@
+#ifndef CHATTER_MAILBOX_H_
+#define CHATTER_MAILBOX_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "client.h"
+#include "rendered_message.h"
+
+namespace chatter {
+
+constexpr size_t NoNode = SIZE_MAX;
+
+// Directory updates and deliveries exchanged between shards, and between
+// nodes over peer links. Every shard keeps a replica of all clients and
+// rooms so that /who, /rooms and /tell can be answered without asking
+// another thread or node.
+struct ShardMessage
+{
+    enum class Type
+    {
+        CONNECT,
+        DISCONNECT,
+        RENAME,
+        JOIN,
+        BROADCAST,
+        TELL,
+        ANNOUNCE,
+        // A client joined a room with no other member on its shard; asks a
+        // shard or node with members for the room's history.
+        FETCH_HISTORY,
+        // The reply, sent back to the shard of the client that asked.
+        HISTORY,
+        // A client switched to the binary protocol.
+        BINARY,
+        // Stop for a handoff to a new process. Never sent to a peer.
+        HANDOFF,
+    };
+    Type type;
+    ClientId client = NoClient;
+    ClientId target = NoClient;
+    std::string name;
+    std::string room;
+    std::string password;
+    bool created = false;
+    RenderedMessage rendered;
+    std::vector<RenderedMessage> history;
+    // Set when another shard hands shard 0 a message for this peer node.
+    size_t relay = NoNode;
+};
+
+// Per-shard inbound queue. Posting from any thread is a short critical
+// section on this shard's mutex only; the owning shard drains the whole
+// batch with one swap after its wake descriptor becomes readable.
+class Mailbox
+{
+    public:
+        Mailbox();
+        ~Mailbox();
+        Mailbox(const Mailbox&) = delete;
+        Mailbox& operator=(const Mailbox&) = delete;
+        sock_t GetFd() const { return read_fd_; }
+        void Post(ShardMessage message);
+        void Drain(std::vector<ShardMessage>& messages);
+    private:
+        std::mutex mutex_;
+        std::vector<ShardMessage> queue_;
+        sock_t read_fd_;
+        sock_t write_fd_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_MAILBOX_H_
@@ -0,0 +1,228 @@
+#include "mccp.h"
+
+#ifdef CHATTER_HAVE_ZLIB
+    #include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "stats.h"
+#include "telnet.h"
+
+namespace chatter {
+
+namespace {
+
+// Largest stored block deflate allows.
+constexpr size_t MaxStoredBlock = 65535;
+
+// Shared chunks are numbered across the process, so a client's last chunk
+// never matches one from another room's stream.
+std::atomic<uint64_t> next_chunk{0};
+
+} // namespace
+
+#ifdef CHATTER_HAVE_ZLIB
+
+// A small window keeps each room's stream to about 32 KiB; chat lines are
+// short and mostly repeat the lines just before them.
+constexpr int WindowBits = 12;
+constexpr int MemoryLevel = 5;
+
+struct RoomCompressor::Stream
+{
+    explicit Stream(int level)
+    {
+        // Raw deflate: the zlib header and checksum are the client's own.
+        if (deflateInit2(&z, level, Z_DEFLATED, -WindowBits, MemoryLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            fprintf(stderr, "chatter-server: deflateInit2 failed\r\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ~Stream() { deflateEnd(&z); }
+    z_stream z{};
+    uint64_t last = 0;
+    bool fresh = true;
+};
+
+bool IsCompressionAvailable()
+{
+    return true;
+}
+
+uint32_t Checksum(const std::string& data)
+{
+    return static_cast<uint32_t>(adler32(1, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size())));
+}
+
+uint32_t CombineChecksums(uint32_t first, uint32_t second, size_t second_size)
+{
+    return static_cast<uint32_t>(adler32_combine(first, second, static_cast<z_off_t>(second_size)));
+}
+
+void RoomCompressor::Compress(size_t variant, const Payload& payload)
+{
+    Chunk& chunk = chunks_[variant];
+    chunk = Chunk();
+    chunk.source = payload;
+    chunk.adler = Checksum(*payload);
+    std::unique_ptr<Stream>& stream = streams_[variant];
+    if (stream == nullptr)
+    {
+        stream = std::make_unique<Stream>(level_);
+    }
+    else if (stream->fresh)
+    {
+        deflateReset(&stream->z);
+    }
+    auto start = std::chrono::steady_clock::now();
+    z_stream& z = stream->z;
+    auto out = std::make_shared<std::string>();
+    // The bound leaves room for the sync flush's empty block as well.
+    out->resize(deflateBound(&z, static_cast<uLong>(payload->size())) + 16);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload->data()));
+    z.avail_in = static_cast<uInt>(payload->size());
+    size_t written = 0;
+    do
+    {
+        if (written == out->size())
+        {
+            out->resize(out->size() * 2);
+        }
+        z.next_out = reinterpret_cast<Bytef*>(out->data() + written);
+        z.avail_out = static_cast<uInt>(out->size() - written);
+        deflate(&z, Z_SYNC_FLUSH);
+        written = out->size() - z.avail_out;
+    }
+    while (z.avail_out == 0);
+    out->resize(written);
+    stats_->compress_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    chunk.compressed = std::move(out);
+    chunk.number = next_chunk.fetch_add(1, std::memory_order_relaxed) + 1;
+    chunk.previous = stream->fresh ? 0 : stream->last;
+    stream->last = chunk.number;
+    stream->fresh = false;
+}
+
+#else
+
+struct RoomCompressor::Stream
+{
+    uint64_t last = 0;
+    bool fresh = true;
+};
+
+bool IsCompressionAvailable()
+{
+    return false;
+}
+
+uint32_t Checksum(const std::string&)
+{
+    return 1;
+}
+
+uint32_t CombineChecksums(uint32_t first, uint32_t, size_t)
+{
+    return first;
+}
+
+void RoomCompressor::Compress(size_t variant, const Payload& payload)
+{
+    Chunk& chunk = chunks_[variant];
+    chunk = Chunk();
+    chunk.source = payload;
+    chunk.compressed = StoreUncompressed(payload);
+}
+
+#endif
+
+std::string StartCompression()
+{
+    const unsigned char start[] = {telnet::Iac, telnet::Sb, telnet::Compress2, telnet::Iac, telnet::Se,
+        // zlib header: deflate with a 32 KiB window.
+        0x78, 0x9c};
+    return std::string(reinterpret_cast<const char*>(start), sizeof start);
+}
+
+std::string EndCompression(uint32_t adler)
+{
+    // An empty final block with fixed codes, then the checksum, big-endian.
+    std::string end = {0x03, 0x00};
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        end.push_back(static_cast<char>(adler >> shift));
+    }
+    return end;
+}
+
+Payload StoreUncompressed(const Payload& data)
+{
+    auto out = std::make_shared<std::string>();
+    out->reserve(data->size() + 5 * (data->size() / MaxStoredBlock + 1));
+    size_t offset = 0;
+    do
+    {
+        size_t size = std::min(data->size() - offset, MaxStoredBlock);
+        // Not final, stored; the block header fills its own byte since the
+        // stream is byte-aligned between messages.
+        out->push_back(0);
+        uint16_t length = static_cast<uint16_t>(size);
+        uint16_t complement = static_cast<uint16_t>(~length);
+        out->push_back(static_cast<char>(length));
+        out->push_back(static_cast<char>(length >> 8));
+        out->push_back(static_cast<char>(complement));
+        out->push_back(static_cast<char>(complement >> 8));
+        out->append(*data, offset, size);
+        offset += size;
+    }
+    while (offset < data->size());
+    return out;
+}
+
+RoomCompressor::RoomCompressor(int level, ShardStats& stats) : level_(level), stats_(&stats)
+{
+}
+
+RoomCompressor::~RoomCompressor() = default;
+
+Payload RoomCompressor::Take(const Payload& payload, size_t variant, CompressionState& state)
+{
+    Chunk& chunk = chunks_[variant];
+    if (chunk.source != payload)
+    {
+        Compress(variant, payload);
+    }
+    state.adler = CombineChecksums(state.adler, chunk.adler, payload->size());
+    if (chunk.previous == 0 || chunk.previous == state.last_chunk)
+    {
+        state.last_chunk = chunk.number;
+        return chunk.compressed;
+    }
+    // The client got something else since this stream's last chunk, so it
+    // can't decode this one. The stream starts over with the next message.
+    streams_[variant]->fresh = true;
+    state.last_chunk = 0;
+    if (chunk.stored == nullptr)
+    {
+        chunk.stored = StoreUncompressed(payload);
+    }
+    return chunk.stored;
+}
+
+void RoomCompressor::Reset()
+{
+    for (size_t variant = 0; variant < Variants; ++variant)
+    {
+        streams_[variant].reset();
+        chunks_[variant] = Chunk();
+    }
+}
+
+} // namespace chatter
@@ -0,0 +1,78 @@
+#ifndef CHATTER_MCCP_H_
+#define CHATTER_MCCP_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "rendered_message.h"
+
+namespace chatter {
+
+class ShardStats;
+
+// Compression for telnet clients that accept MCCP v2. Nothing is kept per
+// client but a checksum: everything a client is sent is deflate data that
+// ends on a byte boundary, either a chunk of its room's shared stream or
+// stored (uncompressed) blocks, so chunks from anywhere can follow each other
+// as long as a shared chunk only ever follows the chunk it was compressed
+// after.
+struct CompressionState
+{
+    // Of everything sent since compression began, to end the stream with.
+    uint32_t adler = 1;
+    // The last shared chunk the client got, if nothing came after it.
+    uint64_t last_chunk = 0;
+};
+
+bool IsCompressionAvailable();
+// Sent uncompressed after the client agrees; compressed data follows.
+std::string StartCompression();
+// Ends the stream, after which the client reads plain text again.
+std::string EndCompression(uint32_t adler);
+// `data` as stored blocks, which fit anywhere in a stream.
+Payload StoreUncompressed(const Payload& data);
+uint32_t Checksum(const std::string& data);
+uint32_t CombineChecksums(uint32_t first, uint32_t second, size_t second_size);
+
+// One room's messages compressed for its members, once per text variant
+// however many members get them. Each variant is one deflate stream that
+// carries its history from message to message. A member who got something
+// else since the last chunk gets stored blocks instead, and the stream
+// starts over with the next message so everyone can take it again.
+class RoomCompressor
+{
+    public:
+        RoomCompressor(int level, ShardStats& stats);
+        ~RoomCompressor();
+        RoomCompressor(const RoomCompressor&) = delete;
+        RoomCompressor& operator=(const RoomCompressor&) = delete;
+        // Returns what to queue for one member receiving `payload`, variant
+        // `variant` of the current message.
+        Payload Take(const Payload& payload, size_t variant, CompressionState& state);
+        // Frees the streams; the next message starts them over.
+        void Reset();
+    private:
+        struct Stream;
+        struct Chunk
+        {
+            Payload source;
+            Payload compressed;
+            Payload stored;
+            uint64_t number = 0;
+            // The chunk this one must follow, or 0 if it refers to nothing.
+            uint64_t previous = 0;
+            uint32_t adler = 1;
+        };
+        static constexpr size_t Variants = 3;
+        void Compress(size_t variant, const Payload& payload);
+        int level_;
+        ShardStats* stats_;
+        std::array<std::unique_ptr<Stream>, Variants> streams_;
+        std::array<Chunk, Variants> chunks_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_MCCP_H_
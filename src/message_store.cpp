@@ -0,0 +1,373 @@
+#include "message_store.h"
+
+#ifdef _WIN32
+    #include <fstream>
+    #include <sstream>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include "time_util.h"
+
+namespace chatter {
+
+namespace {
+
+constexpr int64_t MicrosPerSecond = 1000000;
+
+std::string SegmentPath(const std::string& directory, uint64_t first_seq, const char* extension)
+{
+    char name[32];
+    snprintf(name, sizeof name, "%020" PRIu64 "%s", first_seq, extension);
+    return directory + "/" + name;
+}
+
+// First sequence numbers of the room's segments, oldest first.
+std::vector<uint64_t> ListSegments(const std::string& directory)
+{
+    std::vector<uint64_t> segments;
+    std::error_code error;
+    for (const auto& file : std::filesystem::directory_iterator(directory, error))
+    {
+        if (file.path().extension() == ".idx")
+        {
+            segments.push_back(strtoull(file.path().stem().string().c_str(), nullptr, 10));
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+size_t EntryCount(const MappedFile& index)
+{
+    return index.Size() / sizeof(StoreIndexEntry);
+}
+
+StoreIndexEntry EntryAt(const MappedFile& index, size_t i)
+{
+    StoreIndexEntry entry;
+    memcpy(&entry, index.Data() + i * sizeof entry, sizeof entry);
+    return entry;
+}
+
+int64_t KeyOf(const MappedFile& index, uint64_t first_seq, size_t i, bool by_time)
+{
+    return by_time ? EntryAt(index, i).time_us : static_cast<int64_t>(first_seq + i);
+}
+
+time_t MakeUtcTime(tm& utc_time)
+{
+#ifdef _WIN32
+    return _mkgmtime(&utc_time);
+#else
+    return timegm(&utc_time);
+#endif
+}
+
+} // namespace
+
+SegmentWriter::SegmentWriter(const std::string& directory, size_t segment_bytes, long segment_seconds)
+    : directory_(directory), segment_bytes_(segment_bytes), segment_seconds_(segment_seconds)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    Recover();
+}
+
+SegmentWriter::~SegmentWriter()
+{
+    Flush(false);
+    Close();
+}
+
+void SegmentWriter::Recover()
+{
+    // Carry on numbering after the last indexed record. Records whose index
+    // entry never made it to disk are not visible to readers, so their
+    // numbers are handed out again in a fresh segment.
+    std::vector<uint64_t> segments = ListSegments(directory_);
+    for (auto first = segments.rbegin(); first != segments.rend(); ++first)
+    {
+        MappedFile index(SegmentPath(directory_, *first, ".idx"));
+        size_t count = EntryCount(index);
+        if (count != 0)
+        {
+            next_seq_ = *first + count;
+            last_time_us_ = EntryAt(index, count - 1).time_us;
+            return;
+        }
+    }
+}
+
+void SegmentWriter::Close()
+{
+    if (data_ != nullptr)
+    {
+        fclose(data_);
+        data_ = nullptr;
+    }
+    if (index_ != nullptr)
+    {
+        fclose(index_);
+        index_ = nullptr;
+    }
+}
+
+void SegmentWriter::OpenSegment(time_t now)
+{
+    // A segment named after the next sequence number holds nothing indexed
+    // yet, so any leftovers in it can be truncated.
+    std::string data_path = SegmentPath(directory_, next_seq_, ".seg");
+    std::string index_path = SegmentPath(directory_, next_seq_, ".idx");
+    data_ = fopen(data_path.c_str(), "wb");
+    index_ = fopen(index_path.c_str(), "wb");
+    if (data_ == nullptr || index_ == nullptr)
+    {
+        perror(data_ == nullptr ? data_path.c_str() : index_path.c_str());
+        Close();
+        return;
+    }
+    setvbuf(data_, nullptr, _IONBF, 0);
+    setvbuf(index_, nullptr, _IONBF, 0);
+    data_bytes_ = 0;
+    opened_ = now;
+}
+
+void SegmentWriter::Append(int64_t time_us, std::string_view text)
+{
+    time_us = std::max(time_us, last_time_us_);
+    time_t now = static_cast<time_t>(time_us / MicrosPerSecond);
+    size_t segment_bytes = data_bytes_ + pending_data_.size();
+    bool too_big = segment_bytes_ != 0 && segment_bytes != 0 && segment_bytes + text.size() > segment_bytes_;
+    bool too_old = segment_seconds_ != 0 && segment_bytes != 0 && now - opened_ >= segment_seconds_;
+    if (data_ == nullptr || too_big || too_old)
+    {
+        written_ += WritePending();
+        Close();
+        OpenSegment(now);
+        if (data_ == nullptr)
+        {
+            return;
+        }
+    }
+    pending_data_.append(text);
+    StoreIndexEntry entry{time_us, data_bytes_ + pending_data_.size()};
+    pending_index_.append(reinterpret_cast<const char*>(&entry), sizeof entry);
+    ++next_seq_;
+    last_time_us_ = time_us;
+}
+
+size_t SegmentWriter::WritePending()
+{
+    if (pending_data_.empty() || data_ == nullptr)
+    {
+        pending_data_.clear();
+        pending_index_.clear();
+        return 0;
+    }
+    // Data first, so an index entry never points past what is on disk.
+    fwrite(pending_data_.data(), 1, pending_data_.size(), data_);
+    fwrite(pending_index_.data(), 1, pending_index_.size(), index_);
+    size_t bytes = pending_data_.size() + pending_index_.size();
+    data_bytes_ += pending_data_.size();
+    pending_data_.clear();
+    pending_index_.clear();
+    return bytes;
+}
+
+size_t SegmentWriter::Flush(bool sync)
+{
+    size_t bytes = written_ + WritePending();
+    written_ = 0;
+#ifndef _WIN32
+    if (sync && bytes != 0 && data_ != nullptr)
+    {
+        fsync(fileno(data_));
+        fsync(fileno(index_));
+    }
+#endif
+    return bytes;
+}
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    contents_ = contents.str();
+    data_ = contents_.data();
+    size_ = contents_.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            data_ = static_cast<const char*>(data);
+            size_ = static_cast<size_t>(info.st_size);
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (data_ != nullptr)
+    {
+        munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+size_t StoreReader::ReadBySeq(uint64_t from, uint64_t to, size_t limit, const Visitor& visit) const
+{
+    auto clamp = [](uint64_t seq) { return static_cast<int64_t>(std::min<uint64_t>(seq, INT64_MAX)); };
+    return Read(false, clamp(from), clamp(to), limit, visit);
+}
+
+size_t StoreReader::ReadByTime(int64_t from_us, int64_t to_us, size_t limit, const Visitor& visit) const
+{
+    return Read(true, from_us, to_us, limit, visit);
+}
+
+size_t StoreReader::Read(bool by_time, int64_t from, int64_t to, size_t limit, const Visitor& visit) const
+{
+    size_t visited = 0;
+    std::vector<uint64_t> segments = ListSegments(directory_);
+    for (size_t i = 0; i < segments.size() && visited < limit; ++i)
+    {
+        if (!by_time)
+        {
+            if (static_cast<int64_t>(segments[i]) > to)
+            {
+                break;
+            }
+            if (i + 1 < segments.size() && static_cast<int64_t>(segments[i + 1]) <= from)
+            {
+                continue;
+            }
+        }
+        MappedFile index(SegmentPath(directory_, segments[i], ".idx"));
+        size_t count = EntryCount(index);
+        if (count == 0 || KeyOf(index, segments[i], count - 1, by_time) < from)
+        {
+            continue;
+        }
+        if (KeyOf(index, segments[i], 0, by_time) > to)
+        {
+            break;
+        }
+        size_t low = 0;
+        size_t high = count;
+        while (low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            if (KeyOf(index, segments[i], middle, by_time) < from)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        MappedFile data(SegmentPath(directory_, segments[i], ".seg"));
+        for (size_t j = low; j < count && visited < limit; ++j)
+        {
+            if (KeyOf(index, segments[i], j, by_time) > to)
+            {
+                return visited;
+            }
+            StoreIndexEntry entry = EntryAt(index, j);
+            uint64_t start = j == 0 ? 0 : EntryAt(index, j - 1).end;
+            if (entry.end > data.Size() || start > entry.end)
+            {
+                break;
+            }
+            visit({segments[i] + j, entry.time_us, std::string_view(data.Data() + start, entry.end - start)});
+            ++visited;
+        }
+    }
+    return visited;
+}
+
+bool ParseStoreTime(std::string_view text, time_t now, bool upper, int64_t& time_us)
+{
+    tm utc_time = UtcTime(now);
+    int year = utc_time.tm_year + 1900;
+    int month = utc_time.tm_mon + 1;
+    int day = utc_time.tm_mday;
+    int hour = 0;
+    int minute = 0;
+    int second = 0;
+    int used = 0;
+    std::string input(text);
+    if (text.size() == 5 || text.size() == 8)
+    {
+        if (sscanf(input.c_str(), "%2d:%2d%n:%2d%n", &hour, &minute, &used, &second, &used) < 2)
+        {
+            return false;
+        }
+    }
+    else if (text.size() == 16 || text.size() == 19)
+    {
+        if (sscanf(input.c_str(), "%4d-%2d-%2dT%2d:%2d%n:%2d%n", &year, &month, &day, &hour, &minute, &used,
+            &second, &used) < 5)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+    if (static_cast<size_t>(used) != text.size() || month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour > 23 || minute > 59 || second > 59 || hour < 0 || minute < 0 || second < 0)
+    {
+        return false;
+    }
+    tm parsed = {};
+    parsed.tm_year = year - 1900;
+    parsed.tm_mon = month - 1;
+    parsed.tm_mday = day;
+    parsed.tm_hour = hour;
+    parsed.tm_min = minute;
+    parsed.tm_sec = second;
+    int64_t seconds = static_cast<int64_t>(MakeUtcTime(parsed));
+    if (upper)
+    {
+        bool whole_minute = text.size() == 5 || text.size() == 16;
+        seconds += whole_minute ? 59 : 0;
+    }
+    time_us = seconds * MicrosPerSecond + (upper ? MicrosPerSecond - 1 : 0);
+    return true;
+}
+
+std::string FormatStoreTime(int64_t time_us)
+{
+    tm utc_time = UtcTime(static_cast<time_t>(time_us / MicrosPerSecond));
+    char buffer[40];
+    size_t length = strftime(buffer, sizeof buffer, "%Y-%m-%dT%H:%M:%S", &utc_time);
+    snprintf(buffer + length, sizeof buffer - length, ".%06d", static_cast<int>(time_us % MicrosPerSecond));
+    return buffer;
+}
+
+} // namespace chatter
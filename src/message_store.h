@@ -0,0 +1,107 @@
+#ifndef CHATTER_MESSAGE_STORE_H_
+#define CHATTER_MESSAGE_STORE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace chatter {
+
+// A room's store is a directory of append-only segments. Each segment is a
+// pair of files named after the sequence number of its first message:
+// <seq>.seg holds the message text back to back, exactly as a text log
+// would, and <seq>.idx holds one StoreIndexEntry per message giving its time
+// and where it ends (it starts where the previous one ends). Numbers within a
+// segment are consecutive and times only grow, so both kinds of range query
+// are binary searches over the mapped index. Fields are in host byte order.
+struct StoreIndexEntry
+{
+    int64_t time_us;
+    uint64_t end;
+};
+
+struct StoredMessage
+{
+    uint64_t seq;
+    int64_t time_us;
+    std::string_view text;
+};
+
+// Appends to a room's newest segment. Messages are buffered and written with
+// one write per file on Flush(); data goes out before the index entries that
+// point into it. A new segment is started every `segment_bytes` or
+// `segment_seconds` (0 disables either).
+class SegmentWriter
+{
+    public:
+        SegmentWriter(const std::string& directory, size_t segment_bytes, long segment_seconds);
+        ~SegmentWriter();
+        SegmentWriter(const SegmentWriter&) = delete;
+        SegmentWriter& operator=(const SegmentWriter&) = delete;
+        void Append(int64_t time_us, std::string_view text);
+        // Returns the number of bytes written.
+        size_t Flush(bool sync);
+    private:
+        void Recover();
+        void Close();
+        size_t WritePending();
+        void OpenSegment(time_t now);
+        std::string directory_;
+        size_t segment_bytes_;
+        long segment_seconds_;
+        FILE* data_ = nullptr;
+        FILE* index_ = nullptr;
+        size_t data_bytes_ = 0;
+        size_t written_ = 0;
+        time_t opened_ = 0;
+        uint64_t next_seq_ = 1;
+        int64_t last_time_us_ = 0;
+        std::string pending_data_;
+        std::string pending_index_;
+};
+
+// Read-only view of a file, mapped where the platform allows it.
+class MappedFile
+{
+    public:
+        explicit MappedFile(const std::string& path);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        const char* Data() const { return data_; }
+        size_t Size() const { return size_; }
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+#ifdef _WIN32
+        std::string contents_;
+#endif
+};
+
+// Range queries over a room's store directory. Segments are mapped while a
+// query runs; a segment still being written is read up to its last complete
+// record. Both bounds are inclusive. At most `limit` messages are visited,
+// oldest first; returns how many were.
+class StoreReader
+{
+    public:
+        using Visitor = std::function<void(const StoredMessage&)>;
+        explicit StoreReader(const std::string& directory) : directory_(directory) { }
+        size_t ReadBySeq(uint64_t from, uint64_t to, size_t limit, const Visitor& visit) const;
+        size_t ReadByTime(int64_t from_us, int64_t to_us, size_t limit, const Visitor& visit) const;
+    private:
+        size_t Read(bool by_time, int64_t from, int64_t to, size_t limit, const Visitor& visit) const;
+        std::string directory_;
+};
+
+// Parses "HH:MM[:SS]" (on the UTC day of `now`) or "YYYY-MM-DDTHH:MM[:SS]".
+// An upper bound given without seconds covers the whole minute.
+bool ParseStoreTime(std::string_view text, time_t now, bool upper, int64_t& time_us);
+std::string FormatStoreTime(int64_t time_us);
+
+} // namespace chatter
+
+#endif // CHATTER_MESSAGE_STORE_H_
@@ -0,0 +1,184 @@
+#include "outbound_queue.h"
+
+#ifndef _WIN32
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <limits.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+
+namespace chatter {
+
+namespace {
+
+#ifdef IOV_MAX
+constexpr size_t MaxIovecs = IOV_MAX < 64 ? IOV_MAX : 64;
+#else
+constexpr size_t MaxIovecs = 64;
+#endif
+
+bool WouldBlock()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+void SetCork(sock_t fd, int on)
+{
+#ifdef TCP_CORK
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+#else
+    (void)fd;
+    (void)on;
+#endif
+}
+
+} // namespace
+
+bool OutboundQueue::Push(Payload data, bool droppable, const OutboundLimits& limits)
+{
+    bytes_ += data->size();
+    entries_.push_back({std::move(data), droppable});
+    if (!OverLimits(limits))
+    {
+        return true;
+    }
+    if (limits.policy == SlowConsumerPolicy::DISCONNECT)
+    {
+        return false;
+    }
+    while (OverLimits(limits))
+    {
+        if (!DropOldest())
+        {
+            return false; // nothing left to shed but replies and notices
+        }
+    }
+    return true;
+}
+
+OutboundQueue::FlushResult OutboundQueue::Flush(sock_t fd, bool cork)
+{
+    bool corked = cork && entries_.size() > MaxIovecs;
+    if (corked)
+    {
+        SetCork(fd, 1);
+    }
+    FlushResult result = WriteAll(fd);
+    if (corked)
+    {
+        SetCork(fd, 0);
+    }
+    return result;
+}
+
+OutboundQueue::FlushResult OutboundQueue::WriteAll(sock_t fd)
+{
+    while (!entries_.empty())
+    {
+        long nbytes;
+#ifdef _WIN32
+        const std::string& head = *entries_.front().data;
+        nbytes = send(fd, head.data() + head_offset_, static_cast<int>(head.size() - head_offset_), 0);
+#else
+        iovec iov[MaxIovecs];
+        size_t count = 0;
+        for (auto it = entries_.begin(); it != entries_.end() && count < MaxIovecs; ++it, ++count)
+        {
+            size_t offset = count == 0 ? head_offset_ : 0;
+            iov[count].iov_base = const_cast<char*>(it->data->data() + offset);
+            iov[count].iov_len = it->data->size() - offset;
+        }
+        nbytes = writev(fd, iov, static_cast<int>(count));
+#endif
+        ++write_calls_;
+        if (nbytes == -1)
+        {
+            return WouldBlock() ? FlushResult::PENDING : FlushResult::ERROR;
+        }
+        Consume(static_cast<size_t>(nbytes));
+    }
+    return FlushResult::DONE;
+}
+
+void OutboundQueue::Gather(std::vector<Payload>& payloads, size_t& head_offset, size_t max)
+{
+    payloads.clear();
+    for (auto it = entries_.begin(); it != entries_.end() && payloads.size() < max; ++it)
+    {
+        payloads.push_back(it->data);
+    }
+    head_offset = head_offset_;
+    in_flight_ = payloads.size();
+    ++write_calls_;
+}
+
+void OutboundQueue::Complete(size_t written)
+{
+    in_flight_ = 0;
+    Consume(written);
+}
+
+std::string OutboundQueue::GetUnsent() const
+{
+    std::string unsent;
+    unsent.reserve(bytes_);
+    size_t offset = head_offset_;
+    for (const Entry& entry : entries_)
+    {
+        unsent.append(*entry.data, offset, std::string::npos);
+        offset = 0;
+    }
+    return unsent;
+}
+
+void OutboundQueue::Consume(size_t written)
+{
+    bytes_ -= written;
+    written_ += written;
+    while (written > 0)
+    {
+        size_t remaining = entries_.front().data->size() - head_offset_;
+        if (written < remaining)
+        {
+            head_offset_ += written;
+            break;
+        }
+        written -= remaining;
+        head_offset_ = 0;
+        entries_.pop_front();
+    }
+}
+
+bool OutboundQueue::OverLimits(const OutboundLimits& limits) const
+{
+    return bytes_ > limits.max_bytes || entries_.size() > limits.max_messages;
+}
+
+bool OutboundQueue::DropOldest()
+{
+    // The head may be partially written and a send may be reading the
+    // first entries; dropping those would corrupt the stream.
+    size_t skip = head_offset_ != 0 ? std::max<size_t>(in_flight_, 1) : in_flight_;
+    auto it = entries_.begin() + static_cast<std::ptrdiff_t>(std::min(skip, entries_.size()));
+    for (; it != entries_.end(); ++it)
+    {
+        if (it->droppable)
+        {
+            bytes_ -= it->data->size();
+            entries_.erase(it);
+            ++dropped_;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace chatter
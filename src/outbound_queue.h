@@ -0,0 +1,85 @@
+#ifndef CHATTER_OUTBOUND_QUEUE_H_
+#define CHATTER_OUTBOUND_QUEUE_H_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "rendered_message.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    typedef SOCKET sock_t;
+#else
+    typedef int sock_t;
+#endif
+
+namespace chatter {
+
+enum class SlowConsumerPolicy
+{
+    DROP_OLDEST,
+    DISCONNECT,
+};
+
+struct OutboundLimits
+{
+    size_t max_bytes = 1 << 20;
+    size_t max_messages = 4096;
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DROP_OLDEST;
+};
+
+// Bytes waiting to be written to one client. Writes that would block stay
+// queued and are retried with writev() once the socket is writable again.
+class OutboundQueue
+{
+    public:
+        enum class FlushResult
+        {
+            DONE,
+            PENDING,
+            ERROR,
+        };
+        // Returns false once the client is past the limits and should be
+        // disconnected. Droppable entries are chat lines that DROP_OLDEST
+        // may discard to make room.
+        bool Push(Payload data, bool droppable, const OutboundLimits& limits);
+        // With cork set, a backlog too long for one writev() is held under
+        // TCP_CORK so it still leaves in full-sized segments.
+        FlushResult Flush(sock_t fd, bool cork = false);
+        // For sends the event loop completes later: hands out up to `max`
+        // payloads from the head, the first starting at `head_offset`. They
+        // stay queued, and are not dropped, until Complete().
+        void Gather(std::vector<Payload>& payloads, size_t& head_offset, size_t max);
+        void Complete(size_t written);
+        // Everything not yet written, in one string.
+        std::string GetUnsent() const;
+        bool Empty() const { return entries_.empty(); }
+        size_t GetBytes() const { return bytes_; }
+        size_t GetMessages() const { return entries_.size(); }
+        size_t GetDropped() const { return dropped_; }
+        uint64_t GetWritten() const { return written_; }
+        uint64_t GetWriteCalls() const { return write_calls_; }
+    private:
+        struct Entry
+        {
+            Payload data;
+            bool droppable;
+        };
+        FlushResult WriteAll(sock_t fd);
+        void Consume(size_t written);
+        bool OverLimits(const OutboundLimits& limits) const;
+        bool DropOldest();
+        std::deque<Entry> entries_;
+        size_t head_offset_ = 0;
+        size_t in_flight_ = 0;
+        size_t bytes_ = 0;
+        size_t dropped_ = 0;
+        uint64_t written_ = 0;
+        uint64_t write_calls_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_OUTBOUND_QUEUE_H_
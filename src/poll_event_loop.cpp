@@ -0,0 +1,108 @@
+#include "poll_event_loop.h"
+
+#include <cerrno>
+
+namespace chatter {
+
+namespace {
+
+short ToPollEvents(unsigned events)
+{
+    short ret = 0;
+    if (events & EventRead)
+    {
+        ret |= POLLIN;
+    }
+    if (events & EventWrite)
+    {
+        ret |= POLLOUT;
+    }
+    return ret;
+}
+
+unsigned FromPollEvents(short revents)
+{
+    unsigned ret = 0;
+    if (revents & POLLIN)
+    {
+        ret |= EventRead;
+    }
+    if (revents & POLLOUT)
+    {
+        ret |= EventWrite;
+    }
+    if (revents & POLLHUP)
+    {
+        ret |= EventHangup;
+    }
+    if (revents & (POLLERR | POLLNVAL))
+    {
+        ret |= EventError;
+    }
+    return ret;
+}
+
+} // namespace
+
+bool PollEventLoop::Add(sock_t fd, unsigned events, bool)
+{
+    if (!index_.emplace(fd, pfds_.size()).second)
+    {
+        return false;
+    }
+    pfds_.push_back({fd, ToPollEvents(events), 0});
+    return true;
+}
+
+bool PollEventLoop::Modify(sock_t fd, unsigned events, bool)
+{
+    auto it = index_.find(fd);
+    if (it == index_.end())
+    {
+        return false;
+    }
+    pfds_[it->second].events = ToPollEvents(events);
+    return true;
+}
+
+void PollEventLoop::Remove(sock_t fd)
+{
+    auto it = index_.find(fd);
+    if (it == index_.end())
+    {
+        return;
+    }
+    size_t index = it->second;
+    index_.erase(it);
+    if (index != pfds_.size() - 1)
+    {
+        pfds_[index] = pfds_.back();
+        index_[pfds_[index].fd] = index;
+    }
+    pfds_.pop_back();
+}
+
+int PollEventLoop::Wait(std::vector<Event>& events, int timeout_ms)
+{
+    events.clear();
+    ++syscalls_;
+    int poll_count = poll(pfds_.data(), static_cast<nfds_t>(pfds_.size()), timeout_ms);
+    if (poll_count == -1)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (const pollfd& pfd : pfds_)
+    {
+        if (pfd.revents != 0)
+        {
+            events.push_back({pfd.fd, FromPollEvents(pfd.revents)});
+            if (static_cast<int>(events.size()) == poll_count)
+            {
+                break;
+            }
+        }
+    }
+    return static_cast<int>(events.size());
+}
+
+} // namespace chatter
@@ -0,0 +1,36 @@
+#ifndef CHATTER_POLL_EVENT_LOOP_H_
+#define CHATTER_POLL_EVENT_LOOP_H_
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #define poll WSAPoll
+    typedef unsigned long int nfds_t;
+#else
+    #include <poll.h>
+#endif
+
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.h"
+
+namespace chatter {
+
+// Portable fallback. Removal swaps the last pollfd into the freed slot so
+// add/remove stay O(1); Wait() is still O(n) in the number of sockets.
+class PollEventLoop : public EventLoop
+{
+    public:
+        bool Add(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        bool Modify(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        void Remove(sock_t fd) override;
+        int Wait(std::vector<Event>& events, int timeout_ms) override;
+        const char* Name() const override { return "poll"; }
+    private:
+        std::vector<pollfd> pfds_;
+        std::unordered_map<sock_t, size_t> index_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_POLL_EVENT_LOOP_H_
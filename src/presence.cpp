@@ -0,0 +1,66 @@
+#include "presence.h"
+
+namespace chatter {
+
+namespace {
+
+struct PresenceFormat
+{
+    const char* single_suffix;
+    const char* digest;
+};
+
+constexpr PresenceFormat Formats[]
+{
+    {" has connected!", " users connected: "},
+    {" has disconnected!", " users disconnected: "},
+    {" has joined the room!", " users joined the room: "},
+    {" has left the room!", " users left the room: "},
+    {".", " users changed their names: "},
+};
+
+} // namespace
+
+void PresenceDigest::Add(PresenceKind kind, ClientId subject, const std::string& text)
+{
+    Events& events = events_[static_cast<size_t>(kind)];
+    if (events.count < MaxPresenceNames)
+    {
+        if (events.count != 0)
+        {
+            events.names += ", ";
+        }
+        events.names += text;
+    }
+    events.subject = subject;
+    ++events.count;
+    empty_ = false;
+}
+
+std::vector<PresenceLine> PresenceDigest::Take()
+{
+    std::vector<PresenceLine> lines;
+    for (size_t kind = 0; kind < KindCount; ++kind)
+    {
+        Events& events = events_[kind];
+        PresenceKind presence_kind = static_cast<PresenceKind>(kind);
+        if (events.count == 1)
+        {
+            lines.push_back({presence_kind, events.subject, events.names + Formats[kind].single_suffix + "\r\n"});
+        }
+        else if (events.count > 1)
+        {
+            std::string text = std::to_string(events.count) + Formats[kind].digest + events.names;
+            if (events.count > MaxPresenceNames)
+            {
+                text += " and " + std::to_string(events.count - MaxPresenceNames) + " more";
+            }
+            lines.push_back({presence_kind, NoClient, text + ".\r\n"});
+        }
+        events = Events();
+    }
+    empty_ = true;
+    return lines;
+}
+
+} // namespace chatter
@@ -0,0 +1,61 @@
+#ifndef CHATTER_PRESENCE_H_
+#define CHATTER_PRESENCE_H_
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "client.h"
+
+namespace chatter {
+
+constexpr int DefaultPresenceWindowMs = 200;
+constexpr size_t DefaultPresenceMaxMembers = 1000;
+// Names listed in one digest line before "and N more".
+constexpr size_t MaxPresenceNames = 10;
+
+enum class PresenceKind
+{
+    CONNECTED,
+    DISCONNECTED,
+    JOINED,
+    LEFT,
+    RENAMED,
+};
+
+struct PresenceLine
+{
+    PresenceKind kind;
+    // The client a lone event is about, so it can be spared its own notice;
+    // NoClient for a digest of several.
+    ClientId subject;
+    std::string text;
+};
+
+// Collects connect/disconnect or join/leave/rename events until the next
+// flush and renders them as at most one line per kind: a lone event reads as
+// it always has, several become "12 users joined the room: ...". Memory per
+// kind is bounded by MaxPresenceNames.
+class PresenceDigest
+{
+    public:
+        // `text` names the client, e.g. "[3]anon" or "[3]anon is now known as bob".
+        void Add(PresenceKind kind, ClientId subject, const std::string& text);
+        bool IsEmpty() const { return empty_; }
+        // Renders the pending events and clears them.
+        std::vector<PresenceLine> Take();
+    private:
+        static constexpr size_t KindCount = static_cast<size_t>(PresenceKind::RENAMED) + 1;
+        struct Events
+        {
+            size_t count = 0;
+            ClientId subject = NoClient;
+            std::string names;
+        };
+        std::array<Events, KindCount> events_;
+        bool empty_ = true;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_PRESENCE_H_
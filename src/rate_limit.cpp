@@ -0,0 +1,63 @@
+#include "rate_limit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace chatter {
+
+bool ParseRateLimit(const std::string& text, RateLimit& limit)
+{
+    char* end;
+    double rate = strtod(text.c_str(), &end);
+    double burst = rate;
+    if (*end == ':')
+    {
+        burst = strtod(end + 1, &end);
+    }
+    if (end == text.c_str() || *end != '\0' || !(rate >= 0) || !(burst >= 0))
+    {
+        return false;
+    }
+    limit.rate = rate;
+    limit.burst = std::max(burst, 1.0);
+    return true;
+}
+
+double TokenBucket::GetTokens(const RateLimit& limit, int64_t now_us) const
+{
+    if (tokens_ < 0)
+    {
+        return limit.burst;
+    }
+    double refill = static_cast<double>(now_us - updated_us_) * limit.rate / 1e6;
+    return std::min(limit.burst, tokens_ + refill);
+}
+
+bool TokenBucket::Take(const RateLimit& limit, int64_t now_us)
+{
+    if (limit.rate == 0)
+    {
+        return true;
+    }
+    double tokens = GetTokens(limit, now_us);
+    if (tokens < 1)
+    {
+        return false;
+    }
+    tokens_ = tokens - 1;
+    updated_us_ = now_us;
+    return true;
+}
+
+int64_t TokenBucket::GetWait(const RateLimit& limit, int64_t now_us) const
+{
+    double tokens = GetTokens(limit, now_us);
+    if (limit.rate == 0 || tokens >= 1)
+    {
+        return 0;
+    }
+    return static_cast<int64_t>(std::ceil((1 - tokens) * 1e6 / limit.rate));
+}
+
+} // namespace chatter
@@ -0,0 +1,57 @@
+#ifndef CHATTER_RATE_LIMIT_H_
+#define CHATTER_RATE_LIMIT_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace chatter {
+
+// Lines per second and how many may arrive back to back. A rate of 0 means
+// no limit.
+struct RateLimit
+{
+    double rate = 0;
+    double burst = 0;
+};
+
+constexpr RateLimit DefaultChatLimit{10, 20};
+constexpr RateLimit DefaultCommandLimit{2, 10};
+
+// What happens to a line that arrives with its bucket empty.
+enum class ThrottlePolicy
+{
+    QUEUE,
+    DROP,
+    NOTICE,
+};
+
+struct RateLimits
+{
+    RateLimit chat = DefaultChatLimit;
+    RateLimit command = DefaultCommandLimit;
+    // Chat limits that replace `chat` in particular rooms.
+    std::map<std::string, RateLimit> rooms;
+    ThrottlePolicy policy = ThrottlePolicy::QUEUE;
+};
+
+// "rate[:burst]"; the burst defaults to the rate and is at least 1.
+bool ParseRateLimit(const std::string& text, RateLimit& limit);
+
+// Refilled lazily from a time the caller already has, so a check is a few
+// arithmetic operations. Starts full.
+class TokenBucket
+{
+    public:
+        bool Take(const RateLimit& limit, int64_t now_us);
+        // Microseconds until Take() can succeed.
+        int64_t GetWait(const RateLimit& limit, int64_t now_us) const;
+    private:
+        double GetTokens(const RateLimit& limit, int64_t now_us) const;
+        double tokens_ = -1;
+        int64_t updated_us_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_RATE_LIMIT_H_
@@ -0,0 +1,42 @@
+#include "rendered_message.h"
+
+#include <cstring>
+
+#include "colors.h"
+
+namespace chatter {
+
+Payload RenderPayload(const std::string& timestamp, const char* color, const std::string& message, bool color_enabled)
+{
+    auto out = std::make_shared<std::string>();
+    if (color_enabled)
+    {
+        out->reserve(timestamp.size() + strlen(color) + message.size() + strlen(chatter::colors::Reset));
+        *out += timestamp;
+        *out += color;
+        *out += message;
+        *out += chatter::colors::Reset;
+    }
+    else
+    {
+        out->reserve(timestamp.size() + message.size());
+        *out += timestamp;
+        *out += message;
+    }
+    return out;
+}
+
+RenderedMessage RenderMessage(const std::string& timestamp, const char* color, const std::string& message,
+    const FrameFields& fields)
+{
+    return {RenderPayload(timestamp, color, message, true), RenderPayload(timestamp, color, message, false),
+        EncodeFrame(fields), 0};
+}
+
+RenderedMessage RenderMessage(const std::string& timestamp, const char* color, const std::string& message)
+{
+    return {RenderPayload(timestamp, color, message, true), RenderPayload(timestamp, color, message, false), nullptr,
+        0};
+}
+
+} // namespace chatter
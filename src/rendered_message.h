@@ -0,0 +1,37 @@
+#ifndef CHATTER_RENDERED_MESSAGE_H_
+#define CHATTER_RENDERED_MESSAGE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "binary_protocol.h"
+
+namespace chatter {
+
+// Immutable wire bytes shared by every send queue that delivers them.
+typedef std::shared_ptr<const std::string> Payload;
+
+// A message rendered once per presentation variant, so fanning it out to a
+// room only copies pointers.
+struct RenderedMessage
+{
+    Payload color;
+    Payload plain;
+    // The same message as a frame, for binary-mode clients.
+    Payload binary;
+    // Set for room messages and unique across the federation, so copies of
+    // one message can be told from two messages that read the same.
+    uint64_t serial = 0;
+    const Payload& For(bool color_enabled) const { return color_enabled ? color : plain; }
+};
+
+Payload RenderPayload(const std::string& timestamp, const char* color, const std::string& message, bool color_enabled);
+RenderedMessage RenderMessage(const std::string& timestamp, const char* color, const std::string& message,
+    const FrameFields& fields);
+// Without the frame, for rooms that no binary-mode client is in.
+RenderedMessage RenderMessage(const std::string& timestamp, const char* color, const std::string& message);
+
+} // namespace chatter
+
+#endif // CHATTER_RENDERED_MESSAGE_H_
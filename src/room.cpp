@@ -1,61 +1,309 @@
 #include "room.h"
 
-#include <ctime>
-
-#include <cstdio>
+#include <algorithm>
 
 #include "colors.h"
+#include "room_logger.h"
 #include "server.h"
 
 namespace chatter {
 
-Room::Room(Server& server, const std::string& room_name, const std::string& password, bool enable_logs)
-    : server_(&server), name_(room_name), password_(password)
+Room::Room(Server& server, const std::string& room_name, const std::string& password, ClientId creator, RoomLogger* logger)
+    : name_(room_name), log_name_(std::make_shared<const std::string>(room_name)), password_(password),
+      creator_(creator), shard_members_(server.GetShardCount()), node_members_(server.GetNodeCount()),
+      logger_(logger), server_(&server), broadcasts_(server.GetStats().TrackRoom(room_name)), history_(server.GetHistoryArena()),
+      compressor_(server.GetCompressionLevel(), server.GetStats()),
+      chat_limit_(server.GetChatLimit(room_name))
+{
+}
+
+Room::~Room()
+{
+    server_->GetStats().UntrackRoom(name_);
+}
+
+void Room::Reset(const std::string& password, ClientId creator)
 {
-    if (enable_logs)
+    password_ = password;
+    creator_ = creator;
+    history_.Clear();
+    history_request_ = NoClient;
+}
+
+void Room::AddMember(const Client& client, bool announce)
+{
+    server_->GetClients().SetRoomIndex(client.slot, static_cast<uint32_t>(local_members_.size()));
+    local_members_.push_back({client.id, client.slot});
+    ++shard_members_[server_->GetShardId()];
+    if (server_->GetClients().Has(client.slot, ClientBinary))
     {
-        time_t now = time(nullptr);
-        tm* utc_time = gmtime(&now);
-        log_file_.open("logs/" + name_ + ".log", std::fstream::app);
-        log_file_ << "Starting new log on " + std::string(asctime(utc_time));
-        log_file_.flush();
+        ++binary_members_;
+    }
+    if (announce)
+    {
+        QueuePresence(PresenceKind::JOINED, client.id, "[" + std::to_string(client.id) + "]" + client.name);
     }
 }
 
-bool Room::AddMember(const Client& client, const std::string& password)
+void Room::RemoveMember(const Client& client)
 {
-    if (password != password_ && password_ != "")
+    ClientTable& clients = server_->GetClients();
+    uint32_t index = clients.GetRoomIndex(client.slot);
+    local_members_[index] = local_members_.back();
+    clients.SetRoomIndex(local_members_[index].slot, index);
+    local_members_.pop_back();
+    --shard_members_[server_->GetShardId()];
+    if (clients.Has(client.slot, ClientBinary))
     {
-        return false;
+        --binary_members_;
     }
-    member_fds_.insert(client.fd);
-    BroadCastMessage(client.fd, chatter::colors::Yellow, "[" + std::to_string(client.fd) +
-        "]" + client.name + " has joined the room!\r\n");
-    return true;
+    QueuePresence(PresenceKind::LEFT, client.id, "[" + std::to_string(client.id) + "]" + client.name);
 }
 
-void Room::RemoveMember(const Client& client)
+void Room::AddRemoteMember(RemoteClient& remote)
+{
+    remote.room = this;
+    remote.room_index = static_cast<uint32_t>(remote_members_.size());
+    remote_members_.push_back(&remote);
+    ++MembersOn(remote.id);
+    if (remote.binary)
+    {
+        ++binary_members_;
+    }
+}
+
+void Room::RemoveRemoteMember(RemoteClient& remote)
+{
+    remote_members_[remote.room_index] = remote_members_.back();
+    remote_members_[remote.room_index]->room_index = remote.room_index;
+    remote_members_.pop_back();
+    remote.room = nullptr;
+    --MembersOn(remote.id);
+    if (remote.binary)
+    {
+        --binary_members_;
+    }
+}
+
+size_t& Room::MembersOn(ClientId remote_id)
+{
+    size_t node = server_->NodeOf(remote_id);
+    return node == server_->GetNodeId() ? shard_members_[server_->ShardOf(remote_id)] : node_members_[node];
+}
+
+void Room::ResolveCreator(ClientId creator, const std::string& password)
 {
-    member_fds_.erase(client.fd);
-    BroadCastMessage(client.fd, chatter::colors::Yellow, "[" + std::to_string(client.fd) +
-        "]" + client.name + " has left the room!\r\n");
+    // Two shards may create the same room concurrently; every replica keeps
+    // the password chosen by the lowest client id so they all converge.
+    if (creator < creator_)
+    {
+        creator_ = creator;
+        password_ = password;
+    }
+}
+
+void Room::BroadCastMessage(ClientId sender_id, const char* color, const std::string& message,
+    const FrameFields& fields)
+{
+    FlushPresence();
+    Publish(sender_id, color, message, fields);
+}
+
+void Room::QueuePresence(PresenceKind kind, ClientId subject, const std::string& text)
+{
+    size_t max_members = server_->GetPresenceMaxMembers();
+    if (max_members != 0 && GetMemberCount() > max_members)
+    {
+        return;
+    }
+    bool scheduled = !presence_.IsEmpty();
+    presence_.Add(kind, subject, text);
+    if (!scheduled)
+    {
+        server_->SchedulePresence(*this);
+    }
+}
+
+void Room::FlushPresence()
+{
+    if (presence_.IsEmpty())
+    {
+        return;
+    }
+    for (const PresenceLine& line : presence_.Take())
+    {
+        std::string text = FrameText(line.text);
+        Publish(line.subject, chatter::colors::Yellow, line.text,
+            {FrameKind::PRESENCE, static_cast<uint8_t>(line.kind), line.subject, {}, name_, text});
+    }
+}
+
+void Room::Publish(ClientId sender_id, const char* color, const std::string& message, const FrameFields& fields)
+{
+    RenderedMessage rendered = binary_members_ != 0 ? RenderMessage(server_->GetTimestamp(), color, message, fields) :
+        RenderMessage(server_->GetTimestamp(), color, message);
+    rendered.serial = server_->NextMessageSerial();
+    ++server_->GetStats().broadcasts;
+    ++*broadcasts_;
+    for (size_t node = 0; node < node_members_.size(); ++node)
+    {
+        if (node != server_->GetNodeId() && node_members_[node] != 0)
+        {
+            ShardMessage forward;
+            forward.type = ShardMessage::Type::BROADCAST;
+            forward.client = sender_id;
+            forward.room = name_;
+            forward.rendered = rendered;
+            server_->PostToNode(node, std::move(forward));
+        }
+    }
+    Relay(sender_id, rendered);
+}
+
+void Room::Relay(ClientId sender_id, const RenderedMessage& rendered)
+{
+    // Every node logs the whole room, whichever node it was said on.
+    if (logger_ != nullptr)
+    {
+        logger_->Log(log_name_, rendered.plain);
+    }
+    for (size_t shard = 0; shard < shard_members_.size(); ++shard)
+    {
+        if (shard != server_->GetShardId() && shard_members_[shard] != 0)
+        {
+            ShardMessage forward;
+            forward.type = ShardMessage::Type::BROADCAST;
+            forward.client = sender_id;
+            forward.room = name_;
+            forward.rendered = rendered;
+            server_->Post(shard, std::move(forward));
+        }
+    }
+    DeliverMessage(sender_id, rendered);
+}
+
+void Room::DeliverMessage(ClientId sender_id, const RenderedMessage& rendered)
+{
+    history_.Push(rendered);
+    uint64_t recipients = 0;
+    for (const LocalMember& member : local_members_)
+    {
+        if (member.id != sender_id)
+        {
+            server_->SendToClient(member.slot, rendered, true, &compressor_);
+            ++recipients;
+        }
+    }
+    server_->GetStats().fanout.Record(recipients);
+}
+
+size_t Room::ReplayHistory(ClientSlot slot, size_t lines)
+{
+    size_t count = std::min(lines, history_.Size());
+    for (size_t i = history_.Size() - count; i < history_.Size(); ++i)
+    {
+        server_->SendToClient(slot, history_.At(i), true);
+    }
+    return count;
+}
+
+void Room::ReplayOnJoin(const Client& client)
+{
+    size_t lines = server_->GetHistoryArena().GetLines();
+    if (lines == 0)
+    {
+        return;
+    }
+    size_t own_shard = server_->GetShardId();
+    if (shard_members_[own_shard] != 0 || IsEmpty())
+    {
+        ReplayHistory(client.slot, lines);
+        return;
+    }
+    // Nothing said since this shard's last member left has reached this
+    // replica, so what it still holds has a gap in it.
+    history_.Clear();
+    history_request_ = client.id;
+    ShardMessage fetch;
+    fetch.type = ShardMessage::Type::FETCH_HISTORY;
+    fetch.client = client.id;
+    fetch.room = name_;
+    size_t shard = GetMemberShard();
+    if (shard != own_shard)
+    {
+        server_->Post(shard, std::move(fetch));
+        return;
+    }
+    for (size_t node = 0; node < node_members_.size(); ++node)
+    {
+        if (node != server_->GetNodeId() && node_members_[node] != 0)
+        {
+            server_->PostToNode(node, std::move(fetch));
+            return;
+        }
+    }
+}
+
+void Room::AcceptHistory(ClientId requester, ClientSlot slot, const std::vector<RenderedMessage>& lines)
+{
+    if (requester != history_request_)
+    {
+        return;
+    }
+    history_request_ = NoClient;
+    // Whatever arrived here since is newer than the fetched lines, but a line
+    // said while the request was on its way may be in both. The text is
+    // compared too, as serials start over when a node hands off.
+    std::vector<RenderedMessage> since;
+    for (size_t i = 0; i < history_.Size(); ++i)
+    {
+        since.push_back(history_.At(i));
+    }
+    std::vector<RenderedMessage> fetched;
+    for (const RenderedMessage& line : lines)
+    {
+        auto same = [&line](const RenderedMessage& kept)
+        {
+            return kept.serial == line.serial && *kept.plain == *line.plain;
+        };
+        if (std::none_of(since.begin(), since.end(), same))
+        {
+            fetched.push_back(line);
+        }
+    }
+    history_.Clear();
+    for (const RenderedMessage& line : fetched)
+    {
+        history_.Push(line);
+    }
+    for (const RenderedMessage& line : since)
+    {
+        history_.Push(line);
+    }
+    if (slot != NoSlot)
+    {
+        for (const RenderedMessage& line : fetched)
+        {
+            server_->SendToClient(slot, line, true);
+        }
+    }
 }
 
-void Room::BroadCastMessage(sock_t sender_fd, const char* color, const std::string& message)
+size_t Room::GetMemberShard() const
 {
-    std::string timestamp = server_->GetTimestamp();
-    if (log_file_.is_open())
+    size_t own_shard = server_->GetShardId();
+    if (shard_members_[own_shard] != 0)
     {
-        log_file_ << timestamp << message;
-        log_file_.flush();
+        return own_shard;
     }
-    for (auto dest_fd : member_fds_)
+    for (size_t shard = 0; shard < shard_members_.size(); ++shard)
     {
-        if (dest_fd != sender_fd)
+        if (shard_members_[shard] != 0)
         {
-            server_->SendToClient(dest_fd, timestamp, color, message);
+            return shard;
         }
     }
+    return own_shard;
 }
 
 } // namespace chatter
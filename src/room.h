@@ -1,11 +1,17 @@
 #ifndef CHATTER_ROOM_H_
 #define CHATTER_ROOM_H_
 
+#include <list>
 #include <string>
-#include <unordered_set>
-#include <fstream>
+#include <vector>
 
 #include "client.h"
+#include "histogram.h"
+#include "history.h"
+#include "mccp.h"
+#include "presence.h"
+#include "rate_limit.h"
+#include "rendered_message.h"
 
 #ifdef _WIN32
     #include <winsock2.h>
@@ -16,22 +22,102 @@
 
 namespace chatter {
 
+class RoomLogger;
 class Server;
 
+// Each shard holds a replica of every room. Members on this shard and on
+// other shards or nodes are kept in separate dense arrays; only local
+// members are fanned out to, and broadcasts are forwarded only to shards and
+// nodes that have members. A node passes a broadcast from a peer on to its
+// own shards. A replica's history is therefore only kept up to date while
+// its shard has members; the first to join fetches it from one that does.
+// Each member records its array index (in the ClientTable or its
+// RemoteClient), so joining and leaving are a push and a swap-remove.
 class Room
 {
     public:
-        Room(Server& server, const std::string& room_name, const std::string& password, bool enable_logs);
-        bool AddMember(const Client& client, const std::string& password = "");
+        struct LocalMember
+        {
+            ClientId id;
+            ClientSlot slot;
+        };
+        Room(Server& server, const std::string& room_name, const std::string& password, ClientId creator, RoomLogger* logger);
+        Room(const Room&) = delete;
+        Room& operator=(const Room&) = delete;
+        ~Room();
+        // Reuses a pooled, empty room as if it had just been created.
+        void Reset(const std::string& password, ClientId creator);
+        // Members restored after a handoff join without a notice.
+        void AddMember(const Client& client, bool announce = true);
         void RemoveMember(const Client& client);
-        void BroadCastMessage(sock_t sender_fd, const char* color, const std::string& message);
-        const std::unordered_set<sock_t>& GetMembers() const { return member_fds_; }
+        void AddRemoteMember(RemoteClient& remote);
+        void RemoveRemoteMember(RemoteClient& remote);
+        void ResolveCreator(ClientId creator, const std::string& password);
+        // Messages are only encoded as frames while binary-mode members are
+        // in the room; a member that switches later is counted here.
+        void AddBinaryMember() { ++binary_members_; }
+        bool CheckPassword(const std::string& password) const { return password == password_ || password_ == ""; }
+        // Sends any pending presence digest first, so notices stay in order.
+        void BroadCastMessage(ClientId sender_id, const char* color, const std::string& message,
+            const FrameFields& fields);
+        // Join/leave/rename notices wait for the server's presence window and
+        // go out as one digest; rooms above the member limit get none.
+        void QueuePresence(PresenceKind kind, ClientId subject, const std::string& text);
+        void FlushPresence();
+        // Logs a broadcast, forwards it to the node's other shards and
+        // delivers it here.
+        void Relay(ClientId sender_id, const RenderedMessage& rendered);
+        void DeliverMessage(ClientId sender_id, const RenderedMessage& rendered);
+        // Queues up to `lines` of the most recent messages to the client;
+        // returns how many were sent.
+        size_t ReplayHistory(ClientSlot slot, size_t lines);
+        // Replays the history to a client about to join. If no member was on
+        // this shard to receive what was said, it is fetched from a shard or
+        // node that has members and replayed once it arrives.
+        void ReplayOnJoin(const Client& client);
+        // Puts fetched history in front of what arrived here since it was
+        // asked for and replays it to `slot`, unless a later join asked again.
+        void AcceptHistory(ClientId requester, ClientSlot slot, const std::vector<RenderedMessage>& lines);
+        // A shard of this node with members here, preferring this one.
+        size_t GetMemberShard() const;
+        const RoomHistory& GetHistory() const { return history_; }
+        void ClearHistory() { history_.Clear(); }
+        void ResetCompression() { compressor_.Reset(); }
+        const std::string& GetName() const { return name_; }
+        const std::string& GetPassword() const { return password_; }
+        ClientId GetCreator() const { return creator_; }
+        const RateLimit& GetChatLimit() const { return chat_limit_; }
+        const std::vector<LocalMember>& GetLocalMembers() const { return local_members_; }
+        const std::vector<RemoteClient*>& GetRemoteMembers() const { return remote_members_; }
+        size_t GetMemberCount() const { return local_members_.size() + remote_members_.size(); }
+        bool IsEmpty() const { return GetMemberCount() == 0; }
+        // Position in the server's pool of empty rooms while pooled.
+        bool IsIdle() const { return idle_; }
+        void SetIdle(std::list<Room*>::iterator entry) { idle_ = true; idle_entry_ = entry; }
+        std::list<Room*>::iterator ClearIdle() { idle_ = false; return idle_entry_; }
     private:
+        void Publish(ClientId sender_id, const char* color, const std::string& message, const FrameFields& fields);
+        size_t& MembersOn(ClientId remote_id);
         std::string name_;
+        // Shared with the logger's queue, which would otherwise copy it.
+        std::shared_ptr<const std::string> log_name_;
         std::string password_;
-        std::unordered_set<sock_t> member_fds_;
-        std::ofstream log_file_;
+        ClientId creator_;
+        std::vector<LocalMember> local_members_;
+        std::vector<RemoteClient*> remote_members_;
+        std::vector<size_t> shard_members_;
+        std::vector<size_t> node_members_;
+        size_t binary_members_ = 0;
+        bool idle_ = false;
+        std::list<Room*>::iterator idle_entry_;
+        RoomLogger* logger_;
         Server* server_;
+        RelaxedCounter* broadcasts_;
+        RoomHistory history_;
+        ClientId history_request_ = NoClient;
+        RoomCompressor compressor_;
+        PresenceDigest presence_;
+        RateLimit chat_limit_;
 };
 
 } // namespace chatter
@@ -0,0 +1,246 @@
+#include "room_logger.h"
+
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+#include <chrono>
+#include <filesystem>
+
+#include "time_util.h"
+
+namespace chatter {
+
+namespace {
+
+// Flush early once this much is pending so a burst can't grow without bound.
+constexpr size_t MaxPendingBytes = 1 << 20;
+// Log() wakes the logger before the flush interval once the queue is this
+// full (as a fraction of its capacity), so bursts aren't dropped.
+constexpr size_t WakeFraction = 4;
+
+std::string FormatTime(time_t t, const char* format)
+{
+    tm utc_time = UtcTime(t);
+    char buffer[32];
+    strftime(buffer, sizeof buffer, format, &utc_time);
+    return buffer;
+}
+
+} // namespace
+
+RoomLogger::RoomLogger(const LoggerOptions& options)
+    : options_(options), queue_(options.queue_capacity)
+{
+    std::error_code error;
+    std::filesystem::create_directories(options_.directory, error);
+    thread_ = std::thread(&RoomLogger::Run, this);
+}
+
+RoomLogger::~RoomLogger()
+{
+    if (thread_.joinable())
+    {
+        Stop();
+    }
+}
+
+void RoomLogger::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        running_.store(false, std::memory_order_relaxed);
+    }
+    wake_.notify_one();
+    thread_.join();
+    for (auto& [_, log] : files_)
+    {
+        if (log.file != nullptr)
+        {
+            fclose(log.file);
+        }
+    }
+    files_.clear();
+    segments_.clear();
+}
+
+void RoomLogger::Start()
+{
+    running_.store(true, std::memory_order_relaxed);
+    thread_ = std::thread(&RoomLogger::Run, this);
+}
+
+bool RoomLogger::Log(RoomName room_name, Payload line)
+{
+    if (!queue_.TryPush({std::move(room_name), std::move(line)}))
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (queue_.Size() >= options_.queue_capacity / WakeFraction &&
+        !wake_requested_.exchange(true, std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_.notify_one();
+    }
+    return true;
+}
+
+void RoomLogger::Run()
+{
+    auto interval = std::chrono::milliseconds(options_.flush_interval_ms);
+    auto next_flush = std::chrono::steady_clock::now() + interval;
+    size_t pending = 0;
+    while (running_.load(std::memory_order_relaxed))
+    {
+        wake_requested_.store(false, std::memory_order_relaxed);
+        pending += Drain();
+        auto now = std::chrono::steady_clock::now();
+        if (now >= next_flush || pending >= MaxPendingBytes)
+        {
+            Flush();
+            pending = 0;
+            next_flush = now + interval;
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait_until(lock, next_flush, [this]
+            {
+                return !running_.load(std::memory_order_relaxed) || wake_requested_.load(std::memory_order_relaxed);
+            });
+        }
+    }
+    // Drain() stops at MaxPendingBytes, so keep going until the queue is empty.
+    while (Drain() != 0)
+    {
+        Flush();
+    }
+    Flush();
+}
+
+size_t RoomLogger::Drain()
+{
+    size_t bytes = 0;
+    Entry entry;
+    // Store times are taken once per batch, so they trail the message by at
+    // most one pass of the loop in Run().
+    int64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    while (queue_.TryPop(entry))
+    {
+        bytes += entry.line->size();
+        if (options_.format == LogFormat::STORE)
+        {
+            std::unique_ptr<SegmentWriter>& writer = segments_[*entry.room_name];
+            if (writer == nullptr)
+            {
+                writer = std::make_unique<SegmentWriter>(GetStoreDirectory(*entry.room_name),
+                    options_.rotate_bytes, options_.rotate_seconds);
+            }
+            writer->Append(time_us, *entry.line);
+        }
+        else
+        {
+            files_[*entry.room_name].pending += *entry.line;
+        }
+        entry.room_name.reset();
+        entry.line.reset();
+        if (bytes >= MaxPendingBytes)
+        {
+            break;
+        }
+    }
+    return bytes;
+}
+
+std::string RoomLogger::GetStoreDirectory(const std::string& room_name) const
+{
+    return options_.format == LogFormat::STORE ? options_.directory + "/" + room_name : std::string();
+}
+
+void RoomLogger::Flush()
+{
+    for (auto& [_, writer] : segments_)
+    {
+        written_.fetch_add(writer->Flush(options_.fsync), std::memory_order_relaxed);
+    }
+    time_t now = time(nullptr);
+    for (auto& [room_name, log] : files_)
+    {
+        if (log.pending.empty())
+        {
+            continue;
+        }
+        RotateIfNeeded(room_name, log, now);
+        if (log.file == nullptr)
+        {
+            log.pending.clear();
+            continue;
+        }
+        // The stream is unbuffered, so this is a single write() per room.
+        fwrite(log.pending.data(), 1, log.pending.size(), log.file);
+#ifndef _WIN32
+        if (options_.fsync)
+        {
+            fsync(fileno(log.file));
+        }
+#endif
+        log.bytes += log.pending.size();
+        written_.fetch_add(log.pending.size(), std::memory_order_relaxed);
+        log.pending.clear();
+    }
+    uint64_t dropped = GetDropped();
+    if (dropped != reported_dropped_)
+    {
+        fprintf(stderr, "Room logger queue full, %llu lines dropped so far.\r\n",
+            static_cast<unsigned long long>(dropped));
+        reported_dropped_ = dropped;
+    }
+}
+
+void RoomLogger::Open(const std::string& room_name, LogFile& log)
+{
+    std::string path = options_.directory + "/" + room_name + ".log";
+    log.file = fopen(path.c_str(), "ab");
+    if (log.file == nullptr)
+    {
+        perror(path.c_str());
+        return;
+    }
+    setvbuf(log.file, nullptr, _IONBF, 0);
+    std::error_code error;
+    auto size = std::filesystem::file_size(path, error);
+    log.bytes = error ? 0 : static_cast<size_t>(size);
+    log.opened = time(nullptr);
+    std::string header = "Starting new log on " + FormatTime(log.opened, "%a %b %d %H:%M:%S %Y\n");
+    log.pending.insert(0, header);
+}
+
+void RoomLogger::RotateIfNeeded(const std::string& room_name, LogFile& log, time_t now)
+{
+    if (log.file != nullptr)
+    {
+        bool too_big = options_.rotate_bytes != 0 && log.bytes + log.pending.size() > options_.rotate_bytes;
+        bool too_old = options_.rotate_seconds != 0 && now - log.opened >= options_.rotate_seconds;
+        if (!too_big && !too_old)
+        {
+            return;
+        }
+        fclose(log.file);
+        log.file = nullptr;
+        std::string path = options_.directory + "/" + room_name;
+        std::string rotated = path + "." + FormatTime(now, "%Y%m%d-%H%M%S");
+        // Rotating twice within a second must not overwrite the first one.
+        std::string target = rotated + ".log";
+        std::error_code error;
+        for (int sequence = 1; std::filesystem::exists(target, error); ++sequence)
+        {
+            target = rotated + "." + std::to_string(sequence) + ".log";
+        }
+        std::filesystem::rename(path + ".log", target, error);
+    }
+    Open(room_name, log);
+}
+
+} // namespace chatter
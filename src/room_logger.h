@@ -0,0 +1,98 @@
+#ifndef CHATTER_ROOM_LOGGER_H_
+#define CHATTER_ROOM_LOGGER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "bounded_queue.h"
+#include "message_store.h"
+#include "rendered_message.h"
+
+namespace chatter {
+
+enum class LogFormat
+{
+    TEXT,
+    STORE,
+};
+
+struct LoggerOptions
+{
+    std::string directory = "logs";
+    LogFormat format = LogFormat::TEXT;
+    int flush_interval_ms = 200;
+    bool fsync = false;
+    size_t rotate_bytes = 64 << 20;
+    long rotate_seconds = 0;
+    size_t queue_capacity = 1 << 16;
+};
+
+// Each room keeps its name in one of these, so logging a line never copies it.
+typedef std::shared_ptr<const std::string> RoomName;
+
+// Writes logs/<room>.log, or the segments of the indexed store in
+// logs/<room>/, from a background thread. Reactor threads only push pointers
+// to the room's name and the already rendered line onto a lock-free queue;
+// the logger batches lines from every room and issues one write per file per
+// flush interval, sleeping in between unless the queue fills up. When the
+// queue is full the line is dropped and counted rather than stalling the
+// event loop.
+class RoomLogger
+{
+    public:
+        explicit RoomLogger(const LoggerOptions& options);
+        ~RoomLogger();
+        RoomLogger(const RoomLogger&) = delete;
+        RoomLogger& operator=(const RoomLogger&) = delete;
+        bool Log(RoomName room_name, Payload line);
+        // Writes out everything queued and closes the files, so another
+        // process can take them over; Start() picks up where Stop() left off.
+        void Stop();
+        void Start();
+        uint64_t GetDropped() const { return dropped_.load(std::memory_order_relaxed); }
+        uint64_t GetWritten() const { return written_.load(std::memory_order_relaxed); }
+        const LoggerOptions& GetOptions() const { return options_; }
+        // Empty unless the logger writes the indexed store.
+        std::string GetStoreDirectory(const std::string& room_name) const;
+    private:
+        struct Entry
+        {
+            RoomName room_name;
+            Payload line;
+        };
+        struct LogFile
+        {
+            FILE* file = nullptr;
+            size_t bytes = 0;
+            time_t opened = 0;
+            std::string pending;
+        };
+        void Run();
+        size_t Drain();
+        void Flush();
+        void Open(const std::string& room_name, LogFile& log);
+        void RotateIfNeeded(const std::string& room_name, LogFile& log, time_t now);
+        LoggerOptions options_;
+        BoundedQueue<Entry> queue_;
+        std::atomic<bool> running_{true};
+        std::mutex wake_mutex_;
+        std::condition_variable wake_;
+        std::atomic<bool> wake_requested_{false};
+        std::atomic<uint64_t> dropped_{0};
+        std::atomic<uint64_t> written_{0};
+        uint64_t reported_dropped_ = 0;
+        std::unordered_map<std::string, LogFile> files_;
+        std::unordered_map<std::string, std::unique_ptr<SegmentWriter>> segments_;
+        std::thread thread_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_ROOM_LOGGER_H_
@@ -2,6 +2,7 @@
 
 #ifndef _WIN32
     #include <arpa/inet.h>
+    #include <netinet/tcp.h>
     #include <sys/ioctl.h>
     #include <netdb.h>
     #include <netinet/in.h>
@@ -9,6 +10,10 @@
     constexpr int INVALID_SOCKET = -1;
 #endif
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -16,11 +21,46 @@
 #include <stdexcept>
 
 #include "colors.h"
+#include "shard_group.h"
+#include "telnet.h"
+#include "time_util.h"
 
 namespace chatter {
 
-Server::Server(const char* port, bool enable_logs)
-    : message_buffer_(chatter::MaxDataSize), command_handler_(*this), logs_enabled_(enable_logs)
+namespace {
+
+bool WouldBlock()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+} // namespace
+
+Server::Server(const Config& config, ShardGroup& group, size_t shard_id, const ShardState* inherited)
+    : group_(&group), shard_id_(shard_id), shard_count_(group.GetShardCount()), node_id_(config.node_id),
+      node_count_(config.nodes.empty() ? 1 : config.nodes.size()), logs_enabled_(config.enable_logs),
+      outbound_limits_(config.outbound_limits), cork_output_(config.cork_output),
+      max_line_length_(config.max_line_length), compression_level_(config.compression_level),
+      stats_(&group.GetStats(shard_id)),
+      history_arena_(config.history_lines, config.history_bytes),
+      presence_window_(config.presence_window_ms), presence_max_members_(config.presence_max_members),
+      rate_limits_(config.rate_limits), read_budget_(config.read_budget),
+      idle_timeout_ms_(config.idle_timeout_s * int64_t{1000}), keepalive_ms_(config.keepalive_s * int64_t{1000}),
+      handshake_timeout_ms_(config.handshake_timeout_s * int64_t{1000}),
+      timers_(TimerTickMs, std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count()),
+      // Telnet IAC NOP: ignored by clients, but a dead peer never acks it.
+      keepalive_probe_(std::make_shared<const std::string>("\xff\xf1")),
+      // Telnet IAC WILL COMPRESS2.
+      compression_offer_(std::make_shared<const std::string>("\xff\xfb\x56")),
+      event_loop_(config.make_event_loop ? config.make_event_loop() : MakeEventLoop(config.backend)),
+      admin_port_(config.admin_port), nodes_(config.nodes), handoff_path_(config.handoff_path),
+      handoff_ack_ms_(config.handoff_ack_ms), handoff_listen_fd_(INVALID_SOCKET), handoff_fd_(INVALID_SOCKET),
+      clients_(shard_id * node_count_ + node_id_, group.GetShardCount() * node_count_), command_handler_(*this)
 {
     srand(static_cast<unsigned int>(time(nullptr)));
 #ifdef _WIN32
@@ -30,32 +70,74 @@ Server::Server(const char* port, bool enable_logs)
         exit(EXIT_FAILURE);
     }
 #endif
-    MakeConnection(port);
+    for (size_t* limit : {&read_budget_.bytes, &read_budget_.lines, &read_budget_.tick_lines})
+    {
+        if (*limit == 0)
+        {
+            *limit = SIZE_MAX;
+        }
+    }
+    completion_io_ = event_loop_->GetCompletionIo();
+    if (inherited != nullptr)
+    {
+        server_fd_ = inherited->listener;
+        WatchListener();
+    }
+    else
+    {
+        MakeConnection(config.port.c_str(), config.backlog);
+    }
+    if (shard_count_ > 1)
+    {
+        event_loop_->Add(group_->GetMailbox(shard_id_).GetFd(), EventRead);
+    }
+    StartEndpoints();
+    if (shard_id_ == 0 && !handoff_path_.empty())
+    {
+        handoff_listen_fd_ = ListenForHandoff(handoff_path_);
+        event_loop_->Add(handoff_listen_fd_, EventRead);
+    }
+    if (inherited != nullptr)
+    {
+        RestoreState(*inherited);
+    }
 }
 
-std::string Server::GetClientAddr(sock_t client_fd) const
+void Server::StartEndpoints()
 {
-    char addr_buffer[INET6_ADDRSTRLEN];
-    sockaddr_storage client_addr;
-    socklen_t addr_size = sizeof client_addr;
-    getpeername(client_fd, reinterpret_cast<sockaddr*>(&client_addr), &addr_size);
+    if (shard_id_ == 0 && !admin_port_.empty())
+    {
+        admin_ = std::make_unique<AdminEndpoint>(*event_loop_, admin_port_,
+            [this]() { return group_->GetPrometheusStats(); });
+    }
+    if (shard_id_ == 0 && node_count_ > 1)
+    {
+        federation_ = std::make_unique<Federation>(*event_loop_, nodes_, node_id_, *stats_, Federation::Handlers{
+            [this](size_t node) { SendDirectory(node); },
+            [this](size_t node) { DropNode(node); },
+            [this](size_t, ShardMessage& message) { HandlePeerMessage(message); }});
+    }
+}
 
+std::string Server::GetClientAddr(const sockaddr_storage& client_addr) const
+{
+    char addr_buffer[INET6_ADDRSTRLEN];
     inet_ntop(client_addr.ss_family,
-        GetInAddr(reinterpret_cast<sockaddr*>(&client_addr)),
+        GetInAddr(reinterpret_cast<const sockaddr*>(&client_addr)),
         addr_buffer, sizeof addr_buffer);
     return std::string(addr_buffer);
 }
 
-void* Server::GetInAddr(sockaddr* sa) const
+const void* Server::GetInAddr(const sockaddr* sa) const
 {
     if (sa->sa_family == AF_INET)
     {
-        return &((reinterpret_cast<sockaddr_in*>(sa))->sin_addr);
+        return &((reinterpret_cast<const sockaddr_in*>(sa))->sin_addr);
     }
-    return &((reinterpret_cast<sockaddr_in6*>(sa))->sin6_addr);
+    return &((reinterpret_cast<const sockaddr_in6*>(sa))->sin6_addr);
 };
 
-void Server::MakeConnection(const char* port)
+void Server::MakeConnection(const char* port, int backlog)
 {
     addrinfo hints;
     addrinfo* servinfo;
@@ -86,6 +168,14 @@ void Server::MakeConnection(const char* port)
             perror("setsockopt");
             exit(EXIT_FAILURE);
         }
+#ifdef SO_REUSEPORT
+        if (shard_count_ > 1 &&
+            setsockopt(server_fd_, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char*>(&yes), sizeof(int)) == -1)
+        {
+            perror("setsockopt: SO_REUSEPORT");
+            exit(EXIT_FAILURE);
+        }
+#endif
         if (bind(server_fd_, p->ai_addr, static_cast<int>(p->ai_addrlen)) == -1)
         {
             close(server_fd_);
@@ -103,192 +193,1821 @@ void Server::MakeConnection(const char* port)
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd_, chatter::Backlog) == -1)
+    if (listen(server_fd_, backlog) == -1)
     {
         perror("chatter-server: listen");
         exit(EXIT_FAILURE);
     }
+    // Non-blocking so AcceptClients() can drain the queue until EAGAIN.
+    unsigned long int nonblocking = 1;
+    ioctl(server_fd_, FIONBIO, &nonblocking);
+    WatchListener();
+}
 
-    client_pfds_.push_back({server_fd_, POLLIN, 0});
+void Server::WatchListener()
+{
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->Accept(server_fd_);
+    }
+    else
+    {
+        event_loop_->Add(server_fd_, EventRead);
+    }
 }
 
-void Server::ConnectClient()
+void Server::AcceptClients()
 {
-    sockaddr_storage client_addr;
-    socklen_t addr_size = sizeof client_addr;
-    sock_t client_fd = accept(server_fd_, reinterpret_cast<sockaddr*>(&client_addr), &addr_size);
-    if (client_fd == INVALID_SOCKET)
+    while (true)
     {
-        perror("chatter-server: accept");
+        AcceptedClient accepted;
+        socklen_t addr_size = sizeof accepted.addr;
+        sockaddr* addr = reinterpret_cast<sockaddr*>(&accepted.addr);
+        ++stats_->syscalls;
+#ifdef SOCK_NONBLOCK
+        sock_t client_fd = accept4(server_fd_, addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        sock_t client_fd = accept(server_fd_, addr, &addr_size);
+        if (client_fd != INVALID_SOCKET)
+        {
+            unsigned long int yes = 1;
+            ioctl(client_fd, FIONBIO, &yes);
+        }
+#endif
+        if (client_fd == INVALID_SOCKET)
+        {
+            if (WouldBlock())
+            {
+                return;
+            }
+#ifndef _WIN32
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+#endif
+            // Typically out of descriptors; the rest wait for the next wakeup.
+            perror("chatter-server: accept");
+            return;
+        }
+        AddAccepted(client_fd, accepted);
+    }
+}
+
+void Server::AddAccepted(sock_t client_fd, AcceptedClient& accepted)
+{
+    accepted.slot = clients_.Insert(client_fd);
+    if (accepted.slot == NoSlot)
+    {
+        fprintf(stderr, "chatter-server: client table full\r\n");
+        close(client_fd);
+        return;
+    }
+    accepted_.push_back(accepted);
+}
+
+void Server::SetUpAccepted()
+{
+    for (const AcceptedClient& accepted : accepted_)
+    {
+        ConnectClient(accepted);
+    }
+    accepted_.clear();
+}
+
+void Server::ConnectClient(const AcceptedClient& accepted)
+{
+    ClientSlot slot = accepted.slot;
+    sock_t client_fd = clients_.Fd(slot);
+    Client& client = clients_.Info(slot);
+    client.addr = GetClientAddr(accepted.addr);
+    client.input = LineBuffer(max_line_length_);
+    client.connected_ms = client.last_input_ms = client.last_probe_ms = GetNowMs();
+    ArmClientTimer(client);
+#ifdef TCP_USER_TIMEOUT
+    if (keepalive_ms_ != 0)
+    {
+        // Unacknowledged output, keepalive probes included, fails the
+        // connection after two intervals instead of the kernel's minutes.
+        unsigned int user_timeout = static_cast<unsigned int>(keepalive_ms_ * 2);
+        ++stats_->syscalls;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof user_timeout);
+    }
+#endif
+    QueuePresence(PresenceKind::CONNECTED, client.id, "[" + std::to_string(client.id) + "]" + client.name);
+    ShardMessage connect;
+    connect.type = ShardMessage::Type::CONNECT;
+    connect.client = client.id;
+    connect.name = client.name;
+    PostToCluster(connect);
+    ++stats_->connections;
+    ++stats_->clients;
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->Receive(client_fd, client.id);
     }
     else
     {
-        unsigned long int yes = 1;
-        ioctl(client_fd, FIONBIO, &yes);
-        Client client;
-        client.fd = client_fd;
-        client.addr = GetClientAddr(client_fd);
-        SendToAllClients(GetTimestamp(), "[" + std::to_string(client.fd) +
-            "]" + client.name + " has connected!\r\n");
-        clients_.emplace(client_fd, client);
-        client_pfds_.push_back({client_fd, POLLIN, 0});
-        SendToClient(client_fd, "", chatter::colors::None, "Welcome! You are #" + std::to_string(client.fd) + ".\r\n");
-        std::string logging_notification = "Logging is ";
-        logging_notification += logs_enabled_ ? "enabled" : "disabled";
-        SendToClient(client_fd, "", chatter::colors::None, logging_notification + ".\r\n");
-        AddClientToRoom(clients_.at(client.fd), "global", "");
-        printf("New connection from %s on socket %d\r\n", client.addr.c_str(), static_cast<int>(client_fd));
+        event_loop_->Add(client_fd, EventRead, true);
+    }
+    if (compression_level_ != 0)
+    {
+        QueueRaw(slot, compression_offer_, false);
     }
+    SendToClient(slot, "", chatter::colors::None, "Welcome! You are #" + std::to_string(client.id) + ".\r\n");
+    std::string logging_notification = "Logging is ";
+    logging_notification += logs_enabled_ ? "enabled" : "disabled";
+    SendToClient(slot, "", chatter::colors::None, logging_notification + ".\r\n");
+    AddClientToRoom(client, "global", "");
+    printf("New connection from %s on socket %d\r\n", client.addr.c_str(), static_cast<int>(client_fd));
 }
 
-void Server::DisconnectClient(sock_t client_fd, size_t index)
+void Server::DisconnectClient(ClientSlot slot)
 {
-    Client client = clients_.at(client_fd);
+    sock_t client_fd = clients_.Fd(slot);
+    LeaveRoom(clients_.Info(slot), *clients_.GetRoom(slot));
+    Client client = std::move(clients_.Info(slot));
+    timers_.Cancel(slot);
+    clients_.Erase(slot);
+    stats_->clients -= 1;
     printf("Disconnected %s from socket %d\r\n", client.addr.c_str(), static_cast<int>(client_fd));
-    close(client_fd);
-    rooms_.at(client.room_name).RemoveMember(client);
-    if (rooms_.at(client.room_name).GetMembers().empty())
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->Close(client_fd);
+    }
+    else
     {
-        rooms_.erase(client.room_name);
+        event_loop_->Remove(client_fd);
+        ++stats_->syscalls;
+        close(client_fd);
     }
-    client_pfds_.erase(client_pfds_.begin() + index);
-    clients_.erase(client_fd);
-    SendToAllClients(GetTimestamp(), "[" + std::to_string(client.fd) +
-        "]" + client.name + " has disconnected!\r\n");
+    ShardMessage disconnect;
+    disconnect.type = ShardMessage::Type::DISCONNECT;
+    disconnect.client = client.id;
+    PostToCluster(disconnect);
+    QueuePresence(PresenceKind::DISCONNECTED, client.id, "[" + std::to_string(client.id) + "]" + client.name);
 }
 
 void Server::AddClientToRoom(Client& client, const std::string& room_name, const std::string& password)
 {
-    std::string old_room_name = client.room_name;
-    if (old_room_name != room_name)
+    Room* old_room = clients_.GetRoom(client.slot);
+    if (old_room != nullptr && old_room->GetName() == room_name)
+    {
+        return;
+    }
+    bool created;
+    Room& room = AcquireRoom(room_name, password, client.id, created);
+    if (!room.CheckPassword(password))
+    {
+        SendToClient(client.slot, "", chatter::colors::Red, "Incorrect password!\r\n");
+        return;
+    }
+    ShardMessage join;
+    join.type = ShardMessage::Type::JOIN;
+    join.client = client.id;
+    join.room = room_name;
+    join.password = password;
+    join.created = created;
+    PostToCluster(join);
+    // Leave first: the client's room index is only valid for one room.
+    if (old_room != nullptr)
+    {
+        SendToClient(client.slot, "", chatter::colors::None, "Leaving room: " + old_room->GetName() + "\r\n");
+        LeaveRoom(client, *old_room);
+    }
+    SendToClient(client.slot, "", chatter::colors::None, "Joined room: " + room_name + "\r\n");
+    // Replay before joining so the client's own join notice isn't in it.
+    room.ReplayOnJoin(client);
+    room.AddMember(client);
+    clients_.SetRoom(client.slot, &room);
+}
+
+void Server::LeaveRoom(const Client& client, Room& room)
+{
+    room.RemoveMember(client);
+    ReleaseRoomIfEmpty(room);
+}
+
+void Server::RemoveRemoteFromRoom(RemoteClient& remote)
+{
+    if (Room* room = remote.room)
+    {
+        room->RemoveRemoteMember(remote);
+        ReleaseRoomIfEmpty(*room);
+    }
+}
+
+Room& Server::AcquireRoom(const std::string& room_name, const std::string& password, ClientId creator, bool& created)
+{
+    auto [room, inserted] = rooms_.try_emplace(room_name, *this, room_name, password, creator, group_->GetLogger());
+    created = inserted;
+    if (room->second.IsIdle())
+    {
+        idle_rooms_.erase(room->second.ClearIdle());
+        room->second.Reset(password, creator);
+        created = true;
+    }
+    return room->second;
+}
+
+Room* Server::FindRoom(const std::string& room_name)
+{
+    auto room = rooms_.find(room_name);
+    return room != rooms_.end() && !room->second.IsIdle() ? &room->second : nullptr;
+}
+
+void Server::ReleaseRoomIfEmpty(Room& room)
+{
+    // Empty rooms are pooled rather than destroyed, so rooms people keep
+    // leaving and rejoining are not rebuilt each time.
+    if (!room.IsEmpty())
+    {
+        return;
+    }
+    // Nobody is left to see it, but the log should still get the last leave.
+    room.FlushPresence();
+    room.ClearHistory();
+    room.ResetCompression();
+    room.SetIdle(idle_rooms_.insert(idle_rooms_.end(), &room));
+    if (idle_rooms_.size() > MaxIdleRooms)
+    {
+        Room* oldest = idle_rooms_.front();
+        idle_rooms_.pop_front();
+        rooms_.erase(rooms_.find(oldest->GetName()));
+    }
+}
+
+RemoteClient& Server::GetRemoteClient(ClientId client_id)
+{
+    RemoteClient& remote = remote_clients_[client_id];
+    remote.id = client_id;
+    return remote;
+}
+
+void Server::SendToClient(ClientSlot slot, const std::string& timestamp, const char* color, const std::string& message,
+    bool droppable)
+{
+    if (clients_.Has(slot, ClientClosing | ClientDraining))
+    {
+        return;
+    }
+    if (clients_.Has(slot, ClientBinary))
+    {
+        std::string text = FrameText(message);
+        FrameFields fields;
+        fields.kind = FrameKind::REPLY;
+        fields.text = text;
+        QueueToClient(slot, EncodeFrame(fields), droppable);
+        return;
+    }
+    QueueToClient(slot, RenderPayload(timestamp, color, message, clients_.Has(slot, ClientColor)), droppable);
+}
+
+void Server::SendToClient(ClientSlot slot, const std::string& timestamp, const char* color, const std::string& message,
+    const FrameFields& fields)
+{
+    if (clients_.Has(slot, ClientClosing | ClientDraining))
+    {
+        return;
+    }
+    QueueToClient(slot, clients_.Has(slot, ClientBinary) ? EncodeFrame(fields) :
+        RenderPayload(timestamp, color, message, clients_.Has(slot, ClientColor)), false);
+}
+
+void Server::SendToClient(ClientSlot slot, const RenderedMessage& rendered, bool droppable,
+    RoomCompressor* compressor)
+{
+    if (clients_.Has(slot, ClientClosing | ClientDraining))
+    {
+        return;
+    }
+    bool binary = clients_.Has(slot, ClientBinary);
+    if (binary && rendered.binary == nullptr)
+    {
+        // Said while the room had no binary member, e.g. replayed history,
+        // or before word of this client's switch reached where it was said.
+        std::string text = FrameText(*rendered.plain);
+        QueueToClient(slot, EncodeFrame({FrameKind::NOTICE, 0, NoClient, {}, {}, text}), droppable);
+        return;
+    }
+    bool color = clients_.Has(slot, ClientColor);
+    const Payload& payload = binary ? rendered.binary : rendered.For(color);
+    if (compressor != nullptr && clients_.Has(slot, ClientCompressed))
+    {
+        Payload compressed = compressor->Take(payload, binary ? 2 : color ? 0 : 1, clients_.Compression(slot));
+        stats_->compress_in += payload->size();
+        stats_->compress_out += compressed->size();
+        // A compressed stream can't skip what was already compressed
+        // against, so nothing to this client is droppable.
+        QueueRaw(slot, std::move(compressed), false);
+        return;
+    }
+    QueueToClient(slot, payload, droppable);
+}
+
+void Server::QueueToClient(ClientSlot slot, Payload payload, bool droppable)
+{
+    if (clients_.Has(slot, ClientCompressed))
+    {
+        CompressionState& state = clients_.Compression(slot);
+        state.adler = CombineChecksums(state.adler, Checksum(*payload), payload->size());
+        state.last_chunk = 0;
+        Payload stored = StoreUncompressed(payload);
+        stats_->compress_in += payload->size();
+        stats_->compress_out += stored->size();
+        QueueRaw(slot, std::move(stored), false);
+        return;
+    }
+    QueueRaw(slot, std::move(payload), droppable);
+}
+
+void Server::QueueRaw(ClientSlot slot, Payload payload, bool droppable)
+{
+    OutboundQueue& outbound = clients_.Queue(slot);
+    size_t dropped = outbound.GetDropped();
+    bool keep = outbound.Push(std::move(payload), droppable, outbound_limits_);
+    ++stats_->messages_out;
+    stats_->dropped_sends += outbound.GetDropped() - dropped;
+    stats_->queue_depth.Record(outbound.GetMessages());
+    if (!keep)
+    {
+        printf("Evicting slow consumer %s on socket %d\r\n", clients_.Info(slot).addr.c_str(),
+            static_cast<int>(clients_.Fd(slot)));
+        ++stats_->evictions;
+        MarkForDisconnect(slot);
+        return;
+    }
+    // Everything queued during this tick goes out together in FlushScheduled().
+    if (!clients_.Has(slot, ClientWriteArmed | ClientFlushScheduled))
+    {
+        clients_.Set(slot, ClientFlushScheduled);
+        pending_flushes_.push_back(slot);
+    }
+}
+
+void Server::SendToAllClients(const std::string& timestamp, const std::string& message)
+{
+    std::string text = FrameText(message);
+    FrameFields fields;
+    fields.text = text;
+    SendToAllClients(RenderMessage(timestamp, chatter::colors::None, message, fields));
+}
+
+void Server::SendToAllClients(const RenderedMessage& rendered, ClientSlot except)
+{
+    for (ClientSlot slot = 0; slot < clients_.End(); ++slot)
+    {
+        if (slot != except && clients_.InUse(slot))
+        {
+            SendToClient(slot, rendered);
+        }
+    }
+}
+
+void Server::FlushClient(ClientSlot slot)
+{
+    OutboundQueue& outbound = clients_.Queue(slot);
+    sock_t fd = clients_.Fd(slot);
+    if (completion_io_ != nullptr)
     {
-        // TODO: try_emplace should made this check unnecessary, but doesn't? Constructor is always called.
-        if (rooms_.find(room_name) == rooms_.end())
+        // The flag marks a send in flight; SendCompleted() sends the rest.
+        if (!clients_.Has(slot, ClientWriteArmed) && !outbound.Empty())
+        {
+            clients_.Set(slot, ClientWriteArmed);
+            completion_io_->Send(fd, clients_.Info(slot).id, outbound);
+            ++stats_->write_calls;
+        }
+        else if (!clients_.Has(slot, ClientWriteArmed) && clients_.Has(slot, ClientDraining))
         {
-            rooms_.emplace(room_name, Room(*this, room_name, password, logs_enabled_));
+            MarkForDisconnect(slot);
         }
-        if (rooms_.at(room_name).AddMember(client, password))
+        return;
+    }
+    uint64_t written = outbound.GetWritten();
+    uint64_t write_calls = outbound.GetWriteCalls();
+    OutboundQueue::FlushResult result = outbound.Flush(fd, cork_output_);
+    stats_->bytes_out += outbound.GetWritten() - written;
+    stats_->write_calls += outbound.GetWriteCalls() - write_calls;
+    stats_->syscalls += outbound.GetWriteCalls() - write_calls;
+    switch (result)
+    {
+        case OutboundQueue::FlushResult::DONE:
         {
-            if (old_room_name != "")
+            if (clients_.Has(slot, ClientDraining))
             {
-                SendToClient(client.fd, "", chatter::colors::None, "Leaving room: " + old_room_name + "\r\n");
-                rooms_.at(old_room_name).RemoveMember(client);
-                if (rooms_.at(old_room_name).GetMembers().empty())
-                {
-                    rooms_.erase(old_room_name);
-                }
+                MarkForDisconnect(slot);
             }
-            client.room_name = room_name;
-            SendToClient(client.fd, "", chatter::colors::None, "Joined room: " + room_name + "\r\n");
+            else if (clients_.Has(slot, ClientWriteArmed))
+            {
+                clients_.Clear(slot, ClientWriteArmed);
+                event_loop_->Modify(fd, GetInterest(slot), true);
+            }
+            break;
         }
-        else
+        case OutboundQueue::FlushResult::PENDING:
+        {
+            if (!clients_.Has(slot, ClientWriteArmed))
+            {
+                clients_.Set(slot, ClientWriteArmed);
+                event_loop_->Modify(fd, GetInterest(slot), true);
+            }
+            break;
+        }
+        case OutboundQueue::FlushResult::ERROR:
         {
-            SendToClient(client.fd, "", chatter::colors::Red, "Incorrect password!\r\n");
+            MarkForDisconnect(slot);
+            break;
         }
-        
     }
 }
 
-void Server::SendToClient(sock_t client_fd, const std::string& timestamp, const char* color, const std::string& message) const
+void Server::FlushScheduled()
 {
-    std::string out = timestamp;
-    const Client& client = clients_.at(client_fd);
-    if (client.color)
-    {
-        out += color;
-    }
-    out += message;
-    if (client.color)
+    for (ClientSlot slot : pending_flushes_)
     {
-        out += chatter::colors::Reset;
+        // A slot freed and reused this tick has the flag only if its new
+        // client also queued output.
+        if (clients_.Has(slot, ClientFlushScheduled))
+        {
+            clients_.Clear(slot, ClientFlushScheduled);
+            if (!clients_.Has(slot, ClientClosing | ClientWriteArmed))
+            {
+                FlushClient(slot);
+            }
+        }
     }
-    if (send(client.fd, out.c_str(), static_cast<int>(out.size()), 0) == -1)
+    pending_flushes_.clear();
+}
+
+void Server::MarkForDisconnect(ClientSlot slot)
+{
+    // Disconnecting mutates rooms and the client table, which callers may be
+    // iterating, so it is deferred to the end of the current PollClients().
+    if (!clients_.Has(slot, ClientClosing))
     {
-        perror("send");
+        clients_.Set(slot, ClientClosing);
+        pending_disconnects_.push_back(clients_.Info(slot).id);
     }
 }
 
-void Server::SendToAllClients(const std::string& timestamp, const std::string& message) const
+void Server::DisconnectPending()
 {
-    for (auto& [_, client] : clients_)
+    // DisconnectClient() can mark more clients while announcing, so index.
+    for (size_t i = 0; i < pending_disconnects_.size(); ++i)
     {
-        SendToClient(client.fd, timestamp, chatter::colors::None, message);
+        ClientSlot slot = clients_.FindId(pending_disconnects_[i]);
+        if (slot != NoSlot && clients_.Has(slot, ClientClosing))
+        {
+            DisconnectClient(slot);
+        }
     }
+    pending_disconnects_.clear();
 }
 
 void Server::PollClients()
 {
-    int poll_count = poll(&client_pfds_[0], static_cast<nfds_t>(client_pfds_.size()), -1);
-    if (poll_count == -1)
+    if (event_loop_->Wait(ready_events_, GetWaitTimeout()) == -1)
     {
         perror("poll");
         exit(EXIT_FAILURE);
     }
+    auto start = std::chrono::steady_clock::now();
+    now_us_ = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+    ++tick_;
+    tick_lines_ = 0;
+    ServeDeferred();
+
+    for (const Event& event : ready_events_)
+    {
+        if (event.fd == server_fd_)
+        {
+            AcceptClients();
+            continue;
+        }
+        if (event.fd == handoff_listen_fd_)
+        {
+            AcceptHandoff();
+            continue;
+        }
+        if (shard_count_ > 1 && event.fd == group_->GetMailbox(shard_id_).GetFd())
+        {
+            HandleShardMessages();
+            continue;
+        }
+        if (admin_ && admin_->Owns(event.fd))
+        {
+            admin_->Handle(event.fd);
+            continue;
+        }
+        if (federation_ && federation_->Owns(event.fd))
+        {
+            federation_->Handle(event);
+            continue;
+        }
+        ClientSlot slot = clients_.FindFd(event.fd);
+        if (slot == NoSlot || clients_.Has(slot, ClientClosing))
+        {
+            continue; // disconnected earlier in this batch
+        }
+        if ((event.events & (EventHangup | EventError)) && clients_.Has(slot, ClientDraining))
+        {
+            // Nobody is left to send the reason to.
+            MarkForDisconnect(slot);
+            continue;
+        }
+        if (event.events & EventWrite)
+        {
+            FlushClient(slot);
+        }
+        if (event.events & (EventRead | EventHangup | EventError))
+        {
+            ReceiveMessages(clients_.Info(slot));
+        }
+    }
+    if (completion_io_ != nullptr)
+    {
+        HandleCompletions();
+    }
+    ResumeThrottled();
+    SetUpAccepted();
+    ExpireTimers();
+    if (presence_armed_ && std::chrono::steady_clock::now() >= presence_deadline_)
+    {
+        FlushPresence();
+    }
+    // Disconnect notices queue more output and failed flushes disconnect more
+    // clients, so settle both before the next wait.
+    while (!pending_disconnects_.empty() || !pending_flushes_.empty())
+    {
+        DisconnectPending();
+        FlushScheduled();
+    }
+    if (federation_)
+    {
+        federation_->Reconnect(GetNowMs());
+        federation_->Flush();
+    }
+    uint64_t loop_syscalls = event_loop_->GetSyscalls();
+    stats_->syscalls += loop_syscalls - loop_syscalls_;
+    loop_syscalls_ = loop_syscalls;
+    stats_->poll_us.Record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count()));
+    if (handoff_requested_)
+    {
+        ParkForHandoff();
+    }
+}
+
+void Server::ReceiveMessages(Client& client)
+{
+    // A throttled client's socket is left unread until its lines are let
+    // through, so TCP pushes back on the sender. A deferred one waits for
+    // its turn, and a draining one is only waiting to be closed.
+    if (clients_.Has(client.slot, ClientThrottled | ClientDeferred | ClientDraining) || !HandleLines(client))
+    {
+        return;
+    }
+    // Edge-triggered sockets only report new data once, so read until EAGAIN.
+    sock_t fd = clients_.Fd(client.slot);
+    while (true)
+    {
+        if (!HasReadBudget(client))
+        {
+            Defer(client);
+            return;
+        }
+        long nbytes = client.input.Fill(fd);
+        ++stats_->syscalls;
+        if (nbytes == 0 || (nbytes == -1 && !WouldBlock()))
+        {
+            DisconnectClient(client.slot);
+            return;
+        }
+        if (nbytes == -1)
+        {
+            return;
+        }
+        stats_->bytes_in += static_cast<uint64_t>(nbytes);
+        client.read_bytes += static_cast<size_t>(nbytes);
+        client.last_input_ms = GetNowMs();
+        if (!HandleLines(client))
+        {
+            return;
+        }
+    }
+}
 
-    for (size_t i = 0; i < client_pfds_.size();)
+void Server::HandleCompletions()
+{
+    for (const Completion& completion : completion_io_->GetCompletions())
     {
-        if (client_pfds_[i].revents & POLLIN)
+        switch (completion.type)
         {
-            if (client_pfds_[i].fd == server_fd_)
+            case Completion::Type::ACCEPT:
             {
-                ConnectClient();
+                AcceptCompleted(completion);
+                break;
             }
-            else
+            case Completion::Type::RECEIVE:
             {
-                Client& client = clients_.at(client_pfds_[i].fd);
-                std::string message;
-                if (ReceiveMessage(client.fd, message) == 0)
-                {
-                    DisconnectClient(client.fd, i);
-                    continue;
-                }
-                else if (message[0] > 31)
-                {
-                    if (message[0] != '/')
-                    {
-                        message.insert(0, "[" + std::to_string(client.fd) + "]" + client.name + " : ");
-                        rooms_.at(client.room_name).BroadCastMessage(server_fd_, chatter::colors::Cyan, message);
-                    }
-                    else
-                    {
-                        message = message.substr(1, std::string::npos);
-                        command_handler_.ParseCommand(client, message);
-                    }
-                }
+                ReceiveCompleted(completion);
+                break;
+            }
+            case Completion::Type::SEND:
+            {
+                SendCompleted(completion);
+                break;
             }
         }
-        ++i;
     }
 }
 
-int Server::ReceiveMessage(sock_t client_fd, std::string& message)
+void Server::AcceptCompleted(const Completion& completion)
 {
-    int nbytes;
-    memset(&message_buffer_[0], 0, chatter::MaxDataSize);
-    while ((nbytes = recv(client_fd, &message_buffer_[0], static_cast<int>(message_buffer_.size()), 0)) != -1)
+    if (!completion.more && !handing_off_)
     {
-        if (nbytes == 0)
-        {
-            break;
-        }
-        message.append(message_buffer_.cbegin(), message_buffer_.cend());
-        memset(&message_buffer_[0], 0, chatter::MaxDataSize);
+        completion_io_->Accept(server_fd_);
     }
-    message = message.c_str(); // trim null chars
-    if (message.find("\r\n", message.size() - 2) == std::string::npos)
+    if (completion.result == -ECANCELED)
     {
-        message += "\r\n";
+        return;
+    }
+    if (completion.result < 0)
+    {
+        // Typically out of descriptors; accepting resumes with the next batch.
+        errno = -completion.result;
+        perror("chatter-server: accept");
+        return;
+    }
+    sock_t client_fd = completion.result;
+    AcceptedClient accepted{};
+    ++stats_->syscalls;
+    if (!completion_io_->GetPeerAddress(client_fd, accepted.addr))
+    {
+        // Reset before it was accepted.
+        completion_io_->Close(client_fd);
+        return;
     }
-    return nbytes;
+    AddAccepted(client_fd, accepted);
 }
 
-std::string Server::GetTimestamp() const
+void Server::ReceiveCompleted(const Completion& completion)
 {
-    time_t now = time(nullptr);
-    tm* utc_time = gmtime(&now);
-    char buffer[11];
-    strftime(buffer, 11, "[%H:%M:%S]", utc_time);
-    return std::string(buffer);
+    ClientSlot slot = clients_.FindId(completion.tag);
+    if (slot == NoSlot || clients_.Has(slot, ClientClosing | ClientDraining))
+    {
+        return; // disconnected earlier, or about to be
+    }
+    Client& client = clients_.Info(slot);
+    if (completion.result > 0)
+    {
+        size_t size = static_cast<size_t>(completion.result);
+        stats_->bytes_in += size;
+        client.last_input_ms = GetNowMs();
+        if (clients_.Has(slot, ClientThrottled | ClientDeferred) || handing_off_)
+        {
+            client.backlog.append(completion.data, size);
+        }
+        else
+        {
+            ReceiveData(client, completion.data, size);
+        }
+    }
+    // Out of buffers ends the recv; cancelling it means the client was
+    // throttled or is gone.
+    else if (completion.result != -ENOBUFS && completion.result != -ECANCELED)
+    {
+        DisconnectClient(slot);
+        return;
+    }
+    if (!completion.more && completion.result != -ECANCELED && !handing_off_ &&
+        !clients_.Has(slot, ClientThrottled | ClientDeferred | ClientClosing))
+    {
+        completion_io_->Receive(clients_.Fd(slot), client.id);
+    }
+}
+
+void Server::SendCompleted(const Completion& completion)
+{
+    ClientSlot slot = clients_.FindId(completion.tag);
+    if (slot == NoSlot)
+    {
+        return;
+    }
+    clients_.Clear(slot, ClientWriteArmed);
+    if (completion.result == -ECANCELED)
+    {
+        // Stopped for a handoff; nothing was sent.
+        clients_.Queue(slot).Complete(0);
+        return;
+    }
+    if (completion.result < 0)
+    {
+        MarkForDisconnect(slot);
+        return;
+    }
+    clients_.Queue(slot).Complete(static_cast<size_t>(completion.result));
+    stats_->bytes_out += static_cast<uint64_t>(completion.result);
+    if (!clients_.Has(slot, ClientClosing) && !handing_off_)
+    {
+        FlushClient(slot);
+    }
+}
+
+void Server::ReceiveData(Client& client, const char* data, size_t size)
+{
+    while (size > 0 && !clients_.Has(client.slot, ClientClosing | ClientDraining))
+    {
+        size_t copied = client.input.Append(data, size);
+        data += copied;
+        size -= copied;
+        if (!HandleLines(client))
+        {
+            // Throttled or deferred; the rest waits for ResumeInput().
+            client.backlog.append(data, size);
+            return;
+        }
+    }
+}
+
+void Server::ResumeInput(Client& client)
+{
+    if (!HandleLines(client))
+    {
+        return;
+    }
+    std::string backlog;
+    backlog.swap(client.backlog);
+    ReceiveData(client, backlog.data(), backlog.size());
+    if (clients_.Has(client.slot, ClientThrottled | ClientDeferred | ClientClosing | ClientDraining))
+    {
+        return;
+    }
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->Receive(clients_.Fd(client.slot), client.id);
+    }
+    else
+    {
+        ReceiveMessages(client);
+    }
+}
+
+bool Server::HandleLines(Client& client)
+{
+    std::string_view line;
+    while (!clients_.Has(client.slot, ClientClosing | ClientDraining))
+    {
+        if (!HasReadBudget(client))
+        {
+            Defer(client);
+            return false;
+        }
+        bool binary = clients_.Has(client.slot, ClientBinary);
+        if (!(binary ? client.input.NextFrame(line) : client.input.NextLine(line)))
+        {
+            if (client.input.IsBad())
+            {
+                printf("Bad frame from %s on socket %d\r\n", client.addr.c_str(),
+                    static_cast<int>(clients_.Fd(client.slot)));
+                MarkForDisconnect(client.slot);
+                return false;
+            }
+            break;
+        }
+        if (!client.handshake_done && line == BinaryHello)
+        {
+            client.handshake_done = true;
+            SwitchToBinary(client);
+            continue;
+        }
+        client.handshake_done = true;
+        if (!(binary ? HandleFrame(client, line) : HandleLine(client, line)))
+        {
+            client.input.Unread();
+            return false;
+        }
+        ++client.read_lines;
+        ++tick_lines_;
+    }
+    return true;
+}
+
+bool Server::HandleLine(Client& client, std::string_view line)
+{
+    if (!line.empty() && static_cast<unsigned char>(line[0]) == telnet::Iac)
+    {
+        HandleTelnet(client.slot, line);
+        return true;
+    }
+    if (line.empty() || line[0] <= 31)
+    {
+        return true;
+    }
+    bool chat = line[0] != '/';
+    return HandleInput(client, chat, chat ? line : line.substr(1));
+}
+
+void Server::HandleTelnet(ClientSlot slot, std::string_view command)
+{
+    // Only the answer to our IAC WILL COMPRESS2 matters; everything else
+    // is refused by not answering.
+    if (compression_level_ == 0 || command.size() != 3 ||
+        static_cast<unsigned char>(command[2]) != telnet::Compress2)
+    {
+        return;
+    }
+    unsigned char verb = static_cast<unsigned char>(command[1]);
+    if (verb == telnet::Do && !clients_.Has(slot, ClientCompressed))
+    {
+        QueueRaw(slot, std::make_shared<const std::string>(StartCompression()), false);
+        clients_.Set(slot, ClientCompressed);
+        clients_.Compression(slot) = CompressionState();
+    }
+    else if (verb == telnet::Dont && clients_.Has(slot, ClientCompressed))
+    {
+        QueueRaw(slot, std::make_shared<const std::string>(EndCompression(clients_.Compression(slot).adler)), false);
+        clients_.Clear(slot, ClientCompressed);
+    }
+}
+
+bool Server::HandleFrame(Client& client, std::string_view body)
+{
+    InputKind kind;
+    std::string_view text;
+    if (!DecodeInput(body, kind, text))
+    {
+        printf("Bad frame from %s on socket %d\r\n", client.addr.c_str(), static_cast<int>(clients_.Fd(client.slot)));
+        MarkForDisconnect(client.slot);
+        return true;
+    }
+    // Text clients would see a line break as the end of the line.
+    if (text.empty() || text.size() > max_line_length_ || text.find_first_of("\r\n") != std::string_view::npos)
+    {
+        return true;
+    }
+    return HandleInput(client, kind == InputKind::CHAT, text);
+}
+
+void Server::SwitchToBinary(Client& client)
+{
+    clients_.Set(client.slot, ClientBinary);
+    std::string hello(BinaryHello);
+    hello += "\r\n";
+    QueueToClient(client.slot, std::make_shared<const std::string>(std::move(hello)), false);
+    Room& room = GetRoom(client);
+    room.AddBinaryMember();
+    QueueToClient(client.slot, EncodeFrame({FrameKind::HELLO, 0, client.id, client.name, room.GetName(), {}}), false);
+    ShardMessage binary;
+    binary.type = ShardMessage::Type::BINARY;
+    binary.client = client.id;
+    PostToCluster(binary);
+}
+
+bool Server::HandleInput(Client& client, bool chat, std::string_view text)
+{
+    if (chat || command_handler_.IsExpensive(text))
+    {
+        const RateLimit& limit = chat ? GetRoom(client).GetChatLimit() : rate_limits_.command;
+        TokenBucket& bucket = chat ? client.chat_bucket : client.command_bucket;
+        if (!bucket.Take(limit, now_us_))
+        {
+            ++stats_->throttled;
+            return Throttle(client, bucket.GetWait(limit, now_us_));
+        }
+        client.throttle_noticed = false;
+    }
+    ++stats_->lines_in;
+    if (chat)
+    {
+        std::string message = "[" + std::to_string(client.id) + "]" + client.name + " : ";
+        message.append(text);
+        message += "\r\n";
+        Room& room = GetRoom(client);
+        room.BroadCastMessage(NoClient, chatter::colors::Cyan, message,
+            {FrameKind::CHAT, 0, client.id, client.name, room.GetName(), text});
+    }
+    else
+    {
+        command_handler_.ParseCommand(client, text);
+    }
+    return true;
+}
+
+bool Server::Throttle(Client& client, int64_t wait_us)
+{
+    switch (rate_limits_.policy)
+    {
+        case ThrottlePolicy::QUEUE:
+        {
+            clients_.Set(client.slot, ClientThrottled);
+            throttled_.push_back({client.id, now_us_ + wait_us});
+            if (completion_io_ != nullptr)
+            {
+                completion_io_->CancelReceive(client.id);
+            }
+            if (!event_loop_->IsEdgeTriggered())
+            {
+                event_loop_->Modify(clients_.Fd(client.slot), GetInterest(client.slot), true);
+            }
+            return false;
+        }
+        case ThrottlePolicy::NOTICE:
+        {
+            if (!client.throttle_noticed)
+            {
+                client.throttle_noticed = true;
+                SendToClient(client.slot, "", chatter::colors::Red,
+                    "You are sending too fast; some lines were dropped.\r\n");
+            }
+            return true;
+        }
+        case ThrottlePolicy::DROP:
+        {
+            return true;
+        }
+    }
+    return true;
+}
+
+void Server::ResumeThrottled()
+{
+    if (throttled_.empty())
+    {
+        return;
+    }
+    resuming_.swap(throttled_);
+    for (const ThrottledClient& throttled : resuming_)
+    {
+        ClientSlot slot = clients_.FindId(throttled.id);
+        if (slot == NoSlot || clients_.Has(slot, ClientClosing))
+        {
+            continue;
+        }
+        if (throttled.resume_us > now_us_)
+        {
+            throttled_.push_back(throttled);
+            continue;
+        }
+        clients_.Clear(slot, ClientThrottled);
+        if (!event_loop_->IsEdgeTriggered())
+        {
+            event_loop_->Modify(clients_.Fd(slot), GetInterest(slot), true);
+        }
+        ResumeInput(clients_.Info(slot));
+    }
+    resuming_.clear();
+}
+
+bool Server::HasReadBudget(Client& client)
+{
+    if (client.read_tick != tick_)
+    {
+        client.read_tick = tick_;
+        client.read_bytes = 0;
+        client.read_lines = 0;
+    }
+    return client.read_bytes < read_budget_.bytes && client.read_lines < read_budget_.lines &&
+        tick_lines_ < read_budget_.tick_lines;
+}
+
+void Server::Defer(Client& client)
+{
+    if (clients_.Has(client.slot, ClientDeferred))
+    {
+        return;
+    }
+    clients_.Set(client.slot, ClientDeferred);
+    deferred_.push_back(client.id);
+    ++stats_->deferred;
+    if (completion_io_ != nullptr)
+    {
+        // Stop receiving until the backlog is handled, as when throttled.
+        completion_io_->CancelReceive(client.id);
+    }
+}
+
+void Server::ServeDeferred()
+{
+    if (deferred_.empty())
+    {
+        return;
+    }
+    // Anyone still over budget is deferred again, behind the others.
+    serving_.swap(deferred_);
+    for (ClientId id : serving_)
+    {
+        ClientSlot slot = clients_.FindId(id);
+        if (slot == NoSlot || clients_.Has(slot, ClientClosing))
+        {
+            continue;
+        }
+        clients_.Clear(slot, ClientDeferred);
+        ResumeInput(clients_.Info(slot));
+    }
+    serving_.clear();
+}
+
+unsigned Server::GetInterest(ClientSlot slot) const
+{
+    // Edge-triggered loops keep read interest while throttled or draining;
+    // the events are ignored and input is read when the client is resumed.
+    unsigned events = clients_.Has(slot, ClientWriteArmed) ? EventWrite : 0u;
+    if (!clients_.Has(slot, ClientThrottled | ClientDraining) || event_loop_->IsEdgeTriggered())
+    {
+        events |= EventRead;
+    }
+    return events;
+}
+
+void Server::ArmClientTimer(const Client& client)
+{
+    int64_t deadline = INT64_MAX;
+    if (handshake_timeout_ms_ != 0 && !client.handshake_done)
+    {
+        deadline = std::min(deadline, client.connected_ms + handshake_timeout_ms_);
+    }
+    if (idle_timeout_ms_ != 0)
+    {
+        deadline = std::min(deadline, client.last_input_ms + idle_timeout_ms_);
+    }
+    if (keepalive_ms_ != 0)
+    {
+        deadline = std::min(deadline, std::max(client.last_input_ms, client.last_probe_ms) + keepalive_ms_);
+    }
+    if (deadline != INT64_MAX)
+    {
+        timers_.Arm(client.slot, deadline);
+    }
+}
+
+void Server::ExpireTimers()
+{
+    int64_t now = GetNowMs();
+    timers_.Advance(now, expired_timers_);
+    for (uint32_t slot : expired_timers_)
+    {
+        if (!clients_.InUse(slot) || clients_.Has(slot, ClientClosing))
+        {
+            continue;
+        }
+        if (clients_.Has(slot, ClientDraining))
+        {
+            // Its last output never left.
+            MarkForDisconnect(slot);
+            continue;
+        }
+        Client& client = clients_.Info(slot);
+        if (handshake_timeout_ms_ != 0 && !client.handshake_done && now >= client.connected_ms + handshake_timeout_ms_)
+        {
+            TimeOut(slot, "Timed out waiting for input.\r\n");
+            continue;
+        }
+        if (idle_timeout_ms_ != 0 && now >= client.last_input_ms + idle_timeout_ms_)
+        {
+            TimeOut(slot, "Disconnected for being idle.\r\n");
+            continue;
+        }
+        if (keepalive_ms_ != 0 && now >= std::max(client.last_input_ms, client.last_probe_ms) + keepalive_ms_)
+        {
+            // Binary clients would read the telnet NOP as a frame length.
+            QueueToClient(slot, clients_.Has(slot, ClientBinary) ?
+                EncodeFrame({FrameKind::PING, 0, NoClient, {}, {}, {}}) : keepalive_probe_, true);
+            client.last_probe_ms = now;
+        }
+        ArmClientTimer(client);
+    }
+    expired_timers_.clear();
+}
+
+void Server::TimeOut(ClientSlot slot, const std::string& reason)
+{
+    // The client is closed once the reason has been sent, which with
+    // completion I/O is only known when the send completes.
+    SendToClient(slot, "", chatter::colors::Red, reason);
+    clients_.Set(slot, ClientDraining);
+    ++stats_->timeouts;
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->CancelReceive(clients_.Info(slot).id);
+    }
+    if (!event_loop_->IsEdgeTriggered())
+    {
+        event_loop_->Modify(clients_.Fd(slot), GetInterest(slot), true);
+    }
+    if (!clients_.Has(slot, ClientWriteArmed | ClientFlushScheduled))
+    {
+        FlushClient(slot);
+    }
+    timers_.Arm(slot, GetNowMs() + DrainTimeoutMs);
+}
+
+const RateLimit& Server::GetChatLimit(const std::string& room_name) const
+{
+    auto room = rate_limits_.rooms.find(room_name);
+    return room != rate_limits_.rooms.end() ? room->second : rate_limits_.chat;
+}
+
+std::string Server::GetTimestamp() const
+{
+    tm utc_time = UtcTime(time(nullptr));
+    char buffer[11];
+    strftime(buffer, 11, "[%H:%M:%S]", &utc_time);
+    return std::string(buffer);
+}
+
+const Client* Server::FindLocalClient(ClientId client_id) const
+{
+    ClientSlot slot = clients_.FindId(client_id);
+    return slot != NoSlot ? &clients_.Info(slot) : nullptr;
+}
+
+std::string Server::GetClientName(ClientId client_id) const
+{
+    if (const Client* client = FindLocalClient(client_id))
+    {
+        return client->name;
+    }
+    auto remote = remote_clients_.find(client_id);
+    return remote != remote_clients_.end() ? remote->second.name : "";
+}
+
+void Server::Announce(const std::string& message, const FrameFields& fields, ClientSlot except)
+{
+    RenderedMessage rendered = RenderMessage(GetTimestamp(), chatter::colors::None, message, fields);
+    SendToAllClients(rendered, except);
+    ShardMessage announce;
+    announce.type = ShardMessage::Type::ANNOUNCE;
+    announce.rendered = rendered;
+    PostToCluster(announce);
+}
+
+void Server::QueuePresence(PresenceKind kind, ClientId subject, const std::string& text)
+{
+    bool scheduled = !presence_.IsEmpty();
+    presence_.Add(kind, subject, text);
+    if (presence_window_.count() == 0)
+    {
+        FlushPresence();
+    }
+    else if (!scheduled)
+    {
+        ArmPresenceTimer();
+    }
+}
+
+void Server::SchedulePresence(Room& room)
+{
+    if (presence_window_.count() == 0)
+    {
+        room.FlushPresence();
+        return;
+    }
+    presence_rooms_.push_back(room.GetName());
+    ArmPresenceTimer();
+}
+
+void Server::ArmPresenceTimer()
+{
+    if (!presence_armed_)
+    {
+        presence_armed_ = true;
+        presence_deadline_ = std::chrono::steady_clock::now() + presence_window_;
+    }
+}
+
+int Server::GetWaitTimeout() const
+{
+    if (!deferred_.empty())
+    {
+        return 0;
+    }
+    auto now = std::chrono::steady_clock::now();
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    int timeout = timers_.GetTimeout(now_ms);
+    if (federation_)
+    {
+        int redial = federation_->GetTimeout(now_ms);
+        timeout = timeout == -1 || (redial != -1 && redial < timeout) ? redial : timeout;
+    }
+    if (!presence_armed_ && throttled_.empty())
+    {
+        return timeout;
+    }
+    auto deadline = presence_armed_ ? presence_deadline_ : std::chrono::steady_clock::time_point::max();
+    for (const ThrottledClient& throttled : throttled_)
+    {
+        deadline = std::min(deadline, std::chrono::steady_clock::time_point(std::chrono::microseconds(throttled.resume_us)));
+    }
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+    int deadline_timeout = remaining.count() > 0 ? static_cast<int>(remaining.count()) : 0;
+    return timeout == -1 ? deadline_timeout : std::min(timeout, deadline_timeout);
+}
+
+void Server::FlushPresence()
+{
+    presence_armed_ = false;
+    for (const PresenceLine& line : presence_.Take())
+    {
+        std::string text = FrameText(line.text);
+        Announce(line.text, {FrameKind::PRESENCE, static_cast<uint8_t>(line.kind), line.subject, {}, {}, text},
+            line.subject != NoClient ? clients_.FindId(line.subject) : NoSlot);
+    }
+    // Rooms that broadcast since, or went idle, have already flushed.
+    for (const std::string& room_name : presence_rooms_)
+    {
+        if (Room* room = FindRoom(room_name))
+        {
+            room->FlushPresence();
+        }
+    }
+    presence_rooms_.clear();
+}
+
+void Server::PublishRename(const Client& client)
+{
+    ShardMessage rename;
+    rename.type = ShardMessage::Type::RENAME;
+    rename.client = client.id;
+    rename.name = client.name;
+    PostToCluster(rename);
+}
+
+void Server::Post(size_t shard, ShardMessage message)
+{
+    group_->Post(shard, std::move(message));
+}
+
+void Server::PostToOtherShards(const ShardMessage& message)
+{
+    for (size_t shard = 0; shard < shard_count_; ++shard)
+    {
+        if (shard != shard_id_)
+        {
+            group_->Post(shard, message);
+        }
+    }
+}
+
+void Server::PostToCluster(const ShardMessage& message)
+{
+    PostToOtherShards(message);
+    if (federation_)
+    {
+        federation_->SendToAll(message);
+    }
+}
+
+void Server::PostToNode(size_t node, ShardMessage message)
+{
+    if (federation_)
+    {
+        federation_->Send(node, message);
+        return;
+    }
+    message.relay = node;
+    Post(0, std::move(message));
+}
+
+void Server::HandleShardMessages()
+{
+    group_->GetMailbox(shard_id_).Drain(shard_messages_);
+    for (ShardMessage& message : shard_messages_)
+    {
+        if (federation_)
+        {
+            // Only this node's shards post here, so their directory changes
+            // and announcements are passed on to every peer.
+            if (message.relay != NoNode)
+            {
+                federation_->Send(message.relay, message);
+                continue;
+            }
+            if (message.type != ShardMessage::Type::BROADCAST && message.type != ShardMessage::Type::TELL)
+            {
+                federation_->SendToAll(message);
+            }
+        }
+        HandleShardMessage(message);
+    }
+}
+
+void Server::HandleShardMessage(ShardMessage& message)
+{
+    switch (message.type)
+    {
+        case ShardMessage::Type::CONNECT:
+        {
+            GetRemoteClient(message.client).name = message.name;
+            break;
+        }
+        case ShardMessage::Type::DISCONNECT:
+        {
+            auto remote = remote_clients_.find(message.client);
+            if (remote != remote_clients_.end())
+            {
+                RemoveRemoteFromRoom(remote->second);
+                remote_clients_.erase(remote);
+            }
+            break;
+        }
+        case ShardMessage::Type::RENAME:
+        {
+            GetRemoteClient(message.client).name = message.name;
+            break;
+        }
+        case ShardMessage::Type::JOIN:
+        {
+            RemoteClient& remote = GetRemoteClient(message.client);
+            RemoveRemoteFromRoom(remote);
+            bool created;
+            Room& room = AcquireRoom(message.room, message.password, message.client, created);
+            if (!created && message.created)
+            {
+                room.ResolveCreator(message.client, message.password);
+            }
+            room.AddRemoteMember(remote);
+            break;
+        }
+        case ShardMessage::Type::BROADCAST:
+        {
+            if (Room* room = FindRoom(message.room))
+            {
+                room->DeliverMessage(message.client, message.rendered);
+            }
+            break;
+        }
+        case ShardMessage::Type::TELL:
+        {
+            if (const Client* dest = FindLocalClient(message.target))
+            {
+                SendToClient(dest->slot, message.rendered);
+            }
+            break;
+        }
+        case ShardMessage::Type::ANNOUNCE:
+        {
+            SendToAllClients(message.rendered);
+            break;
+        }
+        case ShardMessage::Type::FETCH_HISTORY:
+        {
+            ShardMessage reply;
+            reply.type = ShardMessage::Type::HISTORY;
+            reply.target = message.client;
+            reply.room = message.room;
+            if (Room* room = FindRoom(message.room))
+            {
+                // The newest lines that fit well within one peer frame.
+                const RoomHistory& history = room->GetHistory();
+                size_t first = history.Size();
+                size_t bytes = 0;
+                while (first != 0 && bytes < MaxPeerFrameBytes / 2)
+                {
+                    const RenderedMessage& line = history.At(--first);
+                    bytes += line.color->size() + line.plain->size() + (line.binary ? line.binary->size() : 0);
+                }
+                for (size_t i = first; i < history.Size(); ++i)
+                {
+                    reply.history.push_back(history.At(i));
+                }
+            }
+            size_t node = NodeOf(message.client);
+            if (node != node_id_)
+            {
+                PostToNode(node, std::move(reply));
+            }
+            else
+            {
+                Post(ShardOf(message.client), std::move(reply));
+            }
+            break;
+        }
+        case ShardMessage::Type::HISTORY:
+        {
+            if (Room* room = FindRoom(message.room))
+            {
+                const Client* dest = FindLocalClient(message.target);
+                bool member = dest != nullptr && clients_.GetRoom(dest->slot) == room;
+                room->AcceptHistory(message.target, member ? dest->slot : NoSlot, message.history);
+            }
+            break;
+        }
+        case ShardMessage::Type::BINARY:
+        {
+            RemoteClient& remote = GetRemoteClient(message.client);
+            if (!remote.binary)
+            {
+                remote.binary = true;
+                if (remote.room != nullptr)
+                {
+                    remote.room->AddBinaryMember();
+                }
+            }
+            break;
+        }
+        case ShardMessage::Type::HANDOFF:
+        {
+            handoff_requested_ = true;
+            break;
+        }
+    }
+}
+
+void Server::HandlePeerMessage(ShardMessage& message)
+{
+    // Each message crosses a link once; shard 0 fans it out to this node.
+    switch (message.type)
+    {
+        case ShardMessage::Type::BROADCAST:
+        {
+            if (Room* room = FindRoom(message.room))
+            {
+                room->Relay(message.client, message.rendered);
+            }
+            break;
+        }
+        case ShardMessage::Type::TELL:
+        case ShardMessage::Type::HISTORY:
+        {
+            size_t shard = ShardOf(message.target);
+            if (shard != shard_id_)
+            {
+                Post(shard, std::move(message));
+            }
+            else
+            {
+                HandleShardMessage(message);
+            }
+            break;
+        }
+        case ShardMessage::Type::FETCH_HISTORY:
+        {
+            // Answered by a shard that has members, whose history is current.
+            Room* room = FindRoom(message.room);
+            size_t shard = room != nullptr ? room->GetMemberShard() : shard_id_;
+            if (shard != shard_id_)
+            {
+                Post(shard, std::move(message));
+            }
+            else
+            {
+                HandleShardMessage(message);
+            }
+            break;
+        }
+        default:
+        {
+            PostToOtherShards(message);
+            HandleShardMessage(message);
+            break;
+        }
+    }
+}
+
+void Server::SendDirectory(size_t node)
+{
+    // Clients of other shards are taken from this shard's replica. Anything
+    // they change meanwhile is still in the mailbox and follows the snapshot.
+    auto send = [this, node](ClientId id, const std::string& name, const Room* room, bool binary)
+    {
+        ShardMessage connect;
+        connect.type = ShardMessage::Type::CONNECT;
+        connect.client = id;
+        connect.name = name;
+        federation_->Send(node, connect);
+        if (room != nullptr)
+        {
+            ShardMessage join;
+            join.type = ShardMessage::Type::JOIN;
+            join.client = id;
+            join.room = room->GetName();
+            join.password = room->GetPassword();
+            federation_->Send(node, join);
+        }
+        if (binary)
+        {
+            ShardMessage switched;
+            switched.type = ShardMessage::Type::BINARY;
+            switched.client = id;
+            federation_->Send(node, switched);
+        }
+    };
+    for (ClientSlot slot = 0; slot < clients_.End(); ++slot)
+    {
+        // Clients accepted in this batch are announced once they are set up.
+        if (clients_.InUse(slot) && clients_.GetRoom(slot) != nullptr)
+        {
+            send(clients_.Info(slot).id, clients_.Info(slot).name, clients_.GetRoom(slot),
+                clients_.Has(slot, ClientBinary));
+        }
+    }
+    for (const auto& [id, remote] : remote_clients_)
+    {
+        if (NodeOf(id) == node_id_)
+        {
+            send(id, remote.name, remote.room, remote.binary);
+        }
+    }
+}
+
+void Server::DropNode(size_t node)
+{
+    std::vector<ClientId> lost;
+    for (const auto& [id, remote] : remote_clients_)
+    {
+        if (NodeOf(id) == node)
+        {
+            lost.push_back(id);
+        }
+    }
+    for (ClientId id : lost)
+    {
+        ShardMessage disconnect;
+        disconnect.type = ShardMessage::Type::DISCONNECT;
+        disconnect.client = id;
+        PostToOtherShards(disconnect);
+        HandleShardMessage(disconnect);
+    }
+}
+
+void Server::AcceptHandoff()
+{
+    sock_t fd = accept(handoff_listen_fd_, nullptr, nullptr);
+    if (fd == INVALID_SOCKET)
+    {
+        return;
+    }
+    printf("New process taking over, handing off...\r\n");
+    handoff_fd_ = fd;
+    handoff_start_ = std::chrono::steady_clock::now();
+    handoff_requested_ = true;
+    ShardMessage handoff;
+    handoff.type = ShardMessage::Type::HANDOFF;
+    PostToOtherShards(handoff);
+}
+
+void Server::ParkForHandoff()
+{
+    handoff_requested_ = false;
+    // Once every shard is here nobody handles input, so what the mailboxes
+    // hold now is all the other shards will post.
+    group_->Synchronize();
+    handing_off_ = true;
+    if (shard_count_ > 1)
+    {
+        HandleShardMessages();
+    }
+    while (!pending_disconnects_.empty() || !pending_flushes_.empty())
+    {
+        DisconnectPending();
+        FlushScheduled();
+    }
+    if (completion_io_ != nullptr)
+    {
+        QuiesceCompletions();
+        DisconnectPending();
+    }
+    CaptureState(group_->GetHandoffState().shards[shard_id_]);
+    group_->Synchronize();
+    if (shard_id_ == 0)
+    {
+        HandOff();
+    }
+    group_->Synchronize();
+    ResumeAfterHandoff();
+}
+
+void Server::QuiesceCompletions()
+{
+    // The new process reads and writes these sockets next, so nothing may be
+    // left in flight here. Sends that can't finish are cancelled and their
+    // output handed over unsent. Cancelling by socket scans every request,
+    // so receives are cancelled by tag.
+    completion_io_->Cancel(server_fd_);
+    for (ClientSlot slot = 0; slot < clients_.End(); ++slot)
+    {
+        if (!clients_.InUse(slot) || clients_.Has(slot, ClientClosing))
+        {
+            continue;
+        }
+        if (clients_.Has(slot, ClientWriteArmed))
+        {
+            completion_io_->Cancel(clients_.Fd(slot));
+        }
+        else
+        {
+            completion_io_->CancelReceive(clients_.Info(slot).id);
+        }
+    }
+    bool busy = true;
+    while (busy)
+    {
+        if (event_loop_->Wait(ready_events_, HandoffSettleMs) == -1)
+        {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        HandleCompletions();
+        busy = !completion_io_->GetCompletions().empty();
+        for (ClientSlot slot = 0; slot < clients_.End() && !busy; ++slot)
+        {
+            busy = clients_.InUse(slot) && clients_.Has(slot, ClientWriteArmed);
+        }
+    }
+}
+
+void Server::CaptureState(ShardState& state)
+{
+    state.listener = server_fd_;
+    state.generations = clients_.GetGenerations();
+    for (const auto& [name, room] : rooms_)
+    {
+        if (!room.IsIdle() && !room.GetLocalMembers().empty())
+        {
+            state.rooms.push_back({name, room.GetPassword(), room.GetCreator()});
+        }
+    }
+    for (ClientSlot slot = 0; slot < clients_.End(); ++slot)
+    {
+        if (!clients_.InUse(slot) || clients_.Has(slot, ClientClosing) || clients_.GetRoom(slot) == nullptr)
+        {
+            continue;
+        }
+        const Client& client = clients_.Info(slot);
+        state.clients.push_back({clients_.Fd(slot), client.id, client.name, clients_.Has(slot, ClientColor),
+            clients_.Has(slot, ClientBinary), clients_.Has(slot, ClientCompressed), clients_.Compression(slot).adler,
+            clients_.GetRoom(slot)->GetName(), client.input.GetUnread() + client.backlog,
+            clients_.Queue(slot).GetUnsent()});
+    }
+}
+
+void Server::HandOff()
+{
+    // The new process binds these ports and writes these logs next.
+    admin_.reset();
+    federation_.reset();
+    if (RoomLogger* logger = group_->GetLogger())
+    {
+        logger->Stop();
+    }
+    HandoffState& state = group_->GetHandoffState();
+    state.node_id = node_id_;
+    state.node_count = node_count_;
+    size_t handed_off = 0;
+    for (const ShardState& shard : state.shards)
+    {
+        handed_off += shard.clients.size();
+    }
+    if (SendHandoff(handoff_fd_, state) && AwaitHandoffAck(handoff_fd_, handoff_ack_ms_))
+    {
+        printf("Handed off %zu clients in %lld ms, exiting.\r\n", handed_off,
+            static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - handoff_start_).count()));
+        exit(EXIT_SUCCESS);
+    }
+    fprintf(stderr, "Handoff failed, resuming.\r\n");
+    close(handoff_fd_);
+    handoff_fd_ = INVALID_SOCKET;
+    if (RoomLogger* logger = group_->GetLogger())
+    {
+        logger->Start();
+    }
+    // The new process may have taken the path over before it failed.
+    event_loop_->Remove(handoff_listen_fd_);
+    close(handoff_listen_fd_);
+    handoff_listen_fd_ = ListenForHandoff(handoff_path_);
+    event_loop_->Add(handoff_listen_fd_, EventRead);
+    // Peers forgot this node when the links dropped and resend their own
+    // clients when they are back.
+    for (size_t node = 0; node < node_count_; ++node)
+    {
+        if (node != node_id_)
+        {
+            DropNode(node);
+        }
+    }
+    StartEndpoints();
+}
+
+void Server::ResumeAfterHandoff()
+{
+    handing_off_ = false;
+    group_->GetHandoffState().shards[shard_id_] = ShardState();
+    if (completion_io_ != nullptr)
+    {
+        completion_io_->Accept(server_fd_);
+        for (ClientSlot slot = 0; slot < clients_.End(); ++slot)
+        {
+            if (!clients_.InUse(slot) || clients_.Has(slot, ClientClosing))
+            {
+                continue;
+            }
+            if (!clients_.Has(slot, ClientThrottled | ClientDeferred))
+            {
+                ResumeInput(clients_.Info(slot));
+            }
+            if (!clients_.Has(slot, ClientClosing | ClientWriteArmed))
+            {
+                FlushClient(slot);
+            }
+        }
+    }
+    if (shard_count_ > 1)
+    {
+        HandleShardMessages();
+    }
+}
+
+void Server::RestoreState(const ShardState& state)
+{
+    now_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::vector<std::pair<sock_t, ClientId>> ids;
+    for (const ClientState& restored : state.clients)
+    {
+        ids.emplace_back(restored.fd, restored.id);
+    }
+    clients_.Restore(state.generations, ids);
+    for (const RoomState& room : state.rooms)
+    {
+        bool created;
+        AcquireRoom(room.name, room.password, room.creator, created);
+    }
+    for (const ClientState& restored : state.clients)
+    {
+        ClientSlot slot = clients_.FindId(restored.id);
+        if (slot == NoSlot || clients_.Fd(slot) != restored.fd)
+        {
+            close(restored.fd);
+            continue;
+        }
+        Client& client = clients_.Info(slot);
+        client.name = restored.name;
+        if (!restored.color)
+        {
+            clients_.Clear(slot, ClientColor);
+        }
+        if (restored.binary)
+        {
+            clients_.Set(slot, ClientBinary);
+        }
+        if (restored.compressed)
+        {
+            clients_.Set(slot, ClientCompressed);
+            clients_.Compression(slot).adler = restored.adler;
+        }
+        sockaddr_storage addr{};
+        socklen_t addr_size = sizeof addr;
+        client.addr = getpeername(restored.fd, reinterpret_cast<sockaddr*>(&addr), &addr_size) == 0 ?
+            GetClientAddr(addr) : "unknown";
+        client.input = LineBuffer(max_line_length_);
+        client.connected_ms = client.last_input_ms = client.last_probe_ms = GetNowMs();
+        client.handshake_done = true;
+        ArmClientTimer(client);
+        ++stats_->clients;
+        bool created;
+        Room& room = AcquireRoom(restored.room, "", client.id, created);
+        room.AddMember(client, false);
+        clients_.SetRoom(slot, &room);
+        ShardMessage connect;
+        connect.type = ShardMessage::Type::CONNECT;
+        connect.client = client.id;
+        connect.name = client.name;
+        PostToCluster(connect);
+        ShardMessage join;
+        join.type = ShardMessage::Type::JOIN;
+        join.client = client.id;
+        join.room = room.GetName();
+        join.password = room.GetPassword();
+        PostToCluster(join);
+        if (restored.binary)
+        {
+            ShardMessage binary;
+            binary.type = ShardMessage::Type::BINARY;
+            binary.client = client.id;
+            PostToCluster(binary);
+        }
+        if (!restored.output.empty())
+        {
+            QueueRaw(slot, std::make_shared<const std::string>(restored.output), false);
+        }
+        // Input that was read but not handled is handled first, in turn.
+        if (!restored.input.empty())
+        {
+            client.backlog = restored.input;
+            clients_.Set(slot, ClientDeferred);
+            deferred_.push_back(client.id);
+        }
+        if (completion_io_ == nullptr)
+        {
+            event_loop_->Add(restored.fd, EventRead, true);
+        }
+        else if (restored.input.empty())
+        {
+            completion_io_->Receive(restored.fd, client.id);
+        }
+    }
 }
 
 } // namespace chatter
@@ -6,51 +6,259 @@
     #include <ws2tcpip.h>
     #define close closesocket
     #define ioctl ioctlsocket
-    #define poll WSAPoll
-    typedef unsigned long int nfds_t;
     typedef SOCKET sock_t;
 #else
-    #include <poll.h>
     #include <sys/socket.h>
     typedef int sock_t;
 #endif
 
+#include <chrono>
+#include <list>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "admin_endpoint.h"
 #include "client.h"
+#include "client_table.h"
 #include "command_handler.h"
+#include "config.h"
+#include "event_loop.h"
+#include "federation.h"
+#include "handoff.h"
+#include "history.h"
+#include "mailbox.h"
+#include "presence.h"
 #include "room.h"
+#include "stats.h"
+#include "timer_wheel.h"
 
 namespace chatter {
 
-constexpr int Backlog = 10;
-constexpr int MaxDataSize = 100;
+constexpr size_t MaxIdleRooms = 256;
+constexpr int64_t TimerTickMs = 100;
+// How long a handoff waits for the kernel to report no more completions.
+constexpr int HandoffSettleMs = 10;
+// How long a timed-out client's last output may take to leave.
+constexpr int64_t DrainTimeoutMs = 5000;
 
+class ShardGroup;
+
+// One reactor thread. Owns the clients accepted on its listener and a
+// replica of the server-wide directory of clients and rooms. In a
+// federation, shard 0 also runs the links to the other nodes: it sends this
+// node's directory changes to them, relays other shards' deliveries, and
+// hands what arrives to the shards it concerns.
+// With a handoff path, shard 0 also waits for a new process to take over: every
+// shard stops, and the listeners, client sockets and sessions are passed to the
+// new process. If it doesn't acknowledge them the shards carry on.
 class Server
 {
     public:
-        Server(const char* port, bool enable_logs);
-        void SendToClient(sock_t client_fd, const std::string& timestamp, const char* color, const std::string& message) const;
-        void SendToAllClients(const std::string& timestamp, const std::string& message) const;
+        Server(const Config& config, ShardGroup& group, size_t shard_id, const ShardState* inherited = nullptr);
+        // Binary-mode clients get the message as a REPLY frame, or as
+        // described by `fields`.
+        void SendToClient(ClientSlot slot, const std::string& timestamp, const char* color, const std::string& message,
+            bool droppable = false);
+        void SendToClient(ClientSlot slot, const std::string& timestamp, const char* color, const std::string& message,
+            const FrameFields& fields);
+        // Room deliveries pass the room's compressor, which MCCP clients
+        // share a stream from.
+        void SendToClient(ClientSlot slot, const RenderedMessage& rendered, bool droppable = false,
+            RoomCompressor* compressor = nullptr);
+        void SendToAllClients(const std::string& timestamp, const std::string& message);
+        void SendToAllClients(const RenderedMessage& rendered, ClientSlot except = NoSlot);
         void PollClients();
+        const char* GetBackendName() const { return event_loop_->Name(); }
         std::string GetTimestamp() const;
+        size_t GetShardId() const { return shard_id_; }
+        size_t GetShardCount() const { return shard_count_; }
+        size_t GetNodeId() const { return node_id_; }
+        size_t GetNodeCount() const { return node_count_; }
+        size_t NodeOf(ClientId client_id) const { return static_cast<size_t>(client_id % node_count_); }
+        size_t ShardOf(ClientId client_id) const
+        {
+            return static_cast<size_t>(client_id / node_count_ % shard_count_);
+        }
+        void Post(size_t shard, ShardMessage message);
+        // Other shards reach peer nodes through shard 0.
+        void PostToNode(size_t node, ShardMessage message);
+        ShardStats& GetStats() { return *stats_; }
+        ClientTable& GetClients() { return clients_; }
+        HistoryArena& GetHistoryArena() { return history_arena_; }
+        size_t GetPresenceMaxMembers() const { return presence_max_members_; }
+        int GetCompressionLevel() const { return compression_level_; }
+        // Flushes the room's presence digest when the window closes.
+        void SchedulePresence(Room& room);
+        const RateLimit& GetChatLimit(const std::string& room_name) const;
+        // Numbers room messages; the shard and node are mixed in like client ids.
+        uint64_t NextMessageSerial()
+        {
+            return (++message_count_ * shard_count_ + shard_id_) * node_count_ + node_id_;
+        }
     private:
         friend class CommandHandler;
-        std::string GetClientAddr(sock_t client_fd) const;
-        void* GetInAddr(sockaddr* sa) const;
-        void MakeConnection(const char* port);
-        void ConnectClient();
-        void DisconnectClient(sock_t client_fd, size_t index);
+        // Connections are accepted in one burst and set up once the listener
+        // is drained, so a reconnect storm empties the accept queue quickly.
+        struct AcceptedClient
+        {
+            ClientSlot slot;
+            sockaddr_storage addr;
+        };
+        // A client whose input waits for its rate limit to allow a line.
+        struct ThrottledClient
+        {
+            ClientId id;
+            int64_t resume_us;
+        };
+        std::string GetClientAddr(const sockaddr_storage& client_addr) const;
+        const void* GetInAddr(const sockaddr* sa) const;
+        void MakeConnection(const char* port, int backlog);
+        void WatchListener();
+        // The admin endpoint and peer links, which a handoff closes and a
+        // failed one reopens.
+        void StartEndpoints();
+        void AcceptClients();
+        void AddAccepted(sock_t client_fd, AcceptedClient& accepted);
+        void SetUpAccepted();
+        void ConnectClient(const AcceptedClient& accepted);
+        void DisconnectClient(ClientSlot slot);
         void AddClientToRoom(Client& client, const std::string& room, const std::string& password = "");
-        int ReceiveMessage(sock_t client_fd, std::string& message);
+        void LeaveRoom(const Client& client, Room& room);
+        Room& GetRoom(const Client& client) const { return *clients_.GetRoom(client.slot); }
+        void RemoveRemoteFromRoom(RemoteClient& remote);
+        Room& AcquireRoom(const std::string& room_name, const std::string& password, ClientId creator, bool& created);
+        Room* FindRoom(const std::string& room_name);
+        void ReleaseRoomIfEmpty(Room& room);
+        RemoteClient& GetRemoteClient(ClientId client_id);
+        void ReceiveMessages(Client& client);
+        // With completion I/O the loop accepts, reads and writes for us.
+        void HandleCompletions();
+        void AcceptCompleted(const Completion& completion);
+        void ReceiveCompleted(const Completion& completion);
+        void SendCompleted(const Completion& completion);
+        void ReceiveData(Client& client, const char* data, size_t size);
+        // Handles input left over from before, then reads more.
+        void ResumeInput(Client& client);
+        bool HandleLines(Client& client);
+        // Returns false when the line must wait for the client's rate limit.
+        bool HandleLine(Client& client, std::string_view line);
+        bool HandleFrame(Client& client, std::string_view body);
+        bool HandleInput(Client& client, bool chat, std::string_view text);
+        void SwitchToBinary(Client& client);
+        bool Throttle(Client& client, int64_t wait_us);
+        void ResumeThrottled();
+        // Clients that used up their read budget with input left are served
+        // again, in turn, on the next loop iteration.
+        bool HasReadBudget(Client& client);
+        void Defer(Client& client);
+        void ServeDeferred();
+        unsigned GetInterest(ClientSlot slot) const;
+        int64_t GetNowMs() const { return now_us_ / 1000; }
+        // Each client has one timer, armed for the earliest of its idle,
+        // keepalive and handshake deadlines. Input does not touch the wheel;
+        // the deadline is recomputed when the timer fires.
+        void ArmClientTimer(const Client& client);
+        void ExpireTimers();
+        void TimeOut(ClientSlot slot, const std::string& reason);
+        // Compresses for MCCP clients; QueueRaw() queues the bytes as they are.
+        void QueueToClient(ClientSlot slot, Payload payload, bool droppable);
+        void QueueRaw(ClientSlot slot, Payload payload, bool droppable);
+        void HandleTelnet(ClientSlot slot, std::string_view command);
+        void FlushClient(ClientSlot slot);
+        void FlushScheduled();
+        void MarkForDisconnect(ClientSlot slot);
+        void DisconnectPending();
+        const Client* FindLocalClient(ClientId client_id) const;
+        std::string GetClientName(ClientId client_id) const;
+        void Announce(const std::string& message, const FrameFields& fields, ClientSlot except = NoSlot);
+        void QueuePresence(PresenceKind kind, ClientId subject, const std::string& text);
+        void ArmPresenceTimer();
+        int GetWaitTimeout() const;
+        void FlushPresence();
+        void PublishRename(const Client& client);
+        void PostToOtherShards(const ShardMessage& message);
+        // Directory changes and announcements go to every shard and node.
+        void PostToCluster(const ShardMessage& message);
+        void HandleShardMessages();
+        void HandleShardMessage(ShardMessage& message);
+        void HandlePeerMessage(ShardMessage& message);
+        // Sends a newly linked node every client of this node and its room.
+        void SendDirectory(size_t node);
+        void DropNode(size_t node);
+        void AcceptHandoff();
+        // Runs once every shard has asked for the handoff. Shard 0 exits in
+        // HandOff() if the new process takes over.
+        void ParkForHandoff();
+        void QuiesceCompletions();
+        void CaptureState(ShardState& state);
+        void HandOff();
+        void ResumeAfterHandoff();
+        void RestoreState(const ShardState& state);
+        ShardGroup* group_;
+        size_t shard_id_;
+        size_t shard_count_;
+        size_t node_id_;
+        size_t node_count_;
         sock_t server_fd_;
         bool logs_enabled_;
-        std::vector<pollfd> client_pfds_;
-        std::unordered_map<sock_t, Client> clients_;
+        OutboundLimits outbound_limits_;
+        bool cork_output_;
+        size_t max_line_length_;
+        int compression_level_;
+        ShardStats* stats_;
+        HistoryArena history_arena_;
+        std::chrono::milliseconds presence_window_;
+        size_t presence_max_members_;
+        // Connects and disconnects, announced server-wide.
+        PresenceDigest presence_;
+        std::vector<std::string> presence_rooms_;
+        bool presence_armed_ = false;
+        std::chrono::steady_clock::time_point presence_deadline_;
+        RateLimits rate_limits_;
+        // Time the current batch of events was picked up, for rate limits.
+        int64_t now_us_ = 0;
+        std::vector<ThrottledClient> throttled_;
+        std::vector<ThrottledClient> resuming_;
+        ReadBudget read_budget_;
+        uint64_t tick_ = 0;
+        size_t tick_lines_ = 0;
+        std::vector<ClientId> deferred_;
+        std::vector<ClientId> serving_;
+        int64_t idle_timeout_ms_;
+        int64_t keepalive_ms_;
+        int64_t handshake_timeout_ms_;
+        TimerWheel timers_;
+        std::vector<uint32_t> expired_timers_;
+        Payload keepalive_probe_;
+        Payload compression_offer_;
+        std::unique_ptr<EventLoop> event_loop_;
+        CompletionIo* completion_io_ = nullptr;
+        uint64_t loop_syscalls_ = 0;
+        uint64_t message_count_ = 0;
+        std::unique_ptr<AdminEndpoint> admin_;
+        std::unique_ptr<Federation> federation_;
+        std::string admin_port_;
+        std::vector<std::string> nodes_;
+        std::string handoff_path_;
+        int handoff_ack_ms_;
+        sock_t handoff_listen_fd_;
+        sock_t handoff_fd_;
+        std::chrono::steady_clock::time_point handoff_start_;
+        bool handoff_requested_ = false;
+        // Set while stopped for a handoff: input is held, not handled.
+        bool handing_off_ = false;
+        std::vector<Event> ready_events_;
+        std::vector<AcceptedClient> accepted_;
+        ClientTable clients_;
+        std::vector<ClientId> pending_disconnects_;
+        std::vector<ClientSlot> pending_flushes_;
+        std::unordered_map<ClientId, RemoteClient> remote_clients_;
         std::unordered_map<std::string, Room> rooms_;
-        std::vector<char> message_buffer_;
+        std::list<Room*> idle_rooms_;
+        std::vector<ShardMessage> shard_messages_;
         CommandHandler command_handler_;
 };
 
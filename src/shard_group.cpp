@@ -0,0 +1,91 @@
+#include "shard_group.h"
+
+#ifndef _WIN32
+    #include <sys/socket.h>
+#endif
+
+#include <csignal>
+#include <cstdio>
+#include <thread>
+
+#include "server.h"
+
+namespace chatter {
+
+ShardGroup::ShardGroup(const Config& config, const HandoffState* inherited)
+{
+#ifndef _WIN32
+    // Write errors on dead peers are handled where writev() returns them.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    size_t shard_count = config.threads == 0 ? 1 : config.threads;
+#if defined(_WIN32) || !defined(SO_REUSEPORT)
+    if (shard_count > 1)
+    {
+        fprintf(stderr, "SO_REUSEPORT unavailable, running a single shard.\r\n");
+        shard_count = 1;
+    }
+#endif
+    if (inherited != nullptr)
+    {
+        shard_count = inherited->shards.size();
+    }
+    if (config.enable_logs)
+    {
+        logger_ = std::make_unique<RoomLogger>(config.logger_options);
+    }
+    for (size_t i = 0; i < shard_count; ++i)
+    {
+        mailboxes_.push_back(std::make_unique<Mailbox>());
+        stats_.push_back(std::make_unique<ShardStats>());
+    }
+    // Every mailbox must exist before any shard can post to it.
+    for (size_t i = 0; i < shard_count; ++i)
+    {
+        shards_.push_back(std::make_unique<Server>(config, *this, i,
+            inherited != nullptr ? &inherited->shards[i] : nullptr));
+    }
+    handoff_.shards.resize(shard_count);
+}
+
+ShardGroup::~ShardGroup() = default;
+
+void ShardGroup::Run()
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards_.size(); ++i)
+    {
+        Server* shard = shards_[i].get();
+        threads.emplace_back([shard]() {
+            while (true)
+            {
+                shard->PollClients();
+            }
+        });
+    }
+    while (true)
+    {
+        shards_[0]->PollClients();
+    }
+}
+
+void ShardGroup::Synchronize()
+{
+    std::unique_lock<std::mutex> lock(barrier_mutex_);
+    if (++barrier_waiting_ == shards_.size())
+    {
+        barrier_waiting_ = 0;
+        ++barrier_round_;
+        barrier_.notify_all();
+        return;
+    }
+    uint64_t round = barrier_round_;
+    barrier_.wait(lock, [this, round]() { return barrier_round_ != round; });
+}
+
+const char* ShardGroup::GetBackendName() const
+{
+    return shards_[0]->GetBackendName();
+}
+
+} // namespace chatter
@@ -0,0 +1,57 @@
+#ifndef CHATTER_SHARD_GROUP_H_
+#define CHATTER_SHARD_GROUP_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "config.h"
+#include "handoff.h"
+#include "mailbox.h"
+#include "room_logger.h"
+#include "stats.h"
+
+namespace chatter {
+
+class Server;
+
+// Owns one Server per reactor thread. Each shard binds its own listener
+// with SO_REUSEPORT so the kernel spreads new connections across them.
+// Given the state of a previous process, each shard resumes its share of it
+// instead.
+class ShardGroup
+{
+    public:
+        explicit ShardGroup(const Config& config, const HandoffState* inherited = nullptr);
+        ~ShardGroup();
+        void Run();
+        size_t GetShardCount() const { return mailboxes_.size(); }
+        void Post(size_t shard, ShardMessage message) { mailboxes_[shard]->Post(std::move(message)); }
+        Mailbox& GetMailbox(size_t shard) { return *mailboxes_[shard]; }
+        const char* GetBackendName() const;
+        // For driving a shard's PollClients() directly instead of Run().
+        Server& GetShard(size_t shard) { return *shards_[shard]; }
+        RoomLogger* GetLogger() const { return logger_.get(); }
+        ShardStats& GetStats(size_t shard) { return *stats_[shard]; }
+        std::string GetStatsReport() const { return FormatStatsReport(stats_, logger_.get()); }
+        std::string GetPrometheusStats() const { return FormatPrometheus(stats_, logger_.get()); }
+        // Blocks until every shard has called it, for the steps of a handoff.
+        void Synchronize();
+        // Each shard fills in its own entry while the group is stopped.
+        HandoffState& GetHandoffState() { return handoff_; }
+    private:
+        std::unique_ptr<RoomLogger> logger_;
+        std::vector<std::unique_ptr<ShardStats>> stats_;
+        std::vector<std::unique_ptr<Mailbox>> mailboxes_;
+        std::vector<std::unique_ptr<Server>> shards_;
+        HandoffState handoff_;
+        std::mutex barrier_mutex_;
+        std::condition_variable barrier_;
+        size_t barrier_waiting_ = 0;
+        uint64_t barrier_round_ = 0;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_SHARD_GROUP_H_
@@ -0,0 +1,263 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+
+#include "room_logger.h"
+
+namespace chatter {
+
+namespace {
+
+constexpr size_t TopRooms = 10;
+
+struct Totals
+{
+    uint64_t clients = 0;
+    uint64_t connections = 0;
+    uint64_t bytes_in = 0;
+    uint64_t lines_in = 0;
+    uint64_t throttled = 0;
+    uint64_t deferred = 0;
+    uint64_t bytes_out = 0;
+    uint64_t messages_out = 0;
+    uint64_t write_calls = 0;
+    uint64_t syscalls = 0;
+    uint64_t dropped_sends = 0;
+    uint64_t evictions = 0;
+    uint64_t timeouts = 0;
+    uint64_t broadcasts = 0;
+    uint64_t compress_in = 0;
+    uint64_t compress_out = 0;
+    uint64_t compress_ns = 0;
+    uint64_t peer_messages_in = 0;
+    uint64_t peer_bytes_in = 0;
+    uint64_t peer_messages_out = 0;
+    uint64_t peer_bytes_out = 0;
+    Histogram fanout;
+    Histogram poll_us;
+    Histogram queue_depth;
+    std::unordered_map<std::string, uint64_t> rooms;
+};
+
+Totals Sum(const std::vector<std::unique_ptr<ShardStats>>& shards)
+{
+    Totals totals;
+    for (const auto& shard : shards)
+    {
+        totals.clients += shard->clients;
+        totals.connections += shard->connections;
+        totals.bytes_in += shard->bytes_in;
+        totals.lines_in += shard->lines_in;
+        totals.throttled += shard->throttled;
+        totals.deferred += shard->deferred;
+        totals.bytes_out += shard->bytes_out;
+        totals.messages_out += shard->messages_out;
+        totals.write_calls += shard->write_calls;
+        totals.syscalls += shard->syscalls;
+        totals.dropped_sends += shard->dropped_sends;
+        totals.evictions += shard->evictions;
+        totals.timeouts += shard->timeouts;
+        totals.broadcasts += shard->broadcasts;
+        totals.compress_in += shard->compress_in;
+        totals.compress_out += shard->compress_out;
+        totals.compress_ns += shard->compress_ns;
+        totals.peer_messages_in += shard->peer_messages_in;
+        totals.peer_bytes_in += shard->peer_bytes_in;
+        totals.peer_messages_out += shard->peer_messages_out;
+        totals.peer_bytes_out += shard->peer_bytes_out;
+        totals.fanout.Merge(shard->fanout);
+        totals.poll_us.Merge(shard->poll_us);
+        totals.queue_depth.Merge(shard->queue_depth);
+        for (const auto& [room, count] : shard->GetRoomBroadcasts())
+        {
+            totals.rooms[room] += count;
+        }
+    }
+    return totals;
+}
+
+std::string Format(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    int size = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    std::string out(size > 0 ? static_cast<size_t>(size) : 0, '\0');
+    vsnprintf(out.data(), out.size() + 1, format, args);
+    va_end(args);
+    return out;
+}
+
+std::string Quantiles(const Histogram& histogram)
+{
+    return Format("p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\r\n",
+        histogram.Percentile(0.5), histogram.Percentile(0.99), histogram.GetMax());
+}
+
+void PrometheusCounter(std::string& out, const char* name, const char* help,
+    const std::vector<std::unique_ptr<ShardStats>>& shards, RelaxedCounter ShardStats::*field)
+{
+    out += Format("# HELP chatter_%s %s\n# TYPE chatter_%s counter\n", name, help, name);
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        out += Format("chatter_%s{shard=\"%zu\"} %" PRIu64 "\n", name, i, (*shards[i].*field).Load());
+    }
+}
+
+void PrometheusHistogram(std::string& out, const char* name, const char* help, const Histogram& histogram)
+{
+    out += Format("# HELP chatter_%s %s\n# TYPE chatter_%s histogram\n", name, help, name);
+    // Fixed power-of-four buckets keep the series stable between scrapes.
+    for (uint64_t bound = 1; bound <= (uint64_t{1} << 30); bound <<= 2)
+    {
+        out += Format("chatter_%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n", name, bound,
+            histogram.CountAtMost(bound));
+    }
+    out += Format("chatter_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, histogram.GetCount());
+    out += Format("chatter_%s_sum %" PRIu64 "\n", name, histogram.GetSum());
+    out += Format("chatter_%s_count %" PRIu64 "\n", name, histogram.GetCount());
+}
+
+} // namespace
+
+RelaxedCounter* ShardStats::TrackRoom(const std::string& room)
+{
+    std::lock_guard<std::mutex> lock(rooms_mutex_);
+    auto& counter = room_broadcasts_[room];
+    if (!counter)
+    {
+        counter = std::make_unique<RelaxedCounter>();
+    }
+    return counter.get();
+}
+
+void ShardStats::UntrackRoom(const std::string& room)
+{
+    std::lock_guard<std::mutex> lock(rooms_mutex_);
+    room_broadcasts_.erase(room);
+}
+
+std::unordered_map<std::string, uint64_t> ShardStats::GetRoomBroadcasts() const
+{
+    std::lock_guard<std::mutex> lock(rooms_mutex_);
+    std::unordered_map<std::string, uint64_t> counts;
+    for (const auto& [room, counter] : room_broadcasts_)
+    {
+        counts.emplace(room, counter->Load());
+    }
+    return counts;
+}
+
+std::string FormatStatsReport(const std::vector<std::unique_ptr<ShardStats>>& shards, const RoomLogger* logger)
+{
+    Totals totals = Sum(shards);
+    std::string out = Format("Server statistics (%zu shards):\r\n", shards.size());
+    out += Format("Clients: %" PRIu64 " connected, %" PRIu64 " accepted\r\n", totals.clients, totals.connections);
+    out += Format("In: %" PRIu64 " bytes, %" PRIu64 " lines, %" PRIu64 " throttled, %" PRIu64 " deferred reads\r\n",
+        totals.bytes_in, totals.lines_in, totals.throttled, totals.deferred);
+    out += Format("Out: %" PRIu64 " bytes, %" PRIu64 " messages, %" PRIu64 " writes\r\n",
+        totals.bytes_out, totals.messages_out, totals.write_calls);
+    out += Format("System calls: %" PRIu64 "\r\n", totals.syscalls);
+    out += Format("Dropped sends: %" PRIu64 ", evicted clients: %" PRIu64 ", timed out clients: %" PRIu64 "\r\n",
+        totals.dropped_sends, totals.evictions, totals.timeouts);
+    out += Format("Broadcasts: %" PRIu64 "\r\n", totals.broadcasts);
+    if (totals.compress_in != 0)
+    {
+        out += Format("Compressed: %" PRIu64 " bytes to %" PRIu64 " (%.1f%%), %.1f ms compressing\r\n",
+            totals.compress_in, totals.compress_out, 100.0 * totals.compress_out / totals.compress_in,
+            totals.compress_ns / 1e6);
+    }
+    if (totals.peer_messages_in + totals.peer_messages_out != 0)
+    {
+        out += Format("Peers: %" PRIu64 " messages / %" PRIu64 " bytes in, %" PRIu64 " messages / %" PRIu64
+            " bytes out\r\n", totals.peer_messages_in, totals.peer_bytes_in, totals.peer_messages_out,
+            totals.peer_bytes_out);
+    }
+    out += "Fan-out: " + Quantiles(totals.fanout);
+    out += "Poll iteration (us): " + Quantiles(totals.poll_us);
+    out += "Queue depth: " + Quantiles(totals.queue_depth);
+    if (logger != nullptr)
+    {
+        out += Format("Log lines: %" PRIu64 " written, %" PRIu64 " dropped\r\n",
+            logger->GetWritten(), logger->GetDropped());
+    }
+    std::vector<std::pair<std::string, uint64_t>> rooms(totals.rooms.begin(), totals.rooms.end());
+    size_t shown = std::min(rooms.size(), TopRooms);
+    std::partial_sort(rooms.begin(), rooms.begin() + shown, rooms.end(),
+        [](const auto& a, const auto& b) { return a.second > b.second; });
+    out += "Broadcasts by room:\r\n";
+    for (size_t i = 0; i < shown; ++i)
+    {
+        out += Format("  %s: %" PRIu64 "\r\n", rooms[i].first.c_str(), rooms[i].second);
+    }
+    return out;
+}
+
+std::string FormatPrometheus(const std::vector<std::unique_ptr<ShardStats>>& shards, const RoomLogger* logger)
+{
+    std::string out;
+    out += "# HELP chatter_clients Clients currently connected.\n# TYPE chatter_clients gauge\n";
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        out += Format("chatter_clients{shard=\"%zu\"} %" PRIu64 "\n", i, shards[i]->clients.Load());
+    }
+    PrometheusCounter(out, "connections_total", "Connections accepted.", shards, &ShardStats::connections);
+    PrometheusCounter(out, "received_bytes_total", "Bytes read from clients.", shards, &ShardStats::bytes_in);
+    PrometheusCounter(out, "received_lines_total", "Lines read from clients.", shards, &ShardStats::lines_in);
+    PrometheusCounter(out, "throttled_lines_total", "Lines held back or dropped by rate limits.", shards,
+        &ShardStats::throttled);
+    PrometheusCounter(out, "deferred_reads_total", "Clients left with input after using their read budget.", shards,
+        &ShardStats::deferred);
+    PrometheusCounter(out, "sent_bytes_total", "Bytes written to clients.", shards, &ShardStats::bytes_out);
+    PrometheusCounter(out, "sent_messages_total", "Messages queued to clients.", shards, &ShardStats::messages_out);
+    PrometheusCounter(out, "write_calls_total", "Sends to clients.", shards, &ShardStats::write_calls);
+    PrometheusCounter(out, "syscalls_total", "System calls for client I/O and event waits.", shards,
+        &ShardStats::syscalls);
+    PrometheusCounter(out, "dropped_sends_total", "Messages shed from slow consumers.", shards,
+        &ShardStats::dropped_sends);
+    PrometheusCounter(out, "evictions_total", "Slow consumers disconnected.", shards, &ShardStats::evictions);
+    PrometheusCounter(out, "timeouts_total", "Clients disconnected for being idle or silent.", shards,
+        &ShardStats::timeouts);
+    PrometheusCounter(out, "broadcasts_total", "Room broadcasts originated.", shards, &ShardStats::broadcasts);
+    PrometheusCounter(out, "compressed_input_bytes_total", "Bytes sent to MCCP clients, before compression.", shards,
+        &ShardStats::compress_in);
+    PrometheusCounter(out, "compressed_output_bytes_total", "Bytes sent to MCCP clients, after compression.", shards,
+        &ShardStats::compress_out);
+    PrometheusCounter(out, "compress_nanoseconds_total", "Time spent compressing output.", shards,
+        &ShardStats::compress_ns);
+    PrometheusCounter(out, "peer_received_messages_total", "Messages received from peer nodes.", shards,
+        &ShardStats::peer_messages_in);
+    PrometheusCounter(out, "peer_received_bytes_total", "Bytes received from peer nodes.", shards,
+        &ShardStats::peer_bytes_in);
+    PrometheusCounter(out, "peer_sent_messages_total", "Messages sent to peer nodes.", shards,
+        &ShardStats::peer_messages_out);
+    PrometheusCounter(out, "peer_sent_bytes_total", "Bytes sent to peer nodes.", shards,
+        &ShardStats::peer_bytes_out);
+    Totals totals = Sum(shards);
+    out += "# HELP chatter_room_broadcasts_total Room broadcasts originated, by room.\n"
+        "# TYPE chatter_room_broadcasts_total counter\n";
+    for (const auto& [room, count] : totals.rooms)
+    {
+        out += Format("chatter_room_broadcasts_total{room=\"%s\"} %" PRIu64 "\n", room.c_str(), count);
+    }
+    PrometheusHistogram(out, "fanout", "Local recipients per delivered broadcast.", totals.fanout);
+    PrometheusHistogram(out, "poll_iteration_microseconds", "Time spent handling one batch of events.",
+        totals.poll_us);
+    PrometheusHistogram(out, "queue_depth", "Outbound queue depth after each enqueue.", totals.queue_depth);
+    if (logger != nullptr)
+    {
+        out += Format("# HELP chatter_log_lines_total Room log lines by outcome.\n"
+            "# TYPE chatter_log_lines_total counter\n"
+            "chatter_log_lines_total{outcome=\"written\"} %" PRIu64 "\n"
+            "chatter_log_lines_total{outcome=\"dropped\"} %" PRIu64 "\n",
+            logger->GetWritten(), logger->GetDropped());
+    }
+    return out;
+}
+
+} // namespace chatter
@@ -0,0 +1,64 @@
+#ifndef CHATTER_STATS_H_
+#define CHATTER_STATS_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.h"
+
+namespace chatter {
+
+class RoomLogger;
+
+// Counters for one shard. Only the owning reactor thread writes them, so the
+// hot path is a relaxed load and store; any thread may read a snapshot.
+class ShardStats
+{
+    public:
+        RelaxedCounter clients;
+        RelaxedCounter connections;
+        RelaxedCounter bytes_in;
+        RelaxedCounter lines_in;
+        RelaxedCounter throttled;
+        RelaxedCounter deferred;
+        RelaxedCounter bytes_out;
+        RelaxedCounter messages_out;
+        RelaxedCounter write_calls;
+        // Client I/O and event loop calls; io_uring batches many per call.
+        RelaxedCounter syscalls;
+        RelaxedCounter dropped_sends;
+        RelaxedCounter evictions;
+        RelaxedCounter timeouts;
+        RelaxedCounter broadcasts;
+        // Output to MCCP clients before and after compression, and the time
+        // spent compressing it.
+        RelaxedCounter compress_in;
+        RelaxedCounter compress_out;
+        RelaxedCounter compress_ns;
+        // Federation traffic, counted by shard 0.
+        RelaxedCounter peer_messages_in;
+        RelaxedCounter peer_bytes_in;
+        RelaxedCounter peer_messages_out;
+        RelaxedCounter peer_bytes_out;
+        AtomicHistogram fanout;
+        AtomicHistogram poll_us;
+        AtomicHistogram queue_depth;
+        // Broadcasts originated on this shard, per room. The table only
+        // changes when a room replica is created or destroyed.
+        RelaxedCounter* TrackRoom(const std::string& room);
+        void UntrackRoom(const std::string& room);
+        std::unordered_map<std::string, uint64_t> GetRoomBroadcasts() const;
+    private:
+        mutable std::mutex rooms_mutex_;
+        std::unordered_map<std::string, std::unique_ptr<RelaxedCounter>> room_broadcasts_;
+};
+
+std::string FormatStatsReport(const std::vector<std::unique_ptr<ShardStats>>& shards, const RoomLogger* logger);
+std::string FormatPrometheus(const std::vector<std::unique_ptr<ShardStats>>& shards, const RoomLogger* logger);
+
+} // namespace chatter
+
+#endif // CHATTER_STATS_H_
@@ -0,0 +1,20 @@
+#ifndef CHATTER_TELNET_H_
+#define CHATTER_TELNET_H_
+
+namespace chatter::telnet {
+
+constexpr unsigned char Se = 240;
+constexpr unsigned char Nop = 241;
+constexpr unsigned char Sb = 250;
+constexpr unsigned char Will = 251;
+constexpr unsigned char Wont = 252;
+constexpr unsigned char Do = 253;
+constexpr unsigned char Dont = 254;
+constexpr unsigned char Iac = 255;
+
+// MUD Client Compression Protocol, version 2.
+constexpr unsigned char Compress2 = 86;
+
+} // namespace chatter::telnet
+
+#endif // CHATTER_TELNET_H_
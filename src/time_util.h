@@ -0,0 +1,22 @@
+#ifndef CHATTER_TIME_UTIL_H_
+#define CHATTER_TIME_UTIL_H_
+
+#include <ctime>
+
+namespace chatter {
+
+// Thread-safe replacement for gmtime().
+inline tm UtcTime(time_t t)
+{
+    tm out;
+#ifdef _WIN32
+    gmtime_s(&out, &t);
+#else
+    gmtime_r(&t, &out);
+#endif
+    return out;
+}
+
+} // namespace chatter
+
+#endif // CHATTER_TIME_UTIL_H_
@@ -0,0 +1,202 @@
+#include "timer_wheel.h"
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+
+namespace chatter {
+
+namespace {
+
+int LowestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+} // namespace
+
+TimerWheel::TimerWheel(int64_t tick_ms, int64_t now_ms)
+    : tick_ms_(tick_ms), now_tick_(static_cast<uint64_t>(now_ms / tick_ms))
+{
+    for (Level& level : levels_)
+    {
+        level.heads.fill(NoTimer);
+    }
+}
+
+void TimerWheel::Arm(uint32_t timer, int64_t deadline_ms)
+{
+    if (timer >= nodes_.size())
+    {
+        nodes_.resize(timer + 1);
+    }
+    if (nodes_[timer].level != NoLevel)
+    {
+        Unlink(timer);
+    }
+    else
+    {
+        ++size_;
+    }
+    // Rounded up, so a timer never fires before its deadline.
+    uint64_t deadline = deadline_ms > 0 ? static_cast<uint64_t>((deadline_ms + tick_ms_ - 1) / tick_ms_) : 0;
+    nodes_[timer].deadline = std::max(deadline, now_tick_ + 1);
+    Link(timer);
+}
+
+void TimerWheel::Cancel(uint32_t timer)
+{
+    if (IsArmed(timer))
+    {
+        Unlink(timer);
+        --size_;
+    }
+}
+
+void TimerWheel::Link(uint32_t timer)
+{
+    Node& node = nodes_[timer];
+    uint64_t delta = node.deadline - now_tick_;
+    int level = 0;
+    while (level < Levels - 1 && delta >= uint64_t{1} << (LevelBits * (level + 1)))
+    {
+        ++level;
+    }
+    uint64_t range = uint64_t{1} << (LevelBits * Levels);
+    if (delta >= range)
+    {
+        node.deadline = now_tick_ + range - 1;
+    }
+    node.level = static_cast<uint8_t>(level);
+    node.slot = static_cast<uint8_t>((node.deadline >> (LevelBits * level)) & (Slots - 1));
+    Level& wheel = levels_[level];
+    node.prev = NoTimer;
+    node.next = wheel.heads[node.slot];
+    if (node.next != NoTimer)
+    {
+        nodes_[node.next].prev = timer;
+    }
+    wheel.heads[node.slot] = timer;
+    wheel.occupied |= uint64_t{1} << node.slot;
+}
+
+void TimerWheel::Unlink(uint32_t timer)
+{
+    Node& node = nodes_[timer];
+    Level& wheel = levels_[node.level];
+    if (node.prev != NoTimer)
+    {
+        nodes_[node.prev].next = node.next;
+    }
+    else
+    {
+        wheel.heads[node.slot] = node.next;
+        if (node.next == NoTimer)
+        {
+            wheel.occupied &= ~(uint64_t{1} << node.slot);
+        }
+    }
+    if (node.next != NoTimer)
+    {
+        nodes_[node.next].prev = node.prev;
+    }
+    node.level = NoLevel;
+}
+
+void TimerWheel::Cascade(int level)
+{
+    Level& wheel = levels_[level];
+    uint32_t slot = static_cast<uint32_t>(now_tick_ >> (LevelBits * level)) & (Slots - 1);
+    uint32_t timer = wheel.heads[slot];
+    wheel.heads[slot] = NoTimer;
+    wheel.occupied &= ~(uint64_t{1} << slot);
+    while (timer != NoTimer)
+    {
+        uint32_t next = nodes_[timer].next;
+        Link(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::Advance(int64_t now_ms, std::vector<uint32_t>& expired)
+{
+    uint64_t target = static_cast<uint64_t>(now_ms / tick_ms_);
+    while (now_tick_ < target)
+    {
+        if (size_ == 0)
+        {
+            now_tick_ = target;
+            break;
+        }
+        // Nothing can fire before the next cascade, so skip to it.
+        if (levels_[0].occupied == 0)
+        {
+            uint64_t last = now_tick_ | (Slots - 1);
+            if (last >= target)
+            {
+                now_tick_ = target;
+                break;
+            }
+            now_tick_ = last;
+        }
+        ++now_tick_;
+        for (int level = Levels - 1; level > 0; --level)
+        {
+            if ((now_tick_ & ((uint64_t{1} << (LevelBits * level)) - 1)) == 0)
+            {
+                Cascade(level);
+            }
+        }
+        Level& wheel = levels_[0];
+        uint32_t slot = static_cast<uint32_t>(now_tick_) & (Slots - 1);
+        uint32_t timer = wheel.heads[slot];
+        wheel.heads[slot] = NoTimer;
+        wheel.occupied &= ~(uint64_t{1} << slot);
+        while (timer != NoTimer)
+        {
+            uint32_t next = nodes_[timer].next;
+            nodes_[timer].level = NoLevel;
+            --size_;
+            expired.push_back(timer);
+            timer = next;
+        }
+    }
+}
+
+int TimerWheel::GetTimeout(int64_t now_ms) const
+{
+    if (size_ == 0)
+    {
+        return -1;
+    }
+    // Level 0 holds everything due within one rotation. Timers on higher
+    // levels may come due at the cascade that starts the next rotation.
+    uint64_t next = UINT64_MAX;
+    for (int level = 1; level < Levels; ++level)
+    {
+        if (levels_[level].occupied != 0)
+        {
+            next = (now_tick_ | (Slots - 1)) + 1;
+        }
+    }
+    uint64_t occupied = levels_[0].occupied;
+    if (occupied != 0)
+    {
+        uint32_t start = static_cast<uint32_t>(now_tick_ + 1) & (Slots - 1);
+        uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (Slots - start));
+        next = std::min(next, now_tick_ + 1 + static_cast<uint64_t>(LowestBit(rotated)));
+    }
+    int64_t timeout = static_cast<int64_t>(next) * tick_ms_ - now_ms;
+    return static_cast<int>(std::clamp<int64_t>(timeout, 0, INT_MAX));
+}
+
+} // namespace chatter
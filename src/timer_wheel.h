@@ -0,0 +1,62 @@
+#ifndef CHATTER_TIMER_WHEEL_H_
+#define CHATTER_TIMER_WHEEL_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace chatter {
+
+// Hierarchical timing wheel. Each level has 64 slots; a slot on level n
+// spans 64^n ticks, so four levels reach 64^4 ticks (19 days at 100 ms).
+// Timers are dense ids chosen by the caller (a ClientSlot) and live on
+// intrusive lists, so arming and cancelling are O(1). A level's slot is
+// cascaded into the levels below when the wheel reaches it. Deadlines past
+// the last level fire early; callers re-check and arm again.
+class TimerWheel
+{
+    public:
+        static constexpr uint32_t NoTimer = UINT32_MAX;
+        TimerWheel(int64_t tick_ms, int64_t now_ms);
+        // Moves the timer if it is already armed.
+        void Arm(uint32_t timer, int64_t deadline_ms);
+        void Cancel(uint32_t timer);
+        bool IsArmed(uint32_t timer) const { return timer < nodes_.size() && nodes_[timer].level != NoLevel; }
+        // Appends the timers due by `now_ms` to `expired`; they are disarmed.
+        void Advance(int64_t now_ms, std::vector<uint32_t>& expired);
+        // Milliseconds until the wheel next has work, or -1 when it is empty.
+        int GetTimeout(int64_t now_ms) const;
+        size_t Size() const { return size_; }
+    private:
+        static constexpr int LevelBits = 6;
+        static constexpr uint32_t Slots = 1u << LevelBits;
+        static constexpr int Levels = 4;
+        static constexpr uint8_t NoLevel = UINT8_MAX;
+        struct Node
+        {
+            uint32_t prev = NoTimer;
+            uint32_t next = NoTimer;
+            uint64_t deadline = 0;
+            uint8_t level = NoLevel;
+            uint8_t slot = 0;
+        };
+        struct Level
+        {
+            std::array<uint32_t, Slots> heads;
+            // Bit i is set while slot i is non-empty.
+            uint64_t occupied = 0;
+        };
+        void Link(uint32_t timer);
+        void Unlink(uint32_t timer);
+        void Cascade(int level);
+        int64_t tick_ms_;
+        uint64_t now_tick_;
+        size_t size_ = 0;
+        std::vector<Node> nodes_;
+        std::array<Level, Levels> levels_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_TIMER_WHEEL_H_
@@ -0,0 +1,64 @@
+// Prints the messages in a room's store directory (logs/<room>/ when the
+// server runs with -G store), one per line: number, UTC time, text.
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string_view>
+
+#include "message_store.h"
+
+namespace {
+
+bool ParseSeq(std::string_view text, uint64_t& seq)
+{
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), seq);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+void Print(const chatter::StoredMessage& message)
+{
+    std::string_view text = message.text;
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+    {
+        text.remove_suffix(1);
+    }
+    printf("%llu\t%s\t%.*s\n", static_cast<unsigned long long>(message.seq),
+        chatter::FormatStoreTime(message.time_us).c_str(), static_cast<int>(text.size()), text.data());
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2 && argc != 4)
+    {
+        fprintf(stderr, "usage: store_dump <room_directory> [<from> <to>]\n"
+            "       from/to are message numbers, HH:MM[:SS] (today, UTC) or YYYY-MM-DDTHH:MM[:SS]\n");
+        return 1;
+    }
+    chatter::StoreReader reader(argv[1]);
+    if (argc == 2)
+    {
+        reader.ReadBySeq(0, UINT64_MAX, SIZE_MAX, Print);
+        return 0;
+    }
+    uint64_t from_seq;
+    uint64_t to_seq;
+    if (ParseSeq(argv[2], from_seq) && ParseSeq(argv[3], to_seq))
+    {
+        reader.ReadBySeq(from_seq, to_seq, SIZE_MAX, Print);
+        return 0;
+    }
+    int64_t from_us;
+    int64_t to_us;
+    time_t now = time(nullptr);
+    if (!chatter::ParseStoreTime(argv[2], now, false, from_us) || !chatter::ParseStoreTime(argv[3], now, true, to_us))
+    {
+        fprintf(stderr, "invalid range: %s %s\n", argv[2], argv[3]);
+        return 1;
+    }
+    reader.ReadByTime(from_us, to_us, SIZE_MAX, Print);
+    return 0;
+}
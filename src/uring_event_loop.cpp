@@ -0,0 +1,474 @@
+#include "uring_event_loop.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace chatter {
+
+namespace {
+
+// user_data carries the kind of request in the top byte and a tag, a pending
+// send or the listener below it.
+constexpr int OpShift = 56;
+constexpr uint64_t ValueMask = (uint64_t{1} << OpShift) - 1;
+
+enum Op : uint64_t
+{
+    OpIgnore,
+    OpAccept,
+    OpReceive,
+    OpSend,
+    OpEpoll,
+};
+
+uint64_t MakeUserData(Op op, uint64_t value)
+{
+    return (static_cast<uint64_t>(op) << OpShift) | (value & ValueMask);
+}
+
+} // namespace
+
+UringEventLoop::UringEventLoop()
+{
+    valid_ = epoll_.IsValid() && SetUpRing() && SetUpBuffers() && SelfTest();
+}
+
+UringEventLoop::~UringEventLoop()
+{
+    if (ring_fd_ != -1)
+    {
+        close(ring_fd_);
+    }
+    if (sqes_ != nullptr)
+    {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_map_ != nullptr && cq_map_ != sq_map_)
+    {
+        munmap(cq_map_, cq_map_size_);
+    }
+    if (sq_map_ != nullptr)
+    {
+        munmap(sq_map_, sq_map_size_);
+    }
+    if (buffer_ring_ != nullptr)
+    {
+        munmap(buffer_ring_, buffer_ring_size_);
+    }
+    if (buffers_ != nullptr)
+    {
+        munmap(buffers_, size_t{UringBufferCount} * UringBufferSize);
+    }
+}
+
+bool UringEventLoop::SetUpRing()
+{
+    io_uring_params params{};
+    // SUBMIT_ALL and COOP_TASKRUN (5.19) save a few wakeups; older kernels
+    // reject them.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = UringEntries * 4;
+    ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, UringEntries, &params));
+    if (ring_fd_ == -1 && errno == EINVAL)
+    {
+        params = io_uring_params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = UringEntries * 4;
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, UringEntries, &params));
+    }
+    if (ring_fd_ == -1)
+    {
+        perror("io_uring_setup");
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        fprintf(stderr, "io_uring: kernel too old\r\n");
+        return false;
+    }
+    sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map)
+    {
+        sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+    }
+    void* map = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+        IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+    {
+        perror("io_uring: mmap");
+        return false;
+    }
+    sq_map_ = map;
+    if (single_map)
+    {
+        cq_map_ = sq_map_;
+    }
+    else
+    {
+        map = mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+            IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+        {
+            perror("io_uring: mmap");
+            return false;
+        }
+        cq_map_ = map;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    map = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+    {
+        perror("io_uring: mmap");
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(map);
+
+    char* sq = static_cast<char*>(sq_map_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = *sq_tail_;
+    // Entry i of the ring always names SQE i.
+    unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i)
+    {
+        array[i] = i;
+    }
+    char* cq = static_cast<char*>(cq_map_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool UringEventLoop::SetUpBuffers()
+{
+    size_t buffers_size = size_t{UringBufferCount} * UringBufferSize;
+    void* map = mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("io_uring: mmap");
+        return false;
+    }
+    buffers_ = static_cast<char*>(map);
+    buffer_ring_size_ = UringBufferCount * sizeof(io_uring_buf);
+    map = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("io_uring: mmap");
+        return false;
+    }
+    buffer_ring_ = static_cast<io_uring_buf_ring*>(map);
+    // Fault the pages in first, or the kernel may pin the shared zero page.
+    memset(buffer_ring_, 0, buffer_ring_size_);
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+    reg.ring_entries = UringBufferCount;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        perror("io_uring: register buffers");
+        return false;
+    }
+    for (unsigned i = 0; i < UringBufferCount; ++i)
+    {
+        used_buffers_.push_back(static_cast<uint16_t>(i));
+    }
+    RecycleBuffers();
+    return true;
+}
+
+bool UringEventLoop::SelfTest()
+{
+    // Multishot recv (6.0) is the newest feature used; the kernel accepts
+    // the flag quietly before then, so try it on a socket pair.
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        return false;
+    }
+    Receive(pair[0], ValueMask);
+    bool passed = write(pair[1], "x", 1) == 1 && Enter(1, 1000) == 0;
+    Reap();
+    passed = passed && completions_.size() == 1 && completions_[0].result == 1 && completions_[0].more;
+    Close(pair[0]);
+    close(pair[1]);
+    // Cancel, the recv it ends and close.
+    Enter(3, 1000);
+    Reap();
+    completions_.clear();
+    if (!passed)
+    {
+        fprintf(stderr, "io_uring: multishot recv unsupported\r\n");
+    }
+    return passed;
+}
+
+io_uring_sqe* UringEventLoop::GetSqe(unsigned count)
+{
+    while (sq_entries_ - (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) < count)
+    {
+        if (Enter(0, 0) == -1)
+        {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+    io_uring_sqe* sqe = &sqes_[sq_local_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof *sqe);
+    ++sq_local_tail_;
+    return sqe;
+}
+
+int UringEventLoop::Enter(unsigned min_complete, int timeout_ms)
+{
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    __kernel_timespec timeout{};
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0)
+    {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    }
+    ++syscalls_;
+    long ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+    if (ret == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void UringEventLoop::Reap()
+{
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        uint64_t value = cqe.user_data & ValueMask;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        switch (static_cast<Op>(cqe.user_data >> OpShift))
+        {
+            case OpAccept:
+            {
+                completions_.push_back({Completion::Type::ACCEPT, value, cqe.res, nullptr, more});
+                break;
+            }
+            case OpReceive:
+            {
+                const char* data = nullptr;
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                {
+                    uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    used_buffers_.push_back(id);
+                    data = buffers_ + size_t{id} * UringBufferSize;
+                }
+                completions_.push_back({Completion::Type::RECEIVE, value, cqe.res, data, more});
+                break;
+            }
+            case OpSend:
+            {
+                PendingSend& send = *sends_[value];
+                completions_.push_back({Completion::Type::SEND, send.tag, cqe.res, nullptr, false});
+                send.payloads.clear();
+                free_sends_.push_back(static_cast<uint32_t>(value));
+                break;
+            }
+            case OpEpoll:
+            {
+                epoll_ready_ = true;
+                epoll_polled_ = more;
+                break;
+            }
+            case OpIgnore:
+            {
+                break;
+            }
+        }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+void UringEventLoop::RecycleBuffers()
+{
+    // The header's flexible array sits one entry in when compiled as C++;
+    // the entries start at the ring itself, overlapping the tail.
+    io_uring_buf* entries = reinterpret_cast<io_uring_buf*>(buffer_ring_);
+    for (uint16_t id : used_buffers_)
+    {
+        io_uring_buf& buffer = entries[buffer_tail_ & (UringBufferCount - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers_ + size_t{id} * UringBufferSize);
+        buffer.len = UringBufferSize;
+        buffer.bid = id;
+        ++buffer_tail_;
+    }
+    __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+    used_buffers_.clear();
+}
+
+void UringEventLoop::PollEpoll()
+{
+    if (epoll_polled_)
+    {
+        return;
+    }
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = epoll_.GetFd();
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = MakeUserData(OpEpoll, 0);
+    epoll_polled_ = true;
+}
+
+bool UringEventLoop::Add(sock_t fd, unsigned events, bool edge_triggered)
+{
+    return epoll_.Add(fd, events, edge_triggered);
+}
+
+bool UringEventLoop::Modify(sock_t fd, unsigned events, bool edge_triggered)
+{
+    return epoll_.Modify(fd, events, edge_triggered);
+}
+
+void UringEventLoop::Remove(sock_t fd)
+{
+    epoll_.Remove(fd);
+}
+
+int UringEventLoop::Wait(std::vector<Event>& events, int timeout_ms)
+{
+    events.clear();
+    completions_.clear();
+    RecycleBuffers();
+    PollEpoll();
+    // Descriptors left over from the last epoll_wait() are collected without
+    // blocking.
+    if (Enter(timeout_ms == 0 || epoll_ready_ ? 0 : 1, epoll_ready_ ? 0 : timeout_ms) == -1)
+    {
+        return -1;
+    }
+    Reap();
+    if (epoll_ready_)
+    {
+        int count = epoll_.Wait(events, 0);
+        if (count == -1)
+        {
+            return -1;
+        }
+        epoll_ready_ = count == MaxEpollEvents;
+    }
+    return static_cast<int>(events.size() + completions_.size());
+}
+
+void UringEventLoop::Accept(sock_t listen_fd)
+{
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = MakeUserData(OpAccept, static_cast<uint64_t>(listen_fd));
+}
+
+void UringEventLoop::Receive(sock_t fd, uint64_t tag)
+{
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = MakeUserData(OpReceive, tag);
+}
+
+void UringEventLoop::CancelReceive(uint64_t tag)
+{
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MakeUserData(OpReceive, tag);
+    sqe->user_data = MakeUserData(OpIgnore, 0);
+}
+
+void UringEventLoop::Send(sock_t fd, uint64_t tag, OutboundQueue& queue)
+{
+    uint32_t index;
+    if (free_sends_.empty())
+    {
+        index = static_cast<uint32_t>(sends_.size());
+        sends_.push_back(std::make_unique<PendingSend>());
+    }
+    else
+    {
+        index = free_sends_.back();
+        free_sends_.pop_back();
+    }
+    PendingSend& send = *sends_[index];
+    send.tag = tag;
+    size_t offset;
+    queue.Gather(send.payloads, offset, UringMaxSendPayloads);
+    send.iov.resize(send.payloads.size());
+    for (size_t i = 0; i < send.payloads.size(); ++i)
+    {
+        size_t skip = i == 0 ? offset : 0;
+        send.iov[i].iov_base = const_cast<char*>(send.payloads[i]->data()) + skip;
+        send.iov[i].iov_len = send.payloads[i]->size() - skip;
+    }
+    send.message = msghdr{};
+    send.message.msg_iov = send.iov.data();
+    send.message.msg_iovlen = send.iov.size();
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&send.message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = MakeUserData(OpSend, index);
+}
+
+void UringEventLoop::Cancel(sock_t fd)
+{
+    io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = MakeUserData(OpIgnore, 0);
+}
+
+void UringEventLoop::Close(sock_t fd)
+{
+    // A multishot recv holds the socket open, so cancel everything on it
+    // first; the close runs whether or not anything was cancelled.
+    io_uring_sqe* sqe = GetSqe(2);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = MakeUserData(OpIgnore, 0);
+    sqe = GetSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = MakeUserData(OpIgnore, 0);
+}
+
+} // namespace chatter
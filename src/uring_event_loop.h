@@ -0,0 +1,102 @@
+#ifndef CHATTER_URING_EVENT_LOOP_H_
+#define CHATTER_URING_EVENT_LOOP_H_
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "completion_io.h"
+#include "epoll_event_loop.h"
+
+namespace chatter {
+
+constexpr unsigned UringEntries = 4096;
+constexpr unsigned UringBufferCount = 1024;
+constexpr unsigned UringBufferSize = 4096;
+constexpr size_t UringMaxSendPayloads = 64;
+
+// io_uring backend. Client sockets are served by a multishot accept and one
+// multishot recv each, which fill buffers from a shared provided-buffer ring;
+// sends queued while handling a batch go to the kernel with the same
+// io_uring_enter() that waits for the next one. Other descriptors (mailbox,
+// admin endpoint) stay on an epoll set that the ring polls.
+class UringEventLoop : public EventLoop, public CompletionIo
+{
+    public:
+        UringEventLoop();
+        ~UringEventLoop() override;
+        // False when the kernel lacks io_uring or a feature used here.
+        bool IsValid() const { return valid_; }
+        bool Add(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        bool Modify(sock_t fd, unsigned events, bool edge_triggered = false) override;
+        void Remove(sock_t fd) override;
+        int Wait(std::vector<Event>& events, int timeout_ms) override;
+        const char* Name() const override { return "io_uring"; }
+        bool IsEdgeTriggered() const override { return true; }
+        uint64_t GetSyscalls() const override { return syscalls_ + epoll_.GetSyscalls(); }
+        CompletionIo* GetCompletionIo() override { return this; }
+        void Accept(sock_t listen_fd) override;
+        void Receive(sock_t fd, uint64_t tag) override;
+        void CancelReceive(uint64_t tag) override;
+        void Send(sock_t fd, uint64_t tag, OutboundQueue& queue) override;
+        void Cancel(sock_t fd) override;
+        void Close(sock_t fd) override;
+        const std::vector<Completion>& GetCompletions() const override { return completions_; }
+    private:
+        // A sendmsg() in flight; holds the payloads it points into.
+        struct PendingSend
+        {
+            uint64_t tag;
+            msghdr message;
+            std::vector<Payload> payloads;
+            std::vector<iovec> iov;
+        };
+        bool SetUpRing();
+        bool SetUpBuffers();
+        bool SelfTest();
+        // Submits what is queued first if fewer than `count` entries are free.
+        io_uring_sqe* GetSqe(unsigned count = 1);
+        int Enter(unsigned min_complete, int timeout_ms);
+        void Reap();
+        void RecycleBuffers();
+        void PollEpoll();
+        bool valid_ = false;
+        int ring_fd_ = -1;
+        void* sq_map_ = nullptr;
+        size_t sq_map_size_ = 0;
+        void* cq_map_ = nullptr;
+        size_t cq_map_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        // Entries up to here are written; the kernel has read up to *sq_head_.
+        unsigned sq_local_tail_ = 0;
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+        io_uring_buf_ring* buffer_ring_ = nullptr;
+        size_t buffer_ring_size_ = 0;
+        char* buffers_ = nullptr;
+        uint16_t buffer_tail_ = 0;
+        // Buffers handed out by the last Wait(), returned by the next one.
+        std::vector<uint16_t> used_buffers_;
+        std::vector<Completion> completions_;
+        std::vector<std::unique_ptr<PendingSend>> sends_;
+        std::vector<uint32_t> free_sends_;
+        EpollEventLoop epoll_;
+        bool epoll_polled_ = false;
+        bool epoll_ready_ = false;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_URING_EVENT_LOOP_H_
@@ -0,0 +1,96 @@
+#ifndef CHATTER_WIRE_FORMAT_H_
+#define CHATTER_WIRE_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace chatter {
+
+// Little-endian integers and length-prefixed strings, for the binary
+// formats spoken between chatter processes and to binary-mode clients.
+inline void PutU32(std::string& out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+inline void PutU64(std::string& out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+inline void PutString(std::string& out, std::string_view value)
+{
+    PutU32(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+class WireReader
+{
+    public:
+        WireReader(const char* data, size_t size) : data_(data), end_(data + size) { }
+        bool GetU8(uint8_t& value)
+        {
+            if (end_ == data_)
+            {
+                return false;
+            }
+            value = static_cast<uint8_t>(*data_++);
+            return true;
+        }
+        bool GetU32(uint32_t& value) { return GetInteger(value, 4); }
+        bool GetU64(uint64_t& value) { return GetInteger(value, 8); }
+        bool GetString(std::string& value)
+        {
+            uint32_t size;
+            if (!GetU32(size) || static_cast<size_t>(end_ - data_) < size)
+            {
+                return false;
+            }
+            value.assign(data_, size);
+            data_ += size;
+            return true;
+        }
+        // Like GetString(), but the view points into the buffer being read.
+        bool GetView(std::string_view& value)
+        {
+            uint32_t size;
+            if (!GetU32(size) || static_cast<size_t>(end_ - data_) < size)
+            {
+                return false;
+            }
+            value = std::string_view(data_, size);
+            data_ += size;
+            return true;
+        }
+        bool AtEnd() const { return data_ == end_; }
+    private:
+        template<typename T>
+        bool GetInteger(T& value, size_t size)
+        {
+            if (static_cast<size_t>(end_ - data_) < size)
+            {
+                return false;
+            }
+            value = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                value |= static_cast<T>(static_cast<uint8_t>(data_[i])) << (8 * i);
+            }
+            data_ += size;
+            return true;
+        }
+        const char* data_;
+        const char* end_;
+};
+
+} // namespace chatter
+
+#endif // CHATTER_WIRE_FORMAT_H_